@@ -1,29 +1,60 @@
 /* comgen - Natural language to bash command generator */
+#ifdef __linux__
+#define _GNU_SOURCE /* tee, splice */
+#endif
 #ifdef _WIN32
 #include <lmcons.h>
 #include <windows.h>
 #include <winhttp.h>
 #else
+#include <arpa/inet.h>
 #include <curl/curl.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <readline/history.h>
 #include <readline/readline.h>
+#include <signal.h>
+#include <spawn.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <sys/un.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #endif
+#include <dirent.h>
+#include <ctype.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
 #endif
 
 /* Constants */
 #define DEFAULT_MODEL "claude-sonnet-4-20250514"
 #define MAX_RESPONSE_CHUNK 4096
+#define SNAPSHOT_VERSION 1
+#define LS_MAX_ENTRIES 50
+#define LS_MAX_NAMES 200000
 
 /* ANSI colors */
 #define C_RESET "\033[0m"
@@ -48,6 +79,11 @@ typedef struct {
 #endif
 } ComgenSession;
 
+/* Non-interactive (comgen "prompt"): stdout carries only the command */
+static int oneshot;
+/* --api: always ask the model, even when an offline intent matches */
+static int force_api;
+
 /* Dynamic String Buffer */
 typedef struct {
   char *data;
@@ -70,10 +106,7 @@ static void sb_free(StringBuffer *sb) {
   sb->cap = 0;
 }
 
-static void sb_append(StringBuffer *sb, const char *str) {
-  if (!str)
-    return;
-  size_t len = strlen(str);
+static void sb_append_n(StringBuffer *sb, const char *str, size_t len) {
   if (sb->len + len >= sb->cap) {
     size_t new_cap = sb->cap * 2 + len;
     char *new_data = realloc(sb->data, new_cap);
@@ -87,6 +120,24 @@ static void sb_append(StringBuffer *sb, const char *str) {
   sb->data[sb->len] = '\0';
 }
 
+static void sb_append(StringBuffer *sb, const char *str) {
+  if (!str)
+    return;
+  sb_append_n(sb, str, strlen(str));
+}
+
+/* FNV-1a: cheap, stable across runs, good enough for tables and cache keys */
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t h) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
 /* Global Context - managed dynamically now, but kept in struct for organization
  */
 typedef struct {
@@ -94,19 +145,134 @@ typedef struct {
   char user[64];
   char os[256];
   char shell[128];
-  char *ls_output; /* Dynamic */
+  char workspace[480]; /* Build systems/languages/targets, empty if none */
+  char *ls_output;     /* Owned by the files probe */
 } EnvContext;
 
 static EnvContext env_ctx;
 
-static void gather_context(void) {
+/* Per-request context for generate_command and the cache in front of it.
+ * The CLI, REPL and daemon answer for this process: env_ctx plus probe,
+ * path and history facts. comgen serve answers for the client that sent
+ * the request, from its own EnvContext, so concurrent requests share
+ * nothing mutable. */
+typedef struct {
+  const EnvContext *env;
+  int local; /* Add this process's probe, path and history facts */
+  int quiet; /* No progress or token usage output */
+  void (*stream_fn)(const char *text, size_t len, void *arg);
+  void *stream_arg;
+  int prio;      /* PRIO_*: scheduling class of the API call */
+  uint64_t user; /* Fair-queueing identity, 0 for this process */
+  int ephemeral; /* comgen serve's clients: own key space, memory only */
+  size_t request_bytes; /* Out: API request body size */
+  char error[160];      /* Out: why no answer (e.g. shed), or empty */
+} GenRequest;
+
+/* A request answered for this process, interactively */
+static void local_request(GenRequest *req) {
+  memset(req, 0, sizeof(*req));
+  req->env = &env_ctx;
+  req->local = 1;
+}
+
+static void get_config_file(char *buf, size_t size, const char *name);
+static int ensure_config_dir(void);
+static void append_probe_context(StringBuffer *sb);
+static void append_history_context(StringBuffer *sb, const char *prompt);
+
+/* Monotonic clock in milliseconds, for startup/phase timing */
+static double now_ms(void) {
 #ifdef _WIN32
-  if (!GetCurrentDirectory(sizeof(env_ctx.cwd), env_ctx.cwd))
-    strcpy(env_ctx.cwd, ".");
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/* Identity: user/os facts rarely change, so they are detected once per
+ * process and (on POSIX) cached in a startup snapshot in the config dir,
+ * revalidated against /etc/os-release mtime and uid */
+static struct {
+  char user[64];
+  char os[256];
+} identity;
+static int snapshot_hit;
+
+#ifndef _WIN32
+
+static int load_snapshot(time_t os_mtime, uid_t uid) {
+  char path[1024];
+  get_config_file(path, sizeof(path), "snapshot");
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+
+  int version = 0;
+  long long snap_mtime = -1, snap_uid = -1;
+  char user[sizeof(identity.user)] = {0};
+  char os[sizeof(identity.os)] = {0};
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    char *eq = strchr(line, '=');
+    if (!eq)
+      continue;
+    *eq = 0;
+    char *val = eq + 1;
+    val[strcspn(val, "\r\n")] = 0;
+
+    if (strcmp(line, "version") == 0)
+      version = atoi(val);
+    else if (strcmp(line, "uid") == 0)
+      snap_uid = atoll(val);
+    else if (strcmp(line, "os_release_mtime") == 0)
+      snap_mtime = atoll(val);
+    else if (strcmp(line, "user") == 0)
+      strncpy(user, val, sizeof(user) - 1);
+    else if (strcmp(line, "os") == 0)
+      strncpy(os, val, sizeof(os) - 1);
+  }
+  fclose(fp);
+
+  if (version != SNAPSHOT_VERSION || snap_uid != (long long)uid ||
+      snap_mtime != (long long)os_mtime || !user[0] || !os[0])
+    return 0;
+
+  memcpy(identity.user, user, sizeof(identity.user));
+  memcpy(identity.os, os, sizeof(identity.os));
+  return 1;
+}
+
+static void save_snapshot(time_t os_mtime, uid_t uid) {
+  if (!ensure_config_dir())
+    return;
 
-  DWORD len = sizeof(env_ctx.user);
-  if (!GetUserName(env_ctx.user, &len))
-    strcpy(env_ctx.user, "user");
+  char path[1024], tmp[1100];
+  get_config_file(path, sizeof(path), "snapshot");
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  /* Write-then-rename so concurrent launches never read a torn file */
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+    return;
+  fprintf(fp, "version=%d\nuid=%lld\nos_release_mtime=%lld\nuser=%s\nos=%s\n",
+          SNAPSHOT_VERSION, (long long)uid, (long long)os_mtime, identity.user,
+          identity.os);
+  if (fclose(fp) != 0 || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+#endif
+
+static void detect_identity(void) {
+#ifdef _WIN32
+  DWORD len = sizeof(identity.user);
+  if (!GetUserName(identity.user, &len))
+    strcpy(identity.user, "user");
 
   /* Advanced Windows Version Detection via Registry */
   HKEY hKey;
@@ -125,82 +291,79 @@ static void gather_context(void) {
       RegQueryValueExA(hKey, "CurrentBuild", NULL, NULL, (LPBYTE)build, &b_len);
 
       if (strlen(build) > 0)
-        snprintf(env_ctx.os, sizeof(env_ctx.os), "%s (Build %s)", product,
+        snprintf(identity.os, sizeof(identity.os), "%s (Build %s)", product,
                  build);
       else
-        snprintf(env_ctx.os, sizeof(env_ctx.os), "%s", product);
+        snprintf(identity.os, sizeof(identity.os), "%s", product);
       found_ver = 1;
     }
     RegCloseKey(hKey);
   }
 
   if (!found_ver)
-    strcpy(env_ctx.os, "Windows");
+    strcpy(identity.os, "Windows");
+#else
+  struct stat os_st;
+  time_t os_mtime = stat("/etc/os-release", &os_st) == 0 ? os_st.st_mtime : 0;
+  uid_t uid = getuid();
+  snapshot_hit = load_snapshot(os_mtime, uid);
+  if (!snapshot_hit) {
+    struct passwd *pw = getpwuid(uid);
+    strncpy(identity.user, pw ? pw->pw_name : "user",
+            sizeof(identity.user) - 1);
 
-  const char *comspec = getenv("COMSPEC");
-  strncpy(env_ctx.shell, comspec ? comspec : "cmd", sizeof(env_ctx.shell) - 1);
-#else
-  if (!getcwd(env_ctx.cwd, sizeof(env_ctx.cwd)))
-    strcpy(env_ctx.cwd, ".");
-
-  struct passwd *pw = getpwuid(getuid());
-  strncpy(env_ctx.user, pw ? pw->pw_name : "user", sizeof(env_ctx.user) - 1);
-
-  /* Advanced Linux Distro Detection */
-  int found_distro = 0;
-  FILE *os_release = fopen("/etc/os-release", "r");
-  if (os_release) {
-    char line[256];
-    while (fgets(line, sizeof(line), os_release)) {
-      if (strncmp(line, "PRETTY_NAME=", 12) == 0) {
-        char *start = line + 12;
-        char *end = start + strlen(start);
-        /* Trim trailing newline/whitespace */
-        while (end > start &&
-               (*end == '\0' || *end == '\n' || *end == '\r' || *end == ' '))
-          end--;
-        if (*end != '\0' && *end != '"')
-          *(end + 1) = '\0'; /* Null terminate after last char */
-        else
-          *end = '\0'; /* Quote or null handling */
+    /* Advanced Linux Distro Detection */
+    int found_distro = 0;
+    FILE *os_release = fopen("/etc/os-release", "r");
+    if (os_release) {
+      char line[256];
+      while (fgets(line, sizeof(line), os_release)) {
+        if (strncmp(line, "PRETTY_NAME=", 12) == 0) {
+          char *start = line + 12;
+          char *end = start + strlen(start);
+          /* Trim trailing newline/whitespace */
+          while (end > start &&
+                 (*end == '\0' || *end == '\n' || *end == '\r' || *end == ' '))
+            end--;
+          if (*end != '\0' && *end != '"')
+            *(end + 1) = '\0'; /* Null terminate after last char */
+          else
+            *end = '\0'; /* Quote or null handling */
 
-        /* Remove quotes */
-        if (*start == '"')
-          start++;
-        char *quote_end = strrchr(start, '"');
-        if (quote_end)
-          *quote_end = '\0';
+          /* Remove quotes */
+          if (*start == '"')
+            start++;
+          char *quote_end = strrchr(start, '"');
+          if (quote_end)
+            *quote_end = '\0';
 
-        strncpy(env_ctx.os, start, sizeof(env_ctx.os) - 1);
-        found_distro = 1;
-        break;
+          strncpy(identity.os, start, sizeof(identity.os) - 1);
+          found_distro = 1;
+          break;
+        }
       }
+      fclose(os_release);
     }
-    fclose(os_release);
-  }
 
-  if (!found_distro) {
-    struct utsname uts;
-    if (uname(&uts) == 0)
-      snprintf(env_ctx.os, sizeof(env_ctx.os), "%s %s", uts.sysname,
-               uts.release);
-    else
-      strcpy(env_ctx.os, "Linux");
-  }
+    if (!found_distro) {
+      struct utsname uts;
+      if (uname(&uts) == 0)
+        snprintf(identity.os, sizeof(identity.os), "%s %s", uts.sysname,
+                 uts.release);
+      else
+        strcpy(identity.os, "Linux");
+    }
 
-  const char *shell = getenv("SHELL");
-  /* Extract just the shell name for brevity (e.g. /bin/bash -> bash) */
-  if (shell) {
-    char *p = strrchr(shell, '/');
-    strncpy(env_ctx.shell, p ? p + 1 : shell, sizeof(env_ctx.shell) - 1);
-  } else {
-    strcpy(env_ctx.shell, "bash");
+    save_snapshot(os_mtime, uid);
   }
 #endif
 }
 
 /* Optimized Prompt Building */
-static char *build_system_prompt(void) {
+/* extra: per-request "|Key:value" facts (paths named in the prompt, data
+ * file schemas), may be NULL */
+static char *build_system_prompt(const GenRequest *req, const char *extra) {
+  const EnvContext *env = req->env;
   StringBuffer sb;
   sb_init(&sb);
 
@@ -211,603 +374,9206 @@ static char *build_system_prompt(void) {
       "command text.Failure:\"ERROR:reason\".Ctx:");
 
   char buf[2048];
-  snprintf(buf, sizeof(buf), "OS:%s|Shell:%s|User:%s|CWD:%s", env_ctx.os,
-           env_ctx.shell, env_ctx.user, env_ctx.cwd);
+  snprintf(buf, sizeof(buf), "OS:%s|Shell:%s|User:%s|CWD:%s", env->os,
+           env->shell, env->user, env->cwd);
   sb_append(&sb, buf);
 
-  if (env_ctx.ls_output) {
-    sb_append(&sb, "|Files:");
-    sb_append(&sb, env_ctx.ls_output);
-  }
+  /* Project, git, container, venv, file list... */
+  if (req->local)
+    append_probe_context(&sb);
+
+  if (extra)
+    sb_append(&sb, extra);
 
   return sb.data; /* Caller must free */
 }
 
-static void capture_ls_output(void) {
-  if (env_ctx.ls_output)
-    free(env_ctx.ls_output);
+/* Filename Compression: collapses numbered runs (img_0001.png ...) into
+ * one pattern per prefix/suffix pair. One hash pass, so linear in names. */
+typedef struct {
+  const char *name; /* First member, supplies prefix/suffix text */
+  size_t prefix_len;
+  size_t suffix_off;
+  unsigned long long min, max;
+  size_t min_width, max_width;
+  size_t count;
+} NameGroup;
+
+/* Finds the last digit run; returns 0 when there is none (or it overflows) */
+static int split_numeric(const char *name, size_t *start, size_t *end,
+                         unsigned long long *value) {
+  size_t len = strlen(name);
+  size_t e = len;
+  while (e > 0 && !(name[e - 1] >= '0' && name[e - 1] <= '9'))
+    e--;
+  if (e == 0)
+    return 0;
+  size_t b = e;
+  while (b > 0 && name[b - 1] >= '0' && name[b - 1] <= '9')
+    b--;
+  if (e - b > 18)
+    return 0;
+
+  unsigned long long v = 0;
+  for (size_t i = b; i < e; i++)
+    v = v * 10 + (unsigned long long)(name[i] - '0');
+  *start = b;
+  *end = e;
+  *value = v;
+  return 1;
+}
+
+static int group_matches(const NameGroup *g, const char *name, size_t b,
+                         size_t e) {
+  const char *g_suffix = g->name + g->suffix_off;
+  return g->prefix_len == b && memcmp(g->name, name, b) == 0 &&
+         strcmp(g_suffix, name + e) == 0;
+}
 
+/* Returns a comma-joined list of at most max_entries entries; *total gets
+ * the entry count before the budget was applied */
+static char *compress_filenames(char **names, size_t n, size_t max_entries,
+                                size_t *total) {
   StringBuffer sb;
   sb_init(&sb);
+  *total = 0;
+
+  size_t table_size = 16;
+  while (table_size < n * 2)
+    table_size <<= 1;
+  size_t *table = malloc(table_size * sizeof(size_t)); /* group idx + 1 */
+  NameGroup *groups = malloc((n ? n : 1) * sizeof(NameGroup));
+  size_t *owner = malloc((n ? n : 1) * sizeof(size_t)); /* name -> group+1 */
+  if (!table || !groups || !owner) {
+    free(table);
+    free(groups);
+    free(owner);
+    return sb.data;
+  }
+  memset(table, 0, table_size * sizeof(size_t));
+
+  size_t n_groups = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t b, e;
+    unsigned long long v;
+    owner[i] = 0;
+    if (!split_numeric(names[i], &b, &e, &v))
+      continue;
+
+    uint64_t h = hash_bytes(names[i], b, HASH_SEED);
+    h = hash_bytes(names[i] + e, strlen(names[i] + e), h ^ 0xff);
+    size_t slot = (size_t)h & (table_size - 1);
+    while (table[slot] &&
+           !group_matches(&groups[table[slot] - 1], names[i], b, e))
+      slot = (slot + 1) & (table_size - 1);
+
+    if (!table[slot]) {
+      NameGroup *g = &groups[n_groups];
+      g->name = names[i];
+      g->prefix_len = b;
+      g->suffix_off = e;
+      g->min = g->max = v;
+      g->min_width = g->max_width = e - b;
+      g->count = 0;
+      table[slot] = ++n_groups;
+    }
+    NameGroup *g = &groups[table[slot] - 1];
+    if (v < g->min)
+      g->min = v;
+    if (v > g->max)
+      g->max = v;
+    if (e - b < g->min_width)
+      g->min_width = e - b;
+    if (e - b > g->max_width)
+      g->max_width = e - b;
+    g->count++;
+    owner[i] = table[slot];
+  }
+
+  /* Emit in listing order; a group is printed where its first member was */
+  size_t entries = 0;
+  for (size_t i = 0; i < n; i++) {
+    const NameGroup *g = owner[i] ? &groups[owner[i] - 1] : NULL;
+    if (g && g->count >= 3 && g->name != names[i])
+      continue;
+    if (entries++ >= max_entries)
+      continue;
+
+    char buf[1400];
+    if (g && g->count >= 3) {
+      int width = g->min_width == g->max_width ? (int)g->min_width : 0;
+      snprintf(buf, sizeof(buf), "%.*s[%0*llu-%0*llu]%s (%zu files)",
+               (int)g->prefix_len, g->name, width, g->min, width, g->max,
+               g->name + g->suffix_off, g->count);
+    } else {
+      snprintf(buf, sizeof(buf), "%s", names[i]);
+    }
+    if (entries > 1)
+      sb_append(&sb, ",");
+    sb_append(&sb, buf);
+  }
+  *total = entries;
+
+  free(table);
+  free(groups);
+  free(owner);
+  return sb.data;
+}
 
+/* Compressed, budgeted listing of the CWD; note gets a short summary */
+static char *list_files(char *note, size_t note_size) {
 #ifdef _WIN32
   FILE *fp = _popen("dir /B /A-D", "r"); /* Files only, bare format */
 #else
   /* Compact list: names only, one per line (efficient for tokenizer than
-   * columnar) */
-  /* Using ls -p to mark dirs with /, grep -v / to filter dirs? No, let's keep
-     it simple. ls -1A = one column, almost all. */
+   * columnar). ls -1A = one column, almost all, sorted. */
   FILE *fp = popen("ls -1A", "r");
 #endif
   if (!fp) {
-    printf(C_RED "ls failed" C_RESET "\n");
-    return;
+    snprintf(note, note_size, "ls failed");
+    return NULL;
   }
 
+  /* Read the whole listing (bounded) so runs can be compressed before the
+   * entry budget is applied */
+  size_t n = 0, cap = 256;
+  char **names = malloc(cap * sizeof(char *));
   char chunk[1024];
-  size_t count = 0;
-  /* Limit capture to avoid blowing up context */
-  while (fgets(chunk, sizeof(chunk), fp) && count < 50) {
-    /* Replace newline with comma for token efficiency?
-       Actually newlines are fine, but comma-space is often slightly fewer
-       tokens for lists in LLMs? Let's stick to simple list but maybe trim
-       whitespace. */
-    size_t len = strlen(chunk);
-    if (len > 0 && chunk[len - 1] == '\n')
-      chunk[len - 1] = '\0';
-    if (count > 0)
-      sb_append(&sb, ",");
-    sb_append(&sb, chunk);
-    count++;
+  while (names && fgets(chunk, sizeof(chunk), fp) && n < LS_MAX_NAMES) {
+    chunk[strcspn(chunk, "\r\n")] = '\0';
+    if (n == cap) {
+      char **grown = realloc(names, cap * 2 * sizeof(char *));
+      if (!grown)
+        break;
+      names = grown;
+      cap *= 2;
+    }
+    if (!(names[n] = strdup(chunk)))
+      break;
+    n++;
   }
-  if (count >= 50)
-    sb_append(&sb, ",...");
+  int truncated = n >= LS_MAX_NAMES;
 
 #ifdef _WIN32
   _pclose(fp);
 #else
   pclose(fp);
 #endif
+  if (!names)
+    return NULL;
 
-  env_ctx.ls_output = sb.data;
-  printf(C_DIM "Captured file list (%zu chars)" C_RESET "\n", sb.len);
-}
-
-/* JSON Escape & Utils */
-static char *json_escape(const char *src) {
-  if (!src)
-    return strdup("");
+  size_t entries;
   StringBuffer sb;
-  sb_init(&sb);
+  sb.data = compress_filenames(names, n, LS_MAX_ENTRIES, &entries);
+  sb.len = sb.data ? strlen(sb.data) : 0;
+  sb.cap = sb.len + 1;
+  /* Mark the list as partial when the budget or read cap dropped entries */
+  if (entries > LS_MAX_ENTRIES || truncated)
+    sb_append(&sb, ",...");
 
-  for (const char *p = src; *p; p++) {
-    if (*p == '"' || *p == '\\') {
-      sb_append(&sb, "\\");
-      char c[2] = {*p, 0};
-      sb_append(&sb, c);
-    } else if (*p == '\n') {
-      sb_append(&sb, "\\n");
-    } else if (*p == '\r') {
-      sb_append(&sb, "\\r");
-    } else if (*p == '\t') {
-      sb_append(&sb, "\\t");
-    } else {
-      char c[2] = {*p, 0};
-      sb_append(&sb, c);
-    }
-  }
+  for (size_t i = 0; i < n; i++)
+    free(names[i]);
+  free(names);
+
+  snprintf(note, note_size, "%zu names, %zu entries, %zu chars", n, entries,
+           sb.len);
   return sb.data;
 }
 
-static char *extract_content(const char *json) {
-  const char *marker = "\"text\":";
-  const char *p = strstr(json, marker);
-  if (!p)
-    return NULL;
-
-  p = strchr(p + strlen(marker), '"');
-  if (!p)
+/* Bounded substring search (memmem is not portable) */
+static const char *mem_find(const char *hay, size_t n, const char *needle) {
+  size_t m = strlen(needle);
+  if (m == 0 || m > n)
     return NULL;
-  p++; /* Skip opening quote */
-
-  StringBuffer sb;
-  sb_init(&sb);
+  for (size_t i = 0; i + m <= n; i++)
+    if (hay[i] == needle[0] && memcmp(hay + i, needle, m) == 0)
+      return hay + i;
+  return NULL;
+}
 
-  while (*p) {
-    if (*p == '"' && *(p - 1) != '\\')
-      break; /* End of string */
+/* Memory-mapped files (read-only). Windows reads into the heap instead. */
+typedef struct {
+  char *data;
+  size_t size;
+} MappedFile;
 
-    if (*p == '\\') {
-      p++;
-      if (*p == 'n')
-        sb_append(&sb, "\n");
-      else if (*p == 't')
-        sb_append(&sb, "\t");
-      else if (*p == 'r')
-        sb_append(&sb, "\r");
-      else if (*p) {
-        char c[2] = {*p, 0};
-        sb_append(&sb, c);
-      }
-    } else {
-      char c[2] = {*p, 0};
-      sb_append(&sb, c);
-    }
-    p++;
+static int map_file(const char *path, MappedFile *m) {
+  m->data = NULL;
+  m->size = 0;
+#ifdef _WIN32
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return 0;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size <= 0 || !(m->data = malloc((size_t)size))) {
+    fclose(fp);
+    return 0;
   }
-  return sb.data;
+  m->size = fread(m->data, 1, (size_t)size, fp);
+  fclose(fp);
+  return 1;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return 0;
+  }
+  void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return 0;
+  m->data = p;
+  m->size = (size_t)st.st_size;
+  return 1;
+#endif
 }
 
-static void print_token_usage(const char *json) {
-  const char *p = strstr(json, "input_tokens\":");
-  int input = 0, output = 0;
-  if (p)
-    input = atoi(p + 14);
+static void unmap_file(MappedFile *m) {
+  if (!m->data)
+    return;
+#ifdef _WIN32
+  free(m->data);
+#else
+  munmap(m->data, m->size);
+#endif
+  m->data = NULL;
+  m->size = 0;
+}
 
-  p = strstr(json, "output_tokens\":");
-  if (p)
-    output = atoi(p + 15);
+/* Workspace Profiling: sniff build manifests in the CWD and summarise the
+ * build systems, languages and common targets for the system prompt */
+static const char *workspace_manifests[] = {
+    "Makefile",       "GNUmakefile", "makefile",   "CMakeLists.txt",
+    "package.json",   "Cargo.toml",  "go.mod",     "pyproject.toml",
+    "Dockerfile",
+};
+#define N_MANIFESTS (sizeof(workspace_manifests) / sizeof(*workspace_manifests))
+#define WS_SLOTS 256
+#define WS_PROBE 8
+#define WS_MAGIC 0x53574743u /* "CGWS" */
+#define WS_VERSION 1
+#define MANIFEST_HEAD (64 * 1024)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t record_size;
+} WorkspaceStoreHeader;
+
+/* Fixed-size records so the store can be mmap'd and read in place */
+typedef struct {
+  uint64_t dir_hash;
+  uint64_t dir_check; /* Second hash of the path guards against collisions */
+  uint64_t sig;       /* Manifest names + mtimes + sizes */
+  int64_t updated;
+  char profile[480];
+} WorkspaceRecord;
 
-  printf(C_DIM "Tokens: %d in, %d out" C_RESET "\n", input, output);
+/* Appends name to a comma list if absent and the list has room */
+static void list_add(char *list, size_t size, const char *name, size_t len) {
+  if (len == 0 || len > 64)
+    return;
+  size_t cur = strlen(list);
+  for (const char *p = list; *p;) {
+    const char *end = strchr(p, ',');
+    size_t item = end ? (size_t)(end - p) : strlen(p);
+    if (item == len && strncmp(p, name, len) == 0)
+      return;
+    p += item + (end ? 1 : 0);
+  }
+  if (cur + len + 2 > size)
+    return;
+  if (cur > 0)
+    list[cur++] = ',';
+  memcpy(list + cur, name, len);
+  list[cur + len] = '\0';
 }
 
-/* Network Logic */
-#ifndef _WIN32
-struct WriteContext {
-  char *data;
-  size_t len;
-};
+static size_t list_count(const char *list) {
+  if (!*list)
+    return 0;
+  size_t n = 1;
+  for (const char *p = list; *p; p++)
+    n += *p == ',';
+  return n;
+}
 
-static size_t write_cb(void *ptr, size_t size, size_t nmemb, void *data) {
-  size_t realsize = size * nmemb;
-  StringBuffer *sb = (StringBuffer *)data;
-  sb_append(sb,
-            (char *)ptr); /* sb logic needs null termination which is fine */
-  /* Actually sb_append copies and null terminates.
-     Warning: not optimal for huge binary data but fine for JSON text */
-  return realsize;
+/* Iterates lines of a bounded buffer; returns 0 at the end */
+static int next_line(const char **pos, const char *end, const char **line,
+                     size_t *len) {
+  if (*pos >= end)
+    return 0;
+  const char *nl = memchr(*pos, '\n', (size_t)(end - *pos));
+  *line = *pos;
+  *len = nl ? (size_t)(nl - *pos) : (size_t)(end - *pos);
+  *pos = nl ? nl + 1 : end;
+  return 1;
 }
-#endif
 
-static char *generate_command(ComgenSession *session, const char *prompt) {
-  char *sys_prompt = build_system_prompt();
-  char *esc_sys = json_escape(sys_prompt);
-  char *esc_prompt = json_escape(prompt);
+static int is_ident_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.' ||
+         c == '/';
+}
 
-  StringBuffer body;
-  sb_init(&body);
+static void sniff_makefile(const char *d, size_t n, char *targets, size_t cap) {
+  const char *pos = d, *end = d + n, *line;
+  size_t len;
+  while (next_line(&pos, end, &line, &len) && list_count(targets) < 8) {
+    if (len == 0 || !is_ident_char(line[0]) || line[0] == '.')
+      continue;
+    const char *colon = memchr(line, ':', len);
+    if (!colon || (colon + 1 < line + len && colon[1] == '=') ||
+        memchr(line, '=', (size_t)(colon - line)))
+      continue;
+    /* "a b: deps" declares several targets */
+    for (const char *p = line; p < colon;) {
+      while (p < colon && (*p == ' ' || *p == '\t'))
+        p++;
+      const char *w = p;
+      while (p < colon && is_ident_char(*p))
+        p++;
+      if (p < colon && *p != ' ' && *p != '\t')
+        break; /* Pattern rules, variables */
+      list_add(targets, cap, w, (size_t)(p - w));
+    }
+  }
+}
 
-  /* Construct JSON body dynamically to avoid stack buffer limits */
-  sb_append(&body, "{\"model\":\"");
-  sb_append(&body, session->model);
-  sb_append(&body, "\",\"max_tokens\":1024,\"system\":\"");
-  sb_append(&body, esc_sys);
-  sb_append(&body, "\",\"messages\":[{\"role\":\"user\",\"content\":\"");
-  sb_append(&body, esc_prompt);
-  sb_append(&body, "\"}]}");
+/* add_executable/add_library targets and project() languages */
+static void sniff_cmake(const char *d, size_t n, char *targets, size_t cap,
+                        char *langs, size_t lang_cap) {
+  const char *pos = d, *end = d + n, *line;
+  size_t len;
+  int saw_project_langs = 0;
+  while (next_line(&pos, end, &line, &len)) {
+    while (len > 0 && (*line == ' ' || *line == '\t')) {
+      line++;
+      len--;
+    }
+    const char *paren = memchr(line, '(', len);
+    if (!paren)
+      continue;
+    size_t cmd_len = (size_t)(paren - line);
+    const char *arg = paren + 1;
+    while (arg < line + len && *arg == ' ')
+      arg++;
+    const char *arg_end = arg;
+    while (arg_end < line + len && is_ident_char(*arg_end))
+      arg_end++;
 
-  free(sys_prompt);
-  free(esc_sys);
-  free(esc_prompt);
+    if ((cmd_len == 14 && strncasecmp(line, "add_executable", 14) == 0) ||
+        (cmd_len == 11 && strncasecmp(line, "add_library", 11) == 0)) {
+      list_add(targets, cap, arg, (size_t)(arg_end - arg));
+    } else if (cmd_len == 7 && strncasecmp(line, "project", 7) == 0) {
+      const char *kw = arg_end;
+      size_t rest = (size_t)(line + len - kw);
+      if (rest > 0 && mem_find(kw, rest, "CXX")) {
+        list_add(langs, lang_cap, "C++", 3);
+        saw_project_langs = 1;
+      }
+      /* Bare C: " C " or " C)" after the project name */
+      for (const char *p = kw; p + 1 < line + len; p++)
+        if (*p == ' ' && p[1] == 'C' &&
+            (p + 2 == line + len || p[2] == ' ' || p[2] == ')')) {
+          list_add(langs, lang_cap, "C", 1);
+          saw_project_langs = 1;
+        }
+    }
+  }
+  if (!saw_project_langs) {
+    list_add(langs, lang_cap, "C", 1);
+    list_add(langs, lang_cap, "C++", 3);
+  }
+}
 
-  StringBuffer response;
-  sb_init(&response);
+/* Keys of the "scripts" object in package.json */
+static void sniff_package_json(const char *d, size_t n, char *targets,
+                               size_t cap) {
+  const char *end = d + n;
+  const char *p = mem_find(d, n, "\"scripts\"");
+  if (!p)
+    return;
+  p = memchr(p, '{', (size_t)(end - p));
+  if (!p)
+    return;
+  int depth = 0, expect_key = 1;
+  for (; p < end && list_count(targets) < 8; p++) {
+    if (*p == '{') {
+      depth++;
+      expect_key = 1;
+    } else if (*p == '}') {
+      if (--depth == 0)
+        break;
+    } else if (*p == ',') {
+      expect_key = 1;
+    } else if (*p == '"') {
+      const char *s = ++p;
+      while (p < end && *p != '"')
+        p += (*p == '\\') ? 2 : 1;
+      if (p >= end)
+        break;
+      if (depth == 1 && expect_key)
+        list_add(targets, cap, s, (size_t)(p - s));
+      expect_key = 0;
+    }
+  }
+}
 
-#ifdef _WIN32
-  HINTERNET hRequest = WinHttpOpenRequest(
-      session->hConnect, L"POST", L"/v1/messages", NULL, WINHTTP_NO_REFERER,
-      WINHTTP_DEFAULT_ACCEPT_TYPES, WINHTTP_FLAG_SECURE);
+/* Keys of name = ... entries inside [section] (TOML-ish) */
+static void sniff_toml_keys(const char *d, size_t n, const char *section,
+                            char *targets, size_t cap) {
+  const char *pos = d, *end = d + n, *line;
+  size_t len, sec_len = strlen(section);
+  int in_section = 0;
+  while (next_line(&pos, end, &line, &len)) {
+    if (len > 0 && line[0] == '[') {
+      in_section = len >= sec_len && strncmp(line, section, sec_len) == 0;
+      continue;
+    }
+    if (!in_section || len == 0 || line[0] == '#')
+      continue;
+    const char *k = line;
+    while (k < line + len && is_ident_char(*k))
+      k++;
+    if (k > line && memchr(k, '=', (size_t)(line + len - k)))
+      list_add(targets, cap, line, (size_t)(k - line));
+  }
+}
 
-  if (!hRequest) {
-    sb_free(&body);
-    sb_free(&response);
-    return NULL;
+/* FROM image AS stage */
+static void sniff_dockerfile(const char *d, size_t n, char *targets,
+                             size_t cap) {
+  const char *pos = d, *end = d + n, *line;
+  size_t len;
+  while (next_line(&pos, end, &line, &len)) {
+    if (len < 5 || strncasecmp(line, "FROM ", 5) != 0)
+      continue;
+    for (const char *p = line; p + 4 <= line + len; p++) {
+      if (strncasecmp(p, " AS ", 4) == 0) {
+        const char *s = p + 4, *e = s;
+        while (e < line + len && is_ident_char(*e))
+          e++;
+        list_add(targets, cap, s, (size_t)(e - s));
+        break;
+      }
+    }
   }
+}
 
-  /* Convert API key to Wide Char safely to avoid format specifier ambiguity */
-  int key_len = MultiByteToWideChar(CP_UTF8, 0, session->api_key, -1, NULL, 0);
-  wchar_t *w_api_key = calloc(key_len, sizeof(wchar_t));
-  if (w_api_key) {
-    MultiByteToWideChar(CP_UTF8, 0, session->api_key, -1, w_api_key, key_len);
+/* Hash of which manifests exist plus their mtimes/sizes; 0 if none do */
+static uint64_t workspace_signature(void) {
+  uint64_t sig = 0;
+  for (size_t i = 0; i < N_MANIFESTS; i++) {
+    struct stat st;
+    if (stat(workspace_manifests[i], &st) != 0)
+      continue;
+    int64_t facts[3] = {(int64_t)i, (int64_t)st.st_mtime, (int64_t)st.st_size};
+    sig = hash_bytes(facts, sizeof(facts), sig ? sig : HASH_SEED);
   }
+  return sig;
+}
 
-  wchar_t headers[2048];
-  /* Use %ls for wide string which works in both MSVC and Standard C modes */
-  swprintf(headers, 2048,
-           L"Content-Type: application/json\r\n"
-           L"x-api-key: %ls\r\n"
-           L"anthropic-version: 2023-06-01\r\n",
-           w_api_key ? w_api_key : L"");
+static void profile_workspace(char *out, size_t size) {
+  char builds[512] = {0};
+  char langs[128] = {0};
+  out[0] = '\0';
 
-  if (w_api_key)
-    free(w_api_key);
+  for (size_t i = 0; i < N_MANIFESTS; i++) {
+    const char *name = workspace_manifests[i];
+    MappedFile m;
+    if (!map_file(name, &m))
+      continue;
+    size_t n = m.size < MANIFEST_HEAD ? m.size : MANIFEST_HEAD;
+    char targets[256] = {0};
+    const char *build = NULL;
 
-  BOOL bResults = WinHttpSendRequest(hRequest, headers, -1L, body.data,
-                                     (DWORD)body.len, (DWORD)body.len, 0);
+    if (strcasecmp(name, "Makefile") == 0 ||
+        strcmp(name, "GNUmakefile") == 0) {
+      if (strncmp(builds, "make", 4) == 0)
+        goto next; /* makefile vs Makefile on case-insensitive FS */
+      build = "make";
+      sniff_makefile(m.data, n, targets, sizeof(targets));
+    } else if (strcmp(name, "CMakeLists.txt") == 0) {
+      build = "cmake";
+      sniff_cmake(m.data, n, targets, sizeof(targets), langs, sizeof(langs));
+    } else if (strcmp(name, "package.json") == 0) {
+      const char *pm = mem_find(m.data, n, "\"packageManager\"");
+      size_t pm_len = pm ? (size_t)(m.data + n - pm) : 0;
+      if (pm_len > 48)
+        pm_len = 48;
+      build = pm && mem_find(pm, pm_len, "pnpm@")   ? "pnpm"
+              : pm && mem_find(pm, pm_len, "yarn@") ? "yarn"
+                                                    : "npm";
+      sniff_package_json(m.data, n, targets, sizeof(targets));
+      if (mem_find(m.data, n, "\"typescript\""))
+        list_add(langs, sizeof(langs), "TypeScript", 10);
+      else
+        list_add(langs, sizeof(langs), "JavaScript", 10);
+    } else if (strcmp(name, "Cargo.toml") == 0) {
+      build = "cargo";
+      list_add(langs, sizeof(langs), "Rust", 4);
+    } else if (strcmp(name, "go.mod") == 0) {
+      build = "go";
+      list_add(langs, sizeof(langs), "Go", 2);
+    } else if (strcmp(name, "pyproject.toml") == 0) {
+      build = mem_find(m.data, n, "[tool.poetry]") ? "poetry"
+              : mem_find(m.data, n, "hatchling")   ? "hatch"
+              : mem_find(m.data, n, "[tool.uv]")   ? "uv"
+                                                   : "pip";
+      sniff_toml_keys(m.data, n, "[project.scripts]", targets,
+                      sizeof(targets));
+      sniff_toml_keys(m.data, n, "[tool.poetry.scripts]", targets,
+                      sizeof(targets));
+      list_add(langs, sizeof(langs), "Python", 6);
+    } else if (strcmp(name, "Dockerfile") == 0) {
+      build = "docker";
+      sniff_dockerfile(m.data, n, targets, sizeof(targets));
+    }
 
-  if (bResults)
-    bResults = WinHttpReceiveResponse(hRequest, NULL);
+    if (build) {
+      size_t cur = strlen(builds);
+      snprintf(builds + cur, sizeof(builds) - cur, "%s%s%s%s%s",
+               cur ? " " : "", build, targets[0] ? "[" : "", targets,
+               targets[0] ? "]" : "");
+    }
+  next:
+    unmap_file(&m);
+  }
 
-  if (bResults) {
-    DWORD dwSize = 0, dwDownloaded = 0;
-    do {
-      dwSize = 0;
-      if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
-        break;
-      if (!dwSize)
-        break;
+  if (builds[0])
+    snprintf(out, size, "%s%s%s", builds, langs[0] ? ";Lang:" : "", langs);
+}
 
-      char *temp = malloc(dwSize + 1);
-      if (temp) {
-        ZeroMemory(temp, dwSize + 1);
-        if (WinHttpReadData(hRequest, temp, dwSize, &dwDownloaded)) {
-          sb_append(&response, temp); /* Append handles realloc */
+/* Per-directory cache of profiles in a fixed-slot, mmap-able file */
+static int workspace_store_lookup(uint64_t dir_hash, uint64_t dir_check,
+                                  uint64_t sig, char *out, size_t size) {
+  char path[1024];
+  get_config_file(path, sizeof(path), "workspaces");
+  MappedFile m;
+  if (!map_file(path, &m))
+    return 0;
+
+  int found = 0;
+  const WorkspaceStoreHeader *hdr = (const WorkspaceStoreHeader *)m.data;
+  if (m.size >= sizeof(*hdr) && hdr->magic == WS_MAGIC &&
+      hdr->version == WS_VERSION && hdr->slots == WS_SLOTS &&
+      hdr->record_size == sizeof(WorkspaceRecord) &&
+      m.size >= sizeof(*hdr) + WS_SLOTS * sizeof(WorkspaceRecord)) {
+    const WorkspaceRecord *recs =
+        (const WorkspaceRecord *)(m.data + sizeof(*hdr));
+    for (size_t i = 0; i < WS_PROBE; i++) {
+      const WorkspaceRecord *r = &recs[(dir_hash + i) % WS_SLOTS];
+      if (r->dir_hash == dir_hash && r->dir_check == dir_check) {
+        if (r->sig == sig) {
+          snprintf(out, size, "%.*s", (int)sizeof(r->profile), r->profile);
+          found = 1;
         }
-        free(temp);
+        break;
       }
-    } while (dwSize > 0);
-  } else {
-    printf(C_RED "WinHttp Error: %lu" C_RESET "\n", GetLastError());
+    }
   }
-  WinHttpCloseHandle(hRequest);
+  unmap_file(&m);
+  return found;
+}
 
-#else
-  curl_easy_setopt(session->curl, CURLOPT_POSTFIELDS, body.data);
-  curl_easy_setopt(session->curl, CURLOPT_WRITEDATA, &response);
+static void workspace_store_save(uint64_t dir_hash, uint64_t dir_check,
+                                 uint64_t sig, const char *profile) {
+  if (!ensure_config_dir())
+    return;
+  char path[1024], tmp[1100];
+  get_config_file(path, sizeof(path), "workspaces");
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
 
-  /* Reset buffer logic for curl callback */
-  /* Re-using write_cb means we assume response is empty initially */
+  WorkspaceStoreHeader hdr = {WS_MAGIC, WS_VERSION, WS_SLOTS,
+                              sizeof(WorkspaceRecord)};
+  WorkspaceRecord *recs = calloc(WS_SLOTS, sizeof(WorkspaceRecord));
+  if (!recs)
+    return;
+  FILE *fp = fopen(path, "rb");
+  WorkspaceStoreHeader cur;
+  if (fp) {
+    /* Missing or incompatible: start from a fresh zeroed store */
+    if (fread(&cur, sizeof(cur), 1, fp) != 1 ||
+        memcmp(&cur, &hdr, sizeof(hdr)) != 0 ||
+        fread(recs, sizeof(*recs), WS_SLOTS, fp) != WS_SLOTS)
+      memset(recs, 0, WS_SLOTS * sizeof(*recs));
+    fclose(fp);
+  }
 
-  CURLcode res = curl_easy_perform(session->curl);
-  if (res != CURLE_OK) {
-    fprintf(stderr, C_RED "CURL Error: %s" C_RESET "\n",
-            curl_easy_strerror(res));
+  /* Reuse this dir's slot, else the first empty, else the stalest */
+  WorkspaceRecord *best = NULL;
+  int64_t best_age = INT64_MAX;
+  for (size_t i = 0; i < WS_PROBE; i++) {
+    WorkspaceRecord *r = &recs[(dir_hash + i) % WS_SLOTS];
+    if (r->dir_hash == dir_hash && r->dir_check == dir_check) {
+      best = r;
+      break;
+    }
+    int64_t age = r->dir_hash ? r->updated : INT64_MIN;
+    if (age < best_age) {
+      best_age = age;
+      best = r;
+    }
   }
+  memset(best, 0, sizeof(*best));
+  best->dir_hash = dir_hash;
+  best->dir_check = dir_check;
+  best->sig = sig;
+  best->updated = (int64_t)time(NULL);
+  snprintf(best->profile, sizeof(best->profile), "%s", profile);
+
+  /* Write-then-rename: other processes have the store mapped, and
+   * rewriting it in place could tear their reads or fault past its end */
+  fp = fopen(tmp, "wb");
+  int ok = fp && fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+           fwrite(recs, sizeof(*recs), WS_SLOTS, fp) == WS_SLOTS;
+  if (fp)
+    ok &= fclose(fp) == 0;
+#ifdef _WIN32
+  if (ok)
+    unlink(path);
 #endif
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+  free(recs);
+}
 
-  sb_free(&body);
+/* Profile for the directory cwd (which must be the process CWD) */
+static void workspace_profile(const char *cwd, char *out, size_t size) {
+  out[0] = '\0';
+  uint64_t sig = workspace_signature();
+  if (!sig)
+    return;
 
-  if (response.len == 0) {
-    sb_free(&response);
-    return NULL;
+  size_t cwd_len = strlen(cwd);
+  uint64_t dir_hash = hash_bytes(cwd, cwd_len, HASH_SEED);
+  uint64_t dir_check = hash_bytes(cwd, cwd_len, ~HASH_SEED);
+  if (!dir_hash)
+    dir_hash = 1; /* 0 marks an empty slot */
+  if (workspace_store_lookup(dir_hash, dir_check, sig, out, size))
+    return;
+
+  profile_workspace(out, size);
+  workspace_store_save(dir_hash, dir_check, sig, out);
+}
+
+/* Worker Pool: a few detached threads shared by anything that wants to run
+ * work in the background (context probes, path scans) */
+#define POOL_THREADS 4
+#define POOL_QUEUE 64
+
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+} PoolJob;
+
+#ifndef _WIN32
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  PoolJob jobs[POOL_QUEUE];
+  size_t head, count;
+  int threads;
+} work_pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+               .ready = PTHREAD_COND_INITIALIZER};
+
+static void *pool_worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&work_pool.lock);
+    while (work_pool.count == 0)
+      pthread_cond_wait(&work_pool.ready, &work_pool.lock);
+    PoolJob job = work_pool.jobs[work_pool.head];
+    work_pool.head = (work_pool.head + 1) % POOL_QUEUE;
+    work_pool.count--;
+    pthread_mutex_unlock(&work_pool.lock);
+    job.fn(job.arg);
   }
+  return NULL;
+}
+#endif
 
-  print_token_usage(response.data);
-  char *content = extract_content(response.data);
-  sb_free(&response);
-  return content;
+/* Queues fn on the pool. Runs it inline when there is no pool (Windows,
+ * thread creation failed) or the queue is full. */
+static void pool_submit(void (*fn)(void *), void *arg) {
+#ifndef _WIN32
+  pthread_mutex_lock(&work_pool.lock);
+  while (work_pool.threads < POOL_THREADS) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, pool_worker, NULL) != 0)
+      break;
+    pthread_detach(tid);
+    work_pool.threads++;
+  }
+  if (work_pool.threads > 0 && work_pool.count < POOL_QUEUE) {
+    size_t tail = (work_pool.head + work_pool.count) % POOL_QUEUE;
+    work_pool.jobs[tail].fn = fn;
+    work_pool.jobs[tail].arg = arg;
+    work_pool.count++;
+    pthread_cond_signal(&work_pool.ready);
+    pthread_mutex_unlock(&work_pool.lock);
+    return;
+  }
+  pthread_mutex_unlock(&work_pool.lock);
+#endif
+  fn(arg);
 }
 
-/* Config Management */
-static void get_config_path(char *buf, size_t size) {
+#ifndef _WIN32
+/* Absolute CLOCK_REALTIME time ms from now, for pthread_cond_timedwait */
+static struct timespec deadline_in(double ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  long long ns = (long long)ts.tv_nsec + (long long)(ms * 1e6);
+  ts.tv_sec += (time_t)(ns / 1000000000LL);
+  ts.tv_nsec = (long)(ns % 1000000000LL);
+  return ts;
+}
+#endif
+
+/* Context Probes: every environment fact is a probe with a deadline and a
+ * result TTL. Due probes run concurrently on the worker pool; one that misses
+ * its deadline is left out of this prompt and its result, once it lands, is
+ * used next time. */
+#define PROBE_FORCED_MS 1000 /* Deadline of a forced probe (e.g. /ls) */
+#define PROBE_SETTLE_MS 500 /* Longest a setenv waits for running probes */
+
+typedef enum {
+  PROBE_IDLE,
+  PROBE_OK,
+  PROBE_CACHED,
+  PROBE_TIMEOUT,
+  PROBE_OFF
+} ProbeStatus;
+
+typedef struct {
+  const char *name;
+  const char *label; /* Prompt key for extra context; NULL for core fields */
+  char *(*run)(char *note, size_t note_size); /* malloc'd value or NULL */
+  double deadline_ms;
+  double ttl_ms;  /* <0: once per process, 0: every prompt */
+  int cwd_bound;  /* Result is stale once the CWD changes */
+  int enabled;
+  /* Shared with workers, guarded by probe_lock */
+  int running;
+  int pending; /* Submitted in the current round */
+  int force;   /* Rerun now and wait past the deadline (e.g. /ls) */
+  int landed;  /* A result is waiting in result */
+  char *result;
+  char note[64];
+  uint64_t run_cwd;
+  double started, last_ms;
+  unsigned runs, timeouts;
+  /* Main thread only */
+  char *value;
+  uint64_t value_cwd;
+  double fresh_until;
+  ProbeStatus status;
+} ContextProbe;
+
+#ifndef _WIN32
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t identity_once = PTHREAD_ONCE_INIT;
+#else
+static int identity_done;
+#endif
+static uint64_t round_cwd;
+static char round_cwd_path[1024]; /* Read in place: it is one syscall */
+
+static void probes_lock(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&probe_lock);
+#endif
+}
+
+static void probes_unlock(void) {
+#ifndef _WIN32
+  pthread_mutex_unlock(&probe_lock);
+#endif
+}
+
+static void load_identity(void) {
 #ifdef _WIN32
-  const char *appdata = getenv("APPDATA");
-  if (!appdata)
-    appdata = getenv("USERPROFILE");
-  snprintf(buf, size, "%s\\comgen", appdata);
+  if (!identity_done) {
+    detect_identity();
+    identity_done = 1;
+  }
 #else
-  const char *home = getenv("HOME");
-  snprintf(buf, size, "%s/.config/comgen", home);
+  pthread_once(&identity_once, detect_identity);
 #endif
 }
 
-static int ensure_config_dir(void) {
-  char path[1024];
-  get_config_path(path, sizeof(path));
+static char *probe_user(char *note, size_t note_size) {
+  load_identity();
+  snprintf(note, note_size, "snapshot %s", snapshot_hit ? "hit" : "miss");
+  return strdup(identity.user);
+}
+
+static char *probe_os(char *note, size_t note_size) {
+  load_identity();
+  snprintf(note, note_size, "snapshot %s", snapshot_hit ? "hit" : "miss");
+  return strdup(identity.os);
+}
+
+static char *probe_shell(char *note, size_t note_size) {
+  (void)note;
+  (void)note_size;
 #ifdef _WIN32
-  return _mkdir(path) == 0 || errno == EEXIST;
+  const char *comspec = getenv("COMSPEC");
+  return strdup(comspec ? comspec : "cmd");
 #else
-  /* Try creating parent .config first just in case */
-  char parent[1024];
-  snprintf(parent, sizeof(parent), "%s/.config", getenv("HOME"));
-  mkdir(parent, 0755);
-  return mkdir(path, 0755) == 0 || errno == EEXIST;
+  const char *shell = getenv("SHELL");
+  if (!shell)
+    return strdup("bash");
+  /* Extract just the shell name for brevity (e.g. /bin/bash -> bash) */
+  const char *p = strrchr(shell, '/');
+  return strdup(p ? p + 1 : shell);
 #endif
 }
 
-static void load_config_file(ComgenSession *s) {
-  char path[1024];
-  get_config_path(path, sizeof(path));
-  strcat(path, "/config");
+static char *probe_workspace(char *note, size_t note_size) {
+  (void)note;
+  (void)note_size;
+  char cwd[1024], profile[sizeof(env_ctx.workspace)];
 #ifdef _WIN32
-  for (int i = 0; path[i]; i++)
-    if (path[i] == '/')
-      path[i] = '\\';
+  if (!GetCurrentDirectory(sizeof(cwd), cwd))
+    return NULL;
+#else
+  if (!getcwd(cwd, sizeof(cwd)))
+    return NULL;
 #endif
+  workspace_profile(cwd, profile, sizeof(profile));
+  return profile[0] ? strdup(profile) : NULL;
+}
 
-  FILE *fp = fopen(path, "r");
-  if (!fp)
-    return;
+/* Branch from .git/HEAD of the enclosing repo, without forking git */
+static char *probe_git(char *note, size_t note_size) {
+  char cwd[1024], dir[1024];
+#ifdef _WIN32
+  if (!GetCurrentDirectory(sizeof(cwd), cwd))
+    return NULL;
+#else
+  if (!getcwd(cwd, sizeof(cwd)))
+    return NULL;
+#endif
+  strcpy(dir, cwd);
 
-  char line[1024];
-  while (fgets(line, sizeof(line), fp)) {
-    char *eq = strchr(line, '=');
-    if (eq) {
-      *eq = 0;
-      char *key = line;
-      char *val = eq + 1;
-      val[strcspn(val, "\r\n")] = 0;
+  for (;;) {
+    char path[1100], line[512];
+    snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+      /* Worktrees and submodules: .git is a file pointing at the gitdir */
+      snprintf(path, sizeof(path), "%s/.git", dir);
+      FILE *link = fopen(path, "r");
+      if (link) {
+        if (fgets(line, sizeof(line), link) &&
+            strncmp(line, "gitdir: ", 8) == 0) {
+          line[strcspn(line, "\r\n")] = 0;
+          if (line[8] == '/')
+            snprintf(path, sizeof(path), "%s/HEAD", line + 8);
+          else
+            snprintf(path, sizeof(path), "%s/%s/HEAD", dir, line + 8);
+          fp = fopen(path, "r");
+        }
+        fclose(link);
+      }
+    }
 
-      if (strcmp(key, "api_key") == 0) {
-        if (s->api_key)
-          free(s->api_key);
-        s->api_key = strdup(val);
-      } else if (strcmp(key, "model") == 0) {
-        if (s->model)
-          free(s->model);
-        s->model = strdup(val);
+    if (fp) {
+      char head[512] = {0};
+      if (!fgets(head, sizeof(head), fp))
+        head[0] = '\0';
+      fclose(fp);
+      head[strcspn(head, "\r\n")] = 0;
+
+      char out[1200];
+      const char *branch = strncmp(head, "ref: refs/heads/", 16) == 0
+                               ? head + 16
+                               : NULL;
+      if (branch)
+        snprintf(out, sizeof(out), "%s", branch);
+      else
+        snprintf(out, sizeof(out), "detached@%.12s", head);
+      if (strcmp(dir, cwd) != 0) {
+        size_t len = strlen(out);
+        snprintf(out + len, sizeof(out) - len, " (root %s)", dir);
       }
+      snprintf(note, note_size, "%s", dir);
+      return strdup(out);
     }
+
+    char *slash = strrchr(dir, '/');
+#ifdef _WIN32
+    char *bslash = strrchr(dir, '\\');
+    if (bslash > slash)
+      slash = bslash;
+#endif
+    if (!slash || slash == dir)
+      return NULL;
+    *slash = '\0';
   }
-  fclose(fp);
 }
 
-static void save_config_file(const char *key, const char *model) {
-  if (!ensure_config_dir())
-    return;
-
-  char path[1024];
-  get_config_path(path, sizeof(path));
-  strcat(path, "/config");
+static char *probe_container(char *note, size_t note_size) {
+  (void)note;
+  (void)note_size;
 #ifdef _WIN32
-  for (int i = 0; path[i]; i++)
-    if (path[i] == '/')
-      path[i] = '\\';
-#endif
+  return NULL;
+#else
+  if (access("/.dockerenv", F_OK) == 0)
+    return strdup("docker");
+  if (access("/run/.containerenv", F_OK) == 0)
+    return strdup("podman");
+  const char *container = getenv("container");
+  if (container && *container)
+    return strdup(container);
 
-  FILE *fp = fopen(path, "w");
+  const char *found = NULL;
+  char buf[4096];
+  FILE *fp = fopen("/proc/1/cgroup", "r");
   if (fp) {
-    fprintf(fp, "api_key=%s\n", key);
-    if (model)
-      fprintf(fp, "model=%s\n", model);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[n] = '\0';
     fclose(fp);
-    printf(C_GREEN "Configuration saved to %s" C_RESET "\n", path);
-  } else {
-    printf(C_RED "Failed to save config to %s" C_RESET "\n", path);
+    if (strstr(buf, "kubepods"))
+      found = "kubernetes";
+    else if (strstr(buf, "docker"))
+      found = "docker";
+    else if (strstr(buf, "lxc"))
+      found = "lxc";
+  }
+  if (!found && (fp = fopen("/proc/version", "r"))) {
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[n] = '\0';
+    fclose(fp);
+    if (strstr(buf, "microsoft") || strstr(buf, "Microsoft"))
+      found = "wsl";
   }
+  return found ? strdup(found) : NULL;
+#endif
 }
 
-/* Initialization & Cleanup */
-static int session_init(ComgenSession *s) {
-  s->api_key = NULL;
-  s->model = NULL;
+static char *probe_venv(char *note, size_t note_size) {
+  (void)note;
+  (void)note_size;
+  char out[512];
+  const char *venv = getenv("VIRTUAL_ENV");
+  const char *conda = getenv("CONDA_DEFAULT_ENV");
+  const char *nix = getenv("IN_NIX_SHELL");
+  if (venv && *venv)
+    snprintf(out, sizeof(out), "python venv %s", venv);
+  else if (conda && *conda)
+    snprintf(out, sizeof(out), "conda %s", conda);
+  else if (nix && *nix)
+    snprintf(out, sizeof(out), "nix-shell");
+  else
+    return NULL;
+  return strdup(out);
+}
 
-  /* 1. Try Config */
-  load_config_file(s);
+static char *probe_files(char *note, size_t note_size) {
+  return list_files(note, note_size);
+}
 
-  /* 2. Try Env (Override) */
-  char *env_key = getenv("ANTHROPIC_API_KEY");
-  if (env_key) {
-    if (s->api_key)
-      free(s->api_key);
-    s->api_key = strdup(env_key);
+/* Core probes fill the fixed OS/Shell/User header, and probes_start reads
+ * the CWD itself so a slow round cannot send the previous one; labelled
+ * ones are appended as |Label:value in registry order */
+static ContextProbe probes[] = {
+    {.name = "user", .run = probe_user, .deadline_ms = 100, .ttl_ms = -1,
+     .enabled = 1},
+    {.name = "os", .run = probe_os, .deadline_ms = 100, .ttl_ms = -1,
+     .enabled = 1},
+    {.name = "shell", .run = probe_shell, .deadline_ms = 20, .ttl_ms = -1,
+     .enabled = 1},
+    {.name = "workspace", .label = "Proj", .run = probe_workspace,
+     .deadline_ms = 50, .cwd_bound = 1, .enabled = 1},
+    {.name = "git", .label = "Git", .run = probe_git, .deadline_ms = 30,
+     .ttl_ms = 5000, .cwd_bound = 1, .enabled = 1},
+    {.name = "container", .label = "Container", .run = probe_container,
+     .deadline_ms = 50, .ttl_ms = -1, .enabled = 1},
+    {.name = "venv", .label = "Venv", .run = probe_venv, .deadline_ms = 10,
+     .enabled = 1},
+    /* Enabled by /ls */
+    {.name = "files", .label = "Files", .run = probe_files, .deadline_ms = 250,
+     .ttl_ms = 30000, .cwd_bound = 1},
+};
+#define N_PROBES (sizeof(probes) / sizeof(*probes))
+
+static ContextProbe *find_probe(const char *name) {
+  for (size_t i = 0; i < N_PROBES; i++)
+    if (strcmp(probes[i].name, name) == 0)
+      return &probes[i];
+  return NULL;
+}
+
+static void probe_job(void *arg) {
+  ContextProbe *p = arg;
+  char note[sizeof(p->note)] = {0};
+  double t0 = now_ms();
+  char *value = p->run(note, sizeof(note));
+  double elapsed = now_ms() - t0;
+
+  probes_lock();
+  free(p->result);
+  p->result = value;
+  memcpy(p->note, note, sizeof(note));
+  p->last_ms = elapsed;
+  p->runs++;
+  p->landed = 1;
+  p->running = 0;
+#ifndef _WIN32
+  pthread_cond_broadcast(&probe_cond);
+#endif
+  probes_unlock();
+}
+
+/* setenv calls that could not wait for the probes, as "NAME=value" or
+ * "NAME" (unset) entries, each NUL-terminated */
+static StringBuffer env_deferred;
+
+static void env_apply_deferred(void) {
+  for (size_t i = 0; i < env_deferred.len;) {
+    const char *v = env_deferred.data + i;
+    const char *eq = strchr(v, '=');
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int)(eq ? eq - v : 63), v);
+#ifndef _WIN32
+    if (eq)
+      setenv(name, eq + 1, 1);
+    else
+      unsetenv(name);
+#endif
+    i += strlen(v) + 1;
   }
+  sb_free(&env_deferred);
+}
 
-  char *env_model = getenv("COMGEN_MODEL");
-  if (env_model) {
-    if (s->model)
-      free(s->model);
-    s->model = strdup(env_model);
+/* Submits every due probe without waiting */
+static void probes_start(void) {
+  char *cwd = round_cwd_path;
+#ifdef _WIN32
+  if (!GetCurrentDirectory(sizeof(round_cwd_path), cwd))
+    strcpy(cwd, ".");
+#else
+  if (!getcwd(cwd, sizeof(round_cwd_path)))
+    strcpy(cwd, ".");
+#endif
+  round_cwd = hash_bytes(cwd, strlen(cwd), HASH_SEED);
+  double now = now_ms();
+
+  probes_lock();
+  int busy = 0;
+  for (size_t i = 0; i < N_PROBES; i++)
+    busy |= probes[i].running;
+  if (!busy && env_deferred.len) /* Idle, and none start until unlock */
+    env_apply_deferred();
+  for (size_t i = 0; i < N_PROBES; i++) {
+    ContextProbe *p = &probes[i];
+    p->pending = 0;
+    if (!p->enabled) {
+      p->status = PROBE_OFF;
+      continue;
+    }
+    if (p->running) /* Still busy from an earlier round */
+      continue;
+    int due = p->force || p->ttl_ms == 0 ||
+              (p->ttl_ms < 0 && p->runs == 0) ||
+              (p->ttl_ms > 0 && now >= p->fresh_until) ||
+              (p->cwd_bound && p->value_cwd != round_cwd);
+    if (!due) {
+      p->status = PROBE_CACHED;
+      continue;
+    }
+    p->running = 1;
+    p->pending = 1;
+    p->started = now;
+    p->run_cwd = round_cwd;
   }
+  probes_unlock();
 
-  /* Defaults */
-  if (!s->model)
-    s->model = strdup(DEFAULT_MODEL);
+  for (size_t i = 0; i < N_PROBES; i++)
+    if (probes[i].pending)
+      pool_submit(probe_job, &probes[i]);
+}
 
-  if (!s->api_key)
-    return 0;
+static void copy_probe(const char *name, char *dest, size_t size,
+                       const char *fallback) {
+  ContextProbe *p = find_probe(name);
+  if (p && p->value)
+    snprintf(dest, size, "%s", p->value);
+  else if (!dest[0])
+    snprintf(dest, size, "%s", fallback);
+}
 
-#ifdef _WIN32
-  s->hSession = WinHttpOpen(L"comgen/2.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-                            WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
-  if (!s->hSession)
-    return 0;
+/* Waits for this round's probes up to their deadlines, then commits every
+ * landed result (including late ones from earlier rounds) into env_ctx */
+static void probes_finish(void) {
+  probes_lock();
+  for (;;) {
+    double now = now_ms(), next = 0;
+    int waiting = 0;
+    for (size_t i = 0; i < N_PROBES; i++) {
+      ContextProbe *p = &probes[i];
+      if (!p->pending || !p->running)
+        continue;
+      /* From the submission, so a hung probe cannot hold startup */
+      double dl = p->started + (p->force ? PROBE_FORCED_MS : p->deadline_ms);
+      if (now < dl && (!waiting || dl < next))
+        next = dl;
+      waiting |= now < dl;
+    }
+    if (!waiting)
+      break;
+#ifndef _WIN32
+    struct timespec ts = deadline_in(next - now);
+    pthread_cond_timedwait(&probe_cond, &probe_lock, &ts);
+#endif
+  }
 
-  s->hConnect = WinHttpConnect(s->hSession, L"api.anthropic.com",
-                               INTERNET_DEFAULT_HTTPS_PORT, 0);
-  if (!s->hConnect) {
-    WinHttpCloseHandle(s->hSession);
-    return 0;
+  double now = now_ms();
+  for (size_t i = 0; i < N_PROBES; i++) {
+    ContextProbe *p = &probes[i];
+    if (p->pending && p->running) {
+      p->status = PROBE_TIMEOUT;
+      p->timeouts++;
+    }
+    if (p->landed) {
+      free(p->value);
+      p->value = p->result;
+      p->value_cwd = p->run_cwd;
+      p->result = NULL;
+      p->landed = 0;
+      p->fresh_until = now + (p->ttl_ms > 0 ? p->ttl_ms : 0);
+      p->status = PROBE_OK;
+    }
+    p->pending = 0;
+    p->force = 0;
   }
+  probes_unlock();
+
+#ifdef _WIN32
+  copy_probe("os", env_ctx.os, sizeof(env_ctx.os), "Windows");
+  copy_probe("shell", env_ctx.shell, sizeof(env_ctx.shell), "cmd");
 #else
-  s->curl = curl_easy_init();
-  if (!s->curl)
-    return 0;
+  copy_probe("os", env_ctx.os, sizeof(env_ctx.os), "Linux");
+  copy_probe("shell", env_ctx.shell, sizeof(env_ctx.shell), "bash");
+#endif
+  snprintf(env_ctx.cwd, sizeof(env_ctx.cwd), "%s", round_cwd_path);
+  copy_probe("user", env_ctx.user, sizeof(env_ctx.user), "user");
+
+  ContextProbe *ws = find_probe("workspace");
+  snprintf(env_ctx.workspace, sizeof(env_ctx.workspace), "%s",
+           ws->value && ws->value_cwd == round_cwd ? ws->value : "");
+  ContextProbe *files = find_probe("files");
+  env_ctx.ls_output =
+      files->value && files->value_cwd == round_cwd ? files->value : NULL;
+}
+
+/* Waits out probes still running, late ones from earlier rounds too, for
+ * up to PROBE_SETTLE_MS; returns whether they all finished. They read the
+ * environment (getenv, exec), so setenv callers wait here first: setenv
+ * may move environ under a concurrent reader. */
+static int probes_settle(void) {
+#ifndef _WIN32
+  struct timespec ts = deadline_in(PROBE_SETTLE_MS);
+  probes_lock();
+  for (;;) {
+    int running = 0;
+    for (size_t i = 0; i < N_PROBES; i++)
+      running |= probes[i].running;
+    if (!running)
+      break;
+    if (pthread_cond_timedwait(&probe_cond, &probe_lock, &ts) == ETIMEDOUT) {
+      probes_unlock();
+      return 0;
+    }
+  }
+  probes_unlock();
+#endif
+  return 1;
+}
+
+/* setenv (value NULL: unsetenv) when probes_settle succeeded. A hung
+ * probe must not freeze cd, so otherwise the change is queued for the
+ * next probes_start that finds the probes idle. */
+static void env_set(const char *name, const char *value, int settled) {
+  if (settled) {
+    env_apply_deferred();
+#ifndef _WIN32
+    if (value)
+      setenv(name, value, 1);
+    else
+      unsetenv(name);
+#endif
+    return;
+  }
+  if (!env_deferred.data)
+    sb_init(&env_deferred);
+  sb_append(&env_deferred, name);
+  if (value) {
+    sb_append(&env_deferred, "=");
+    sb_append(&env_deferred, value);
+  }
+  sb_append_n(&env_deferred, "", 1);
+}
+
+static void append_probe_context(StringBuffer *sb) {
+  for (size_t i = 0; i < N_PROBES; i++) {
+    const ContextProbe *p = &probes[i];
+    if (!p->label || !p->enabled || !p->value || !p->value[0] ||
+        (p->cwd_bound && p->value_cwd != round_cwd))
+      continue;
+    sb_append(sb, "|");
+    sb_append(sb, p->label);
+    sb_append(sb, ":");
+    sb_append(sb, p->value);
+  }
+}
+
+static void print_probes(void) {
+  static const char *status_names[] = {"idle", "ok", "cached", "timeout",
+                                       "off"};
+  printf(C_BOLD "%-10s %-8s %9s %9s %8s %5s %8s  %s" C_RESET "\n", "probe",
+         "status", "last", "deadline", "ttl", "runs", "timeouts", "note");
+  probes_lock();
+  for (size_t i = 0; i < N_PROBES; i++) {
+    const ContextProbe *p = &probes[i];
+    char ttl[16];
+    if (p->ttl_ms < 0)
+      strcpy(ttl, "once");
+    else if (p->ttl_ms == 0)
+      strcpy(ttl, "none");
+    else
+      snprintf(ttl, sizeof(ttl), "%.0fs", p->ttl_ms / 1000);
+    printf("%-10s %-8s %7.2fms %7.0fms %8s %5u %8u  %s\n", p->name,
+           p->running ? "running" : status_names[p->status], p->last_ms,
+           p->deadline_ms, ttl, p->runs, p->timeouts, p->note);
+  }
+  probes_unlock();
+}
+
+/* /ls: enable the file list probe and wait for a fresh scan */
+static void capture_ls_output(void) {
+  ContextProbe *p = find_probe("files");
+  p->enabled = 1;
+  p->force = 1;
+  probes_start();
+  probes_finish();
+  if (env_ctx.ls_output)
+    printf(C_DIM "Captured file list (%s)" C_RESET "\n", p->note);
+  else
+    printf(C_RED "File scan failed or timed out" C_RESET "\n");
+}
+
+/* Schema Sniffing: for data files named in the prompt, read only a bounded
+ * head (and tail) window and infer delimiter, header, columns, JSON keys and
+ * an estimated line count. Cost is independent of file size. */
+#define SCHEMA_HEAD (64 * 1024)
+#define SCHEMA_TAIL (16 * 1024)
+#define SCHEMA_SAMPLE_LINES 20
+
+typedef struct {
+  char *data; /* Copy of the requested window */
+  size_t size;
+} FileWindow;
+
+/* Copied rather than mapped: logs are appended to, rotated and truncated
+ * while we look, and a mapping would fault on pages past the new end */
+static int read_window(const char *path, unsigned long long offset,
+                       size_t len, FileWindow *w) {
+  memset(w, 0, sizeof(*w));
+  if (!(w->data = malloc(len ? len : 1)))
+    return 0;
+#ifdef _WIN32
+  FILE *fp = fopen(path, "rb");
+  if (fp && _fseeki64(fp, (long long)offset, SEEK_SET) == 0)
+    w->size = fread(w->data, 1, len, fp);
+  if (fp)
+    fclose(fp);
+#else
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  while (fd >= 0 && w->size < len) {
+    ssize_t n = pread(fd, w->data + w->size, len - w->size,
+                      (off_t)(offset + w->size));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    w->size += (size_t)n;
+  }
+  if (fd >= 0)
+    close(fd);
+#endif
+  if (w->size == 0) {
+    free(w->data);
+    w->data = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static void free_window(FileWindow *w) {
+  free(w->data);
+  w->data = NULL;
+}
+
+static const char *file_ext(const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(path, '.');
+  return dot && (!slash || dot > slash) ? dot + 1 : "";
+}
+
+static int is_number_field(const char *s, size_t len) {
+  while (len > 0 && (*s == ' ' || *s == '"')) {
+    s++;
+    len--;
+  }
+  while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '"' ||
+                     s[len - 1] == '\r'))
+    len--;
+  if (len == 0)
+    return 0;
+  size_t i = (*s == '-' || *s == '+') ? 1 : 0;
+  int digits = 0;
+  for (; i < len; i++) {
+    if (s[i] >= '0' && s[i] <= '9')
+      digits++;
+    else if (s[i] != '.' && s[i] != ',' && s[i] != 'e' && s[i] != 'E')
+      return 0;
+  }
+  return digits > 0;
+}
+
+/* Fields of one delimited line, honouring double quotes. Returns the count
+ * and fills up to max start/len pairs. */
+static size_t split_fields(const char *line, size_t len, char delim,
+                           const char **starts, size_t *lens, size_t max) {
+  size_t n = 0, field_start = 0;
+  int quoted = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i < len && line[i] == '"')
+      quoted = !quoted;
+    if (i == len || (!quoted && line[i] == delim)) {
+      if (n < max) {
+        starts[n] = line + field_start;
+        lens[n] = i - field_start;
+      }
+      n++;
+      field_start = i + 1;
+    }
+  }
+  return n;
+}
+
+/* Top-level keys of the first JSON object at or after p */
+static void json_object_keys(const char *p, const char *end, char *out,
+                             size_t size) {
+  p = memchr(p, '{', (size_t)(end - p));
+  if (!p)
+    return;
+  int depth = 0, expect_key = 1;
+  for (; p < end && list_count(out) < 16; p++) {
+    if (*p == '{' || *p == '[') {
+      depth++;
+      expect_key = *p == '{';
+    } else if (*p == '}' || *p == ']') {
+      if (--depth == 0)
+        break;
+    } else if (*p == ',') {
+      expect_key = 1;
+    } else if (*p == ':') {
+      expect_key = 0;
+    } else if (*p == '"') {
+      const char *s = ++p;
+      while (p < end && *p != '"')
+        p += (*p == '\\') ? 2 : 1;
+      if (p >= end)
+        break;
+      if (depth == 1 && expect_key)
+        list_add(out, size, s, (size_t)(p - s));
+      expect_key = 0;
+    }
+  }
+}
+
+/* Leading timestamp style of a log line */
+static const char *log_timestamp_style(const char *line, size_t len) {
+  if (len >= 19 && line[4] == '-' && line[7] == '-' &&
+      (line[10] == 'T' || line[10] == ' ') && line[13] == ':')
+    return "iso8601";
+  if (len >= 15 && line[3] == ' ' && line[6] == ' ' && line[9] == ':' &&
+      line[12] == ':')
+    return "syslog";
+  if (len >= 12 && line[0] == '[' && memchr(line, ']', len < 40 ? len : 40))
+    return "bracketed";
+  if (len >= 10 && is_number_field(line, 10))
+    return "epoch";
+  return NULL;
+}
+
+/* Writes "csv delim=',' header=a,b cols=2 lines~1000" style text into out;
+ * returns 0 when the file is not a recognised data file */
+static int sniff_schema(const char *path, unsigned long long file_size,
+                        char *out, size_t size) {
+  const char *ext = file_ext(path);
+  int is_csv = strcasecmp(ext, "csv") == 0;
+  int is_tsv = strcasecmp(ext, "tsv") == 0 || strcasecmp(ext, "tab") == 0;
+  int is_json = strcasecmp(ext, "json") == 0;
+  int is_jsonl = strcasecmp(ext, "jsonl") == 0 ||
+                 strcasecmp(ext, "ndjson") == 0;
+  int is_log = strcasecmp(ext, "log") == 0;
+  if (!(is_csv || is_tsv || is_json || is_jsonl || is_log) || file_size == 0)
+    return 0;
+
+  FileWindow head;
+  size_t head_len =
+      file_size < SCHEMA_HEAD ? (size_t)file_size : (size_t)SCHEMA_HEAD;
+  if (!read_window(path, 0, head_len, &head))
+    return 0;
+  const char *end = head.data + head.size;
+  int whole = file_size <= SCHEMA_HEAD;
+
+  /* Sample lines and a line count estimate from the head */
+  const char *lines[SCHEMA_SAMPLE_LINES];
+  size_t line_lens[SCHEMA_SAMPLE_LINES];
+  size_t n_lines = 0, head_lines = 0, consumed = 0;
+  const char *pos = head.data, *line;
+  size_t len;
+  while (next_line(&pos, end, &line, &len)) {
+    if (!whole && line + len == end)
+      break; /* Cut off by the window */
+    if (n_lines < SCHEMA_SAMPLE_LINES && len > 0) {
+      lines[n_lines] = line;
+      line_lens[n_lines++] = len;
+    }
+    head_lines++;
+    consumed = (size_t)(pos - head.data);
+  }
+  char lines_s[32];
+  if (whole)
+    snprintf(lines_s, sizeof(lines_s), "lines=%zu", head_lines);
+  else if (head_lines > 0)
+    snprintf(lines_s, sizeof(lines_s), "lines~%llu",
+             file_size * head_lines / (unsigned long long)consumed);
+  else
+    snprintf(lines_s, sizeof(lines_s), "lines=?");
+
+  /* JSONL logs are common; treat {-prefixed .log files as JSONL */
+  if (is_log && n_lines > 0 && lines[0][0] == '{') {
+    is_log = 0;
+    is_jsonl = 1;
+  }
+
+  if (is_json || is_jsonl) {
+    char keys[256] = {0};
+    const char *p = head.data;
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+      p++;
+    json_object_keys(p, end, keys, sizeof(keys));
+    const char *kind = is_jsonl ? "jsonl"
+                       : (p < end && *p == '[') ? "json array of objects"
+                                                : "json object";
+    snprintf(out, size, "%s keys=%s%s%s", kind, keys[0] ? keys : "?",
+             is_jsonl ? " " : "", is_jsonl ? lines_s : "");
+    free_window(&head);
+    return 1;
+  }
+
+  if (is_log) {
+    const char *style = n_lines ? log_timestamp_style(lines[0], line_lens[0])
+                                : NULL;
+    char levels[64] = {0};
+    static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG",
+                                        "FATAL", "TRACE"};
+    for (size_t i = 0; i < n_lines; i++)
+      for (size_t l = 0; l < sizeof(level_names) / sizeof(*level_names); l++)
+        if (mem_find(lines[i], line_lens[i], level_names[l]))
+          list_add(levels, sizeof(levels), level_names[l],
+                   strlen(level_names[l]));
+    snprintf(out, size, "log ts=%s levels=%s %s", style ? style : "none",
+             levels[0] ? levels : "none", lines_s);
+
+    /* The tail gives the time span without reading the middle */
+    if (style && !whole) {
+      unsigned long long off = file_size > SCHEMA_TAIL
+                                   ? file_size - SCHEMA_TAIL
+                                   : 0;
+      FileWindow tail;
+      if (read_window(path, off, (size_t)(file_size - off), &tail)) {
+        const char *t_end = tail.data + tail.size;
+        while (t_end > tail.data && (t_end[-1] == '\n' || t_end[-1] == '\r'))
+          t_end--;
+        const char *last = t_end;
+        while (last > tail.data && last[-1] != '\n')
+          last--;
+        size_t ts_len = strcmp(style, "iso8601") == 0 ? 19 : 15;
+        if ((size_t)(t_end - last) >= ts_len && n_lines > 0 &&
+            line_lens[0] >= ts_len) {
+          size_t cur = strlen(out);
+          snprintf(out + cur, size - cur, " first=%.*s last=%.*s",
+                   (int)ts_len, lines[0], (int)ts_len, last);
+        }
+        free_window(&tail);
+      }
+    }
+    free_window(&head);
+    return 1;
+  }
+
+  /* Delimited: pick the delimiter whose field count is most consistent */
+  static const char delims[] = {',', '\t', ';', '|'};
+  char delim = is_tsv ? '\t' : ',';
+  size_t best_score = 0, cols = 0;
+  const char *starts[64];
+  size_t lens[64];
+  for (size_t d = 0; d < sizeof(delims); d++) {
+    if (n_lines == 0)
+      break;
+    size_t first =
+        split_fields(lines[0], line_lens[0], delims[d], starts, lens, 64);
+    if (first < 2)
+      continue;
+    size_t agree = 0;
+    for (size_t i = 0; i < n_lines; i++)
+      agree += split_fields(lines[i], line_lens[i], delims[d], starts, lens,
+                            64) == first;
+    if (agree > best_score) {
+      best_score = agree;
+      delim = delims[d];
+      cols = first;
+    }
+  }
+
+  /* Header if row 0 has no numbers where later rows do */
+  int header = 0;
+  char header_s[256] = {0};
+  if (cols > 0 && n_lines > 1) {
+    const char *h_starts[64], *r_starts[64];
+    size_t h_lens[64], r_lens[64];
+    size_t hn = split_fields(lines[0], line_lens[0], delim, h_starts, h_lens,
+                             64);
+    size_t rn = split_fields(lines[1], line_lens[1], delim, r_starts, r_lens,
+                             64);
+    int hdr_numeric = 0, row_numeric = 0;
+    for (size_t i = 0; i < hn && i < 64; i++)
+      hdr_numeric |= is_number_field(h_starts[i], h_lens[i]);
+    for (size_t i = 0; i < rn && i < 64; i++)
+      row_numeric |= is_number_field(r_starts[i], r_lens[i]);
+    header = !hdr_numeric && (row_numeric || hn == rn);
+    for (size_t i = 0; header && i < hn && i < 16; i++) {
+      const char *f = h_starts[i];
+      size_t fl = h_lens[i];
+      while (fl > 0 && (*f == '"' || *f == ' ')) {
+        f++;
+        fl--;
+      }
+      while (fl > 0 && (f[fl - 1] == '"' || f[fl - 1] == ' ' ||
+                        f[fl - 1] == '\r'))
+        fl--;
+      size_t cur = strlen(header_s);
+      if (cur + fl + 2 >= sizeof(header_s))
+        break;
+      if (i > 0)
+        header_s[cur++] = ',';
+      memcpy(header_s + cur, f, fl > 24 ? 24 : fl);
+      header_s[cur + (fl > 24 ? 24 : fl)] = '\0';
+    }
+  }
+
+  const char *delim_s = delim == '\t'  ? "tab"
+                        : delim == ';' ? "';'"
+                        : delim == '|' ? "'|'"
+                                       : "','";
+  if (cols == 0)
+    snprintf(out, size, "%s single column %s", is_tsv ? "tsv" : "csv",
+             lines_s);
+  else if (header)
+    snprintf(out, size, "%s delim=%s cols=%zu header=%s %s",
+             is_tsv ? "tsv" : "csv", delim_s, cols, header_s, lines_s);
+  else
+    snprintf(out, size, "%s delim=%s cols=%zu no-header %s",
+             is_tsv ? "tsv" : "csv", delim_s, cols, lines_s);
+  free_window(&head);
+  return 1;
+}
+
+/* Prompt Path Analysis: path-like tokens in the request are stat'ed/scanned
+ * in parallel so the model sees what ./logs/2024 actually holds */
+#define PATH_MAX_TOKENS 8
+#define PATH_SCAN_ENTRIES 10000
+#define PATH_SCAN_DEADLINE_MS 150
+
+typedef struct {
+  char token[256]; /* As typed */
+  char path[1024]; /* ~ expanded */
+  int explicit_path; /* Starts with / ~ ./ ../: report even when missing */
+  int abandoned;     /* Caller gave up; the job frees itself */
+  int done;
+  char summary[256];
+  char schema[384]; /* Data files only */
+} PathScan;
+
+#ifndef _WIN32
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void format_size(unsigned long long bytes, char *out, size_t size) {
+  const char *units = "BKMGTP";
+  double v = (double)bytes;
+  int u = 0;
+  while (v >= 1024 && u < 5) {
+    v /= 1024;
+    u++;
+  }
+  if (u == 0)
+    snprintf(out, size, "%lluB", bytes);
+  else
+    snprintf(out, size, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+/* Compact age, e.g. 45s, 3h, 12d */
+static void format_age(long long secs, char *out, size_t size) {
+  if (secs < 0)
+    secs = 0;
+  if (secs < 120)
+    snprintf(out, size, "%llds", secs);
+  else if (secs < 7200)
+    snprintf(out, size, "%lldm", secs / 60);
+  else if (secs < 172800)
+    snprintf(out, size, "%lldh", secs / 3600);
+  else
+    snprintf(out, size, "%lldd", secs / 86400);
+}
+
+static void scan_path(PathScan *ps) {
+  struct stat st;
+  char size_s[24], age_a[24], age_b[24];
+  time_t now = time(NULL);
+
+  if (stat(ps->path, &st) != 0) {
+    snprintf(ps->summary, sizeof(ps->summary), "missing");
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    format_size((unsigned long long)st.st_size, size_s, sizeof(size_s));
+    format_age((long long)(now - st.st_mtime), age_a, sizeof(age_a));
+    snprintf(ps->summary, sizeof(ps->summary), "%s %s,age %s",
+             S_ISREG(st.st_mode) ? "file" : "special", size_s, age_a);
+    if (S_ISREG(st.st_mode))
+      sniff_schema(ps->path, (unsigned long long)st.st_size, ps->schema,
+                   sizeof(ps->schema));
+    return;
+  }
+
+  DIR *d = opendir(ps->path);
+  if (!d) {
+    snprintf(ps->summary, sizeof(ps->summary), "dir (unreadable)");
+    return;
+  }
+  unsigned long long total = 0;
+  size_t entries = 0, subdirs = 0;
+  time_t newest = 0, oldest = 0;
+  int capped = 0;
+  struct dirent *de;
+  char child[2048];
+  while ((de = readdir(d))) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if (entries >= PATH_SCAN_ENTRIES) {
+      capped = 1;
+      break;
+    }
+    entries++;
+    snprintf(child, sizeof(child), "%s/%s", ps->path, de->d_name);
+    struct stat cst;
+    if (stat(child, &cst) != 0)
+      continue;
+    if (S_ISDIR(cst.st_mode))
+      subdirs++;
+    else
+      total += (unsigned long long)cst.st_size;
+    if (!newest || cst.st_mtime > newest)
+      newest = cst.st_mtime;
+    if (!oldest || cst.st_mtime < oldest)
+      oldest = cst.st_mtime;
+  }
+  closedir(d);
+
+  format_size(total, size_s, sizeof(size_s));
+  if (entries == 0) {
+    snprintf(ps->summary, sizeof(ps->summary), "dir empty");
+    return;
+  }
+  format_age((long long)(now - newest), age_a, sizeof(age_a));
+  format_age((long long)(now - oldest), age_b, sizeof(age_b));
+  snprintf(ps->summary, sizeof(ps->summary),
+           "dir %zu%s entries (%zu subdirs),%s files,newest %s,oldest %s",
+           entries, capped ? "+" : "", subdirs, size_s, age_a, age_b);
+}
+
+static void path_scan_job(void *arg) {
+  PathScan *ps = arg;
+  scan_path(ps);
+#ifndef _WIN32
+  pthread_mutex_lock(&scan_lock);
+  if (ps->abandoned) {
+    pthread_mutex_unlock(&scan_lock);
+    free(ps);
+    return;
+  }
+  ps->done = 1;
+  pthread_cond_broadcast(&scan_cond);
+  pthread_mutex_unlock(&scan_lock);
+#else
+  ps->done = 1;
+#endif
+}
+
+static int is_stopword(const char *w) {
+  static const char *stop[] = {
+      "a",    "all",  "an",   "and",  "any",   "are",  "as",    "at",
+      "be",   "by",   "each", "every","for",   "from", "in",    "into",
+      "is",   "it",   "its",  "me",   "my",    "not",  "of",    "on",
+      "or",   "our",  "than", "that", "the",   "them", "then",  "there",
+      "these","this", "those","to",   "under", "with", "older", "newer",
+      "files","file", "here", "what", "which", "show", "list",  "find",
+  };
+  for (size_t i = 0; i < sizeof(stop) / sizeof(*stop); i++)
+    if (strcasecmp(w, stop[i]) == 0)
+      return 1;
+  return 0;
+}
+
+/* Pulls path-like tokens out of the prompt, scans them in parallel and
+ * returns "|Paths:tok=summary;...|Schema:tok=schema;..." (malloc'd) or NULL
+ * when nothing was found */
+static char *analyze_prompt_paths(const char *prompt) {
+  PathScan *scans[PATH_MAX_TOKENS];
+  size_t n = 0;
+  const char *home = getenv("HOME");
+
+  for (const char *p = prompt; *p && n < PATH_MAX_TOKENS;) {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    const char *start = p;
+    while (*p && *p != ' ' && *p != '\t')
+      p++;
+    size_t len = (size_t)(p - start);
+
+    /* Strip quotes and trailing sentence punctuation */
+    while (len > 0 && strchr("\"'`(", *start)) {
+      start++;
+      len--;
+    }
+    while (len > 0 && strchr("\"'`),.;:!?", start[len - 1]))
+      len--;
+    if (len < 2 || len >= sizeof(((PathScan *)0)->token))
+      continue;
+
+    char tok[256];
+    memcpy(tok, start, len);
+    tok[len] = '\0';
+    int explicit_path = tok[0] == '/' || tok[0] == '~' ||
+                        strncmp(tok, "./", 2) == 0 ||
+                        strncmp(tok, "../", 3) == 0;
+    if (!explicit_path && is_stopword(tok))
+      continue;
+
+    int dup = 0;
+    for (size_t i = 0; i < n; i++)
+      dup |= strcmp(scans[i]->token, tok) == 0;
+    if (dup)
+      continue;
+
+    char path[1024];
+    if (tok[0] == '~' && (tok[1] == '/' || tok[1] == '\0') && home)
+      snprintf(path, sizeof(path), "%s%s", home, tok + 1);
+    else
+      snprintf(path, sizeof(path), "%s", tok);
+
+    /* Plain words only count when they name something that exists */
+    struct stat st;
+    if (!explicit_path && stat(path, &st) != 0)
+      continue;
+
+    PathScan *ps = calloc(1, sizeof(PathScan));
+    if (!ps)
+      break;
+    memcpy(ps->token, tok, len + 1);
+    memcpy(ps->path, path, sizeof(path));
+    ps->explicit_path = explicit_path;
+    scans[n++] = ps;
+  }
+  if (n == 0)
+    return NULL;
+
+  for (size_t i = 0; i < n; i++)
+    pool_submit(path_scan_job, scans[i]);
+
+#ifndef _WIN32
+  double deadline = now_ms() + PATH_SCAN_DEADLINE_MS;
+  pthread_mutex_lock(&scan_lock);
+  for (;;) {
+    int all_done = 1;
+    for (size_t i = 0; i < n; i++)
+      all_done &= scans[i]->done;
+    double now = now_ms();
+    if (all_done || now >= deadline)
+      break;
+    struct timespec ts = deadline_in(deadline - now);
+    pthread_cond_timedwait(&scan_cond, &scan_lock, &ts);
+  }
+#endif
+
+  StringBuffer sb, schema;
+  sb_init(&sb);
+  sb_init(&schema);
+  for (size_t i = 0; i < n; i++) {
+    PathScan *ps = scans[i];
+    if (!ps->done) {
+      ps->abandoned = 1; /* Freed by the job when it finishes */
+      continue;
+    }
+    if (ps->explicit_path || strcmp(ps->summary, "missing") != 0) {
+      sb_append(&sb, sb.len > 0 ? ";" : "|Paths:");
+      sb_append(&sb, ps->token);
+      sb_append(&sb, "=");
+      sb_append(&sb, ps->summary);
+    }
+    if (ps->schema[0]) {
+      sb_append(&schema, schema.len > 0 ? ";" : "|Schema:");
+      sb_append(&schema, ps->token);
+      sb_append(&schema, "=");
+      sb_append(&schema, ps->schema);
+    }
+    free(ps);
+  }
+#ifndef _WIN32
+  pthread_mutex_unlock(&scan_lock);
+#endif
+
+  sb_append(&sb, schema.data);
+  sb_free(&schema);
+  if (sb.len == 0) {
+    sb_free(&sb);
+    return NULL;
+  }
+  return sb.data;
+}
+
+/* JSON Escape & Utils */
+/* Appends src as the inside of a JSON string in one pass. Control bytes are
+ * \u-escaped and invalid UTF-8 becomes U+FFFD so the body always parses. */
+static void sb_append_json(StringBuffer *sb, const char *src, size_t len) {
+  const unsigned char *p = (const unsigned char *)src;
+  size_t run = 0, i = 0;
+  while (i < len) {
+    unsigned char c = p[i];
+    if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+      i++;
+      continue;
+    }
+
+    char ubuf[8];
+    const char *esc;
+    if (c >= 0x80) {
+      size_t need = (c >= 0xC2 && c <= 0xDF)   ? 1
+                    : (c >= 0xE0 && c <= 0xEF) ? 2
+                    : (c >= 0xF0 && c <= 0xF4) ? 3
+                                               : 0;
+      size_t k = 1;
+      while (need && k <= need && i + k < len && (p[i + k] & 0xC0) == 0x80)
+        k++;
+      if (need && k == need + 1) {
+        i += k;
+        continue;
+      }
+      esc = "\\ufffd";
+    } else if (c == '"') {
+      esc = "\\\"";
+    } else if (c == '\\') {
+      esc = "\\\\";
+    } else if (c == '\n') {
+      esc = "\\n";
+    } else if (c == '\r') {
+      esc = "\\r";
+    } else if (c == '\t') {
+      esc = "\\t";
+    } else {
+      snprintf(ubuf, sizeof(ubuf), "\\u%04x", c);
+      esc = ubuf;
+    }
+    sb_append_n(sb, src + run, i - run);
+    sb_append(sb, esc);
+    run = ++i;
+  }
+  sb_append_n(sb, src + run, len - run);
+}
+
+/* Where the value of the first "key": lies whose object is depth levels
+ * deep (1: the top-level object, 0: any), or NULL. Keys are only matched
+ * as keys: string values, including escaped quotes, are skipped whole. */
+static const char *json_find_key(const char *json, const char *key,
+                                 int depth) {
+  size_t klen = strlen(key);
+  int d = 0;
+  for (const char *p = json; *p; p++) {
+    if (*p == '{' || *p == '[') {
+      d++;
+    } else if (*p == '}' || *p == ']') {
+      d--;
+    } else if (*p == '"') {
+      const char *s = ++p;
+      while (*p && *p != '"')
+        p += (*p == '\\' && p[1]) ? 2 : 1;
+      if (!*p)
+        return NULL;
+      const char *q = p + 1;
+      while (isspace((unsigned char)*q))
+        q++;
+      if (*q == ':' && (!depth || d == depth) && (size_t)(p - s) == klen &&
+          memcmp(s, key, klen) == 0) {
+        for (q++; isspace((unsigned char)*q); q++)
+          ;
+        return q;
+      }
+    }
+  }
+  return NULL;
+}
+
+static int hex4(const char *p, unsigned *out) {
+  unsigned v = 0;
+  for (int i = 0; i < 4; i++) {
+    int c = (unsigned char)p[i];
+    if (!isxdigit(c))
+      return 0;
+    v = v * 16 + (unsigned)(isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+  }
+  *out = v;
+  return 1;
+}
+
+static void sb_append_utf8(StringBuffer *sb, unsigned cp) {
+  char u[4];
+  size_t n;
+  if (cp < 0x80) {
+    u[0] = (char)cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    u[0] = (char)(0xc0 | cp >> 6);
+    u[1] = (char)(0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    u[0] = (char)(0xe0 | cp >> 12);
+    u[1] = (char)(0x80 | (cp >> 6 & 0x3f));
+    u[2] = (char)(0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    u[0] = (char)(0xf0 | cp >> 18);
+    u[1] = (char)(0x80 | (cp >> 12 & 0x3f));
+    u[2] = (char)(0x80 | (cp >> 6 & 0x3f));
+    u[3] = (char)(0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  sb_append_n(sb, u, n);
+}
+
+/* Value of the first "key": string in json (see json_find_key for
+ * depth), unescaped; NULL if absent, not a string or unterminated.
+ * \uXXXX escapes, surrogate pairs included, become UTF-8; \u0000 is
+ * dropped rather than cutting the string short. */
+static char *json_string_field(const char *json, const char *key,
+                               int depth) {
+  const char *p = json_find_key(json, key, depth);
+  if (!p || *p != '"')
+    return NULL;
+  p++; /* Skip opening quote */
+
+  StringBuffer sb;
+  sb_init(&sb);
+  while (*p && *p != '"') {
+    if (*p != '\\') {
+      sb_append_n(&sb, p++, 1);
+      continue;
+    }
+    char c = *++p; /* Escapes are pairs: \\ never ends the string */
+    unsigned cp, lo;
+    switch (c) {
+    case 'n':
+      c = '\n';
+      break;
+    case 't':
+      c = '\t';
+      break;
+    case 'r':
+      c = '\r';
+      break;
+    case 'b':
+      c = '\b';
+      break;
+    case 'f':
+      c = '\f';
+      break;
+    case 'u':
+      if (!hex4(p + 1, &cp))
+        goto bad;
+      p += 4;
+      if (cp >= 0xd800 && cp < 0xdc00 && p[1] == '\\' && p[2] == 'u' &&
+          hex4(p + 3, &lo) && lo >= 0xdc00 && lo < 0xe000) {
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        p += 6;
+      } else if (cp >= 0xd800 && cp < 0xe000) {
+        cp = 0xfffd; /* Unpaired surrogate */
+      }
+      if (cp)
+        sb_append_utf8(&sb, cp);
+      p++;
+      continue;
+    case '\0':
+      goto bad;
+    }
+    sb_append_n(&sb, &c, 1); /* \" \\ \/ and the above */
+    p++;
+  }
+  if (*p == '"')
+    return sb.data;
+bad:
+  sb_free(&sb);
+  return NULL;
+}
+
+static char *extract_content(const char *json) {
+  return json_string_field(json, "text", 0);
+}
+
+static void print_token_usage(const char *json) {
+  const char *p = strstr(json, "input_tokens\":");
+  int input = 0, output = 0;
+  if (p)
+    input = atoi(p + 14);
+
+  p = strstr(json, "output_tokens\":");
+  if (p)
+    output = atoi(p + 15);
+
+  fprintf(oneshot ? stderr : stdout, C_DIM "Tokens: %d in, %d out" C_RESET "\n",
+          input, output);
+}
+
+/* Attachments: a file or piped stdin summarised as bounded context. The
+ * input is streamed once; memory stays fixed however large it is. */
+#define ATTACH_HEAD_BYTES 3200
+#define ATTACH_TAIL_BYTES 2000
+#define ATTACH_SAMPLES 24
+#define ATTACH_SAMPLE_LEN 160
+#define ATTACH_LINE_MAX 1024
+#define ATTACH_SEEN_SLOTS 65536 /* Distinct-line hashes remembered */
+
+typedef struct {
+  char name[256];
+  unsigned long long bytes, lines, distinct;
+  char head[ATTACH_HEAD_BYTES];
+  size_t head_len;
+  char tail[ATTACH_TAIL_BYTES]; /* Ring */
+  size_t tail_pos;
+  int tail_wrapped;
+  char samples[ATTACH_SAMPLES][ATTACH_SAMPLE_LEN];
+  size_t n_samples;
+  uint64_t *seen; /* Open addressing; 0 = empty */
+  size_t seen_count;
+  uint64_t rng;
+  char line[ATTACH_LINE_MAX];
+  size_t line_len;
+  unsigned long long line_start; /* Byte offset of the current line */
+} Attachment;
+
+static void attachment_init(Attachment *a, const char *name) {
+  memset(a, 0, sizeof(*a));
+  snprintf(a->name, sizeof(a->name), "%s", name);
+  a->seen = calloc(ATTACH_SEEN_SLOTS, sizeof(uint64_t));
+  a->rng = 0x9e3779b97f4a7c15ULL;
+}
+
+static void attachment_free(Attachment *a) {
+  free(a->seen);
+  a->seen = NULL;
+}
+
+/* Inserts h; returns 1 if it was new (or the set is full, so unknown) */
+static int seen_insert(Attachment *a, uint64_t h) {
+  if (!a->seen || a->seen_count >= ATTACH_SEEN_SLOTS / 2)
+    return 1;
+  h |= 1;
+  size_t slot = (size_t)h & (ATTACH_SEEN_SLOTS - 1);
+  while (a->seen[slot]) {
+    if (a->seen[slot] == h)
+      return 0;
+    slot = (slot + 1) & (ATTACH_SEEN_SLOTS - 1);
+  }
+  a->seen[slot] = h;
+  a->seen_count++;
+  return 1;
+}
+
+/* Lines past the head feed a reservoir sample of distinct shapes; digit runs
+ * are folded so log lines differing only in ids/timestamps collapse */
+static void attachment_line(Attachment *a) {
+  a->lines++;
+  if (a->line_start < ATTACH_HEAD_BYTES || a->line_len == 0)
+    return;
+
+  uint64_t h = HASH_SEED;
+  int in_digits = 0;
+  for (size_t i = 0; i < a->line_len; i++) {
+    unsigned char c = (unsigned char)a->line[i];
+    int digit = c >= '0' && c <= '9';
+    if (digit && in_digits)
+      continue;
+    in_digits = digit;
+    h = (h ^ (digit ? '0' : c)) * 0x100000001b3ULL;
+  }
+  if (!seen_insert(a, h))
+    return;
+
+  a->distinct++;
+  size_t slot = a->n_samples;
+  if (a->n_samples == ATTACH_SAMPLES) {
+    a->rng ^= a->rng << 13;
+    a->rng ^= a->rng >> 7;
+    a->rng ^= a->rng << 17;
+    slot = (size_t)(a->rng % a->distinct);
+    if (slot >= ATTACH_SAMPLES)
+      return;
+  } else {
+    a->n_samples++;
+  }
+  size_t len = a->line_len < ATTACH_SAMPLE_LEN - 1 ? a->line_len
+                                                   : ATTACH_SAMPLE_LEN - 1;
+  memcpy(a->samples[slot], a->line, len);
+  a->samples[slot][len] = '\0';
+}
+
+static void attachment_feed(Attachment *a, const char *buf, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    char c = buf[i];
+    /* Keep the text printable; NULs would cut strings short */
+    if (c == '\0')
+      c = '.';
+    if (a->bytes < ATTACH_HEAD_BYTES)
+      a->head[a->head_len++] = c;
+    a->tail[a->tail_pos++] = c;
+    if (a->tail_pos == ATTACH_TAIL_BYTES) {
+      a->tail_pos = 0;
+      a->tail_wrapped = 1;
+    }
+    a->bytes++;
+
+    if (c == '\n') {
+      attachment_line(a);
+      a->line_len = 0;
+      a->line_start = a->bytes;
+    } else if (a->line_len < ATTACH_LINE_MAX) {
+      a->line[a->line_len++] = c;
+    }
+  }
+}
+
+static void attachment_finish(Attachment *a) {
+  if (a->line_len > 0)
+    attachment_line(a);
+  a->line_len = 0;
+}
+
+static int attachment_read(Attachment *a, FILE *fp) {
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    attachment_feed(a, buf, n);
+  attachment_finish(a);
+  return !ferror(fp);
+}
+
+/* Appends the attachment to a JSON string being built, escaping in place */
+static void attachment_render_json(const Attachment *a, StringBuffer *body) {
+  char size_s[24], info[512];
+  format_size(a->bytes, size_s, sizeof(size_s));
+  int complete = a->bytes <= ATTACH_HEAD_BYTES;
+  snprintf(info, sizeof(info), "\n\n[Input %s: %llu lines, %s%s]\n", a->name,
+           a->lines, size_s,
+           complete ? "" : "; head, distinct line sample and tail shown");
+  sb_append_json(body, info, strlen(info));
+
+  if (complete) {
+    sb_append_json(body, a->head, a->head_len);
+    return;
+  }
+
+  /* Head up to its last full line */
+  size_t head_len = a->head_len;
+  while (head_len > 0 && a->head[head_len - 1] != '\n')
+    head_len--;
+  sb_append_json(body, "--- head ---\n", 13);
+  sb_append_json(body, a->head, head_len);
+
+  if (a->n_samples > 0) {
+    snprintf(info, sizeof(info), "--- sample (%zu of ~%llu distinct) ---\n",
+             a->n_samples, a->distinct);
+    sb_append_json(body, info, strlen(info));
+    for (size_t i = 0; i < a->n_samples; i++) {
+      sb_append_json(body, a->samples[i], strlen(a->samples[i]));
+      sb_append_json(body, "\n", 1);
+    }
+  }
+
+  /* Tail from the ring, starting at the first full line */
+  size_t start = a->tail_wrapped ? a->tail_pos : 0;
+  size_t count = a->tail_wrapped ? ATTACH_TAIL_BYTES : a->tail_pos;
+  size_t skip = 0;
+  if (a->tail_wrapped)
+    while (skip < count && a->tail[(start + skip) % ATTACH_TAIL_BYTES] != '\n')
+      skip++;
+  /* Don't repeat bytes the head already showed */
+  size_t first = a->tail_wrapped ? skip + 1 : 0;
+  unsigned long long tail_off = a->bytes - count;
+  if (tail_off + first < head_len)
+    first = (size_t)(head_len - tail_off);
+  sb_append_json(body, "--- tail ---\n", 13);
+  for (size_t i = first; i < count;) {
+    size_t idx = (start + i) % ATTACH_TAIL_BYTES;
+    size_t run = ATTACH_TAIL_BYTES - idx;
+    if (run > count - i)
+      run = count - i;
+    sb_append_json(body, a->tail + idx, run);
+    i += run;
+  }
+}
+
+/* API Key Pool: every api_key= line in the config joins the pool. Each
+ * response's anthropic-ratelimit-* headers update that key's remaining
+ * requests and tokens, and each request goes out on the key with the
+ * most headroom. A key that is out of requests or tokens, or got a 429,
+ * is skipped until it resets, so throughput scales with the combined
+ * limits. A key the API rejects (401/403) is skipped for KEY_REJECTED_MS
+ * while any other key is accepted. Shared by comgen serve's workers,
+ * guarded by key_pool.lock. */
+#define KEY_REQUEST_TOKENS 1000 /* Rough cost of one request */
+#define KEY_UNKNOWN_ROOM 1e6    /* Untried keys look roomy */
+#define KEY_BACKOFF_MS 5000     /* 429 without retry-after */
+#define KEY_REJECTED_MS (30 * 60 * 1000) /* After a 401 or 403 */
+
+typedef struct {
+  char *key;
+#ifndef _WIN32
+  struct curl_slist *headers; /* x-api-key and the fixed headers */
+#endif
+  long requests_limit, requests_left, tokens_left; /* -1 until known */
+  double requests_reset, tokens_reset; /* now_ms() times */
+  double observed;                     /* When they were reported */
+  double retry_until;                  /* After a 429 */
+  double rejected_until;               /* After a 401 or 403 */
+  int in_flight;
+  unsigned long used, throttled, rejected;
+} ApiKey;
+
+static struct {
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif
+  ApiKey *keys;
+  size_t n, next; /* next: rotates ties between keys */
+} key_pool
+#ifndef _WIN32
+    = {.lock = PTHREAD_MUTEX_INITIALIZER}
+#endif
+;
+
+static void key_pool_lock(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&key_pool.lock);
+#endif
+}
+
+static void key_pool_unlock(void) {
+#ifndef _WIN32
+  pthread_mutex_unlock(&key_pool.lock);
+#endif
+}
+
+static void key_pool_clear(void) {
+  for (size_t i = 0; i < key_pool.n; i++) {
+    free(key_pool.keys[i].key);
+#ifndef _WIN32
+    curl_slist_free_all(key_pool.keys[i].headers);
+#endif
+  }
+  free(key_pool.keys);
+  key_pool.keys = NULL;
+  key_pool.n = 0;
+}
+
+static void key_pool_add(const char *key) {
+  if (!*key)
+    return;
+  for (size_t i = 0; i < key_pool.n; i++)
+    if (strcmp(key_pool.keys[i].key, key) == 0)
+      return;
+  ApiKey *keys = realloc(key_pool.keys, (key_pool.n + 1) * sizeof(*keys));
+  if (!keys)
+    return;
+  key_pool.keys = keys;
+  ApiKey *k = &keys[key_pool.n];
+  memset(k, 0, sizeof(*k));
+  if (!(k->key = strdup(key)))
+    return;
+  k->requests_limit = k->requests_left = k->tokens_left = -1;
+#ifndef _WIN32
+  char auth[256];
+  snprintf(auth, sizeof(auth), "x-api-key: %s", key);
+  k->headers = curl_slist_append(NULL, "Content-Type: application/json");
+  k->headers = curl_slist_append(k->headers, auth);
+  k->headers = curl_slist_append(k->headers, "anthropic-version: 2023-06-01");
+#endif
+  key_pool.n++;
+}
+
+/* now_ms() time until which k should not be used at all, or 0 */
+static double key_blocked_until(const ApiKey *k) {
+  double until = k->retry_until;
+  if (k->tokens_left >= 0 && k->tokens_left < KEY_REQUEST_TOKENS &&
+      k->tokens_reset > until)
+    until = k->tokens_reset;
+  return until;
+}
+
+/* Requests k can take at time now, less those in flight. Each key is a
+ * token bucket: the last reported remaining count, refilled linearly to
+ * the limit by the reported reset (the API replenishes continuously). */
+static double key_headroom(const ApiKey *k, double now) {
+  double req = KEY_UNKNOWN_ROOM;
+  if (k->requests_left >= 0) {
+    req = k->requests_left;
+    double span = k->requests_reset - k->observed;
+    if (now >= k->requests_reset && k->requests_reset > 0)
+      req = k->requests_limit > 0 ? k->requests_limit : KEY_UNKNOWN_ROOM;
+    else if (k->requests_limit > req && span > 0)
+      req += (k->requests_limit - req) * (now - k->observed) / span;
+  }
+  double tok = k->tokens_left < 0 ? KEY_UNKNOWN_ROOM
+                                  : (double)k->tokens_left / KEY_REQUEST_TOKENS;
+  return (req < tok ? req : tok) - k->in_flight;
+}
+
+/* Request Scheduler: admission in front of the key pool. A request that
+ * finds no key with room waits in its priority class, interactive before
+ * batch before speculative; within a class, users take turns (start-time
+ * fair queueing with one tag per request). Lower classes leave part of
+ * each key's limit to higher ones, so background work only soaks up
+ * spare capacity. A request whose class queue is full, or that would
+ * wait longer than its class allows, is shed with an error rather than
+ * sent into a 429. Guarded by key_pool.lock. */
+enum { PRIO_INTERACTIVE, PRIO_BATCH, PRIO_SPECULATIVE, N_PRIOS };
+static const char *prio_names[N_PRIOS] = {"interactive", "batch",
+                                          "speculative"};
+static const double sched_max_wait_ms[N_PRIOS] = {15000, 120000, 0};
+static const double sched_reserve[N_PRIOS] = {0, 0.1, 0.3}; /* Of limit */
+#define SCHED_QUEUE_MAX 512 /* Waiting requests per class */
+#define SCHED_USERS 256     /* Fair-queueing tags, direct-mapped by user */
+#define SCHED_POLL_MS 100   /* Buckets refill without an event */
+
+typedef struct SchedWaiter {
+  double tag;
+  struct SchedWaiter *next;
+} SchedWaiter;
+
+static struct {
+  SchedWaiter *queue[N_PRIOS];
+  size_t queued[N_PRIOS];
+  double vtime[N_PRIOS]; /* Tag of the last request let through */
+  struct {
+    uint64_t user;
+    double finish;
+  } users[SCHED_USERS];
+  unsigned long admitted[N_PRIOS], shed[N_PRIOS];
+#ifndef _WIN32
+  pthread_cond_t changed;
+#endif
+} sched
+#ifndef _WIN32
+    = {.changed = PTHREAD_COND_INITIALIZER}
+#endif
+;
+
+static int prio_from_name(const char *name) {
+  for (int p = 0; p < N_PRIOS; p++)
+    if (strcmp(name, prio_names[p]) == 0)
+      return p;
+  return -1;
+}
+
+/* Key capacity changed: waiters re-check */
+static void sched_changed(void) {
+#ifndef _WIN32
+  pthread_cond_broadcast(&sched.changed);
+#endif
+}
+
+/* The roomiest key with room for class prio (ties rotate), or NULL */
+static ApiKey *key_pick(int prio, double now) {
+  ApiKey *best = NULL;
+  double best_room = 0;
+  /* Rejected keys only when all are: the caller then sees the error */
+  int all_rejected = 1;
+  for (size_t j = 0; j < key_pool.n; j++)
+    all_rejected &= key_pool.keys[j].rejected_until > now;
+  for (size_t j = 0; j < key_pool.n; j++) {
+    ApiKey *k = &key_pool.keys[(key_pool.next + j) % key_pool.n];
+    if (k->rejected_until > now && !all_rejected)
+      continue;
+    double room = key_headroom(k, now);
+    double keep = k->requests_limit > 0
+                      ? sched_reserve[prio] * (double)k->requests_limit
+                      : 0;
+    if (key_blocked_until(k) > now || room < 1 + keep)
+      continue;
+    if (!best || room > best_room) {
+      best = k;
+      best_room = room;
+    }
+  }
+  key_pool.next++;
+  if (best) {
+    best->in_flight++;
+    best->used++;
+  }
+  return best;
+}
+
+/* Waits for a key with room for req's class. NULL with req->error set
+ * when the request is shed; NULL without one if the pool is empty. */
+static ApiKey *sched_admit(GenRequest *req) {
+  int p = req->prio;
+  key_pool_lock();
+  double now = now_ms(), deadline = now + sched_max_wait_ms[p];
+  int ahead = 0;
+  for (int q = 0; q <= p; q++)
+    ahead += sched.queued[q] > 0;
+  ApiKey *k = key_pool.n && !ahead ? key_pick(p, now) : NULL;
+  if (k || !key_pool.n || sched.queued[p] >= SCHED_QUEUE_MAX ||
+      sched_max_wait_ms[p] <= 0)
+    goto done;
+
+  /* Queue: the tag orders this user's requests after its earlier ones
+   * and level with other users' */
+  size_t slot = (size_t)(req->user % SCHED_USERS);
+  if (sched.users[slot].user != req->user) {
+    sched.users[slot].user = req->user;
+    sched.users[slot].finish = 0;
+  }
+  double last = sched.users[slot].finish;
+  SchedWaiter w;
+  w.tag = (sched.vtime[p] > last ? sched.vtime[p] : last) + 1;
+  sched.users[slot].finish = w.tag;
+  w.next = sched.queue[p];
+  sched.queue[p] = &w;
+  sched.queued[p]++;
+  for (;;) {
+    int first = 1;
+    for (int q = 0; q < p; q++)
+      first &= sched.queued[q] == 0;
+    for (const SchedWaiter *o = sched.queue[p]; first && o; o = o->next)
+      first = o->tag >= w.tag;
+    if (first && (k = key_pick(p, now)))
+      sched.vtime[p] = w.tag;
+    if (k || now >= deadline)
+      break;
+#ifndef _WIN32
+    double wait = deadline - now < SCHED_POLL_MS ? deadline - now
+                                                 : SCHED_POLL_MS;
+    struct timespec ts = deadline_in(wait);
+    pthread_cond_timedwait(&sched.changed, &key_pool.lock, &ts);
+#else
+    Sleep(SCHED_POLL_MS);
+#endif
+    now = now_ms();
+  }
+  SchedWaiter **link = &sched.queue[p];
+  while (*link != &w)
+    link = &(*link)->next;
+  *link = w.next;
+  sched.queued[p]--;
+  sched_changed(); /* The next in line may go */
+
+done:
+  if (k)
+    sched.admitted[p]++;
+  else if (key_pool.n) {
+    sched.shed[p]++;
+    snprintf(req->error, sizeof(req->error),
+             "rate limited: no API key has room for %s requests "
+             "(%zu waiting); try again shortly",
+             prio_names[p], sched.queued[p]);
+  }
+  key_pool_unlock();
+  return k;
+}
+
+/* Appends {"interactive":{"queued":..,"admitted":..,"shed":..},...} */
+static void sched_json(StringBuffer *sb) {
+  key_pool_lock();
+  for (int p = 0; p < N_PRIOS; p++) {
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             "%s\"%s\":{\"queued\":%zu,\"admitted\":%lu,\"shed\":%lu}",
+             p ? "," : "{", prio_names[p], sched.queued[p],
+             sched.admitted[p], sched.shed[p]);
+    sb_append(sb, buf);
+  }
+  sb_append(sb, "}");
+  key_pool_unlock();
+}
+
+/* Rate-limit state reported by one response; -1/0 for headers it lacked */
+typedef struct {
+  long requests_limit, requests_left, tokens_left;
+  double requests_reset, tokens_reset; /* now_ms() times */
+  double retry_after_ms;
+} RateHeaders;
+
+/* status: the HTTP status, or 0 when there was no response */
+static void key_release(ApiKey *k, const RateHeaders *rh, long status) {
+  if (!k)
+    return;
+  key_pool_lock();
+  k->in_flight--;
+  if (rh->requests_left >= 0) {
+    k->requests_left = rh->requests_left;
+    k->requests_reset = rh->requests_reset;
+    k->observed = now_ms();
+    if (rh->requests_limit > 0)
+      k->requests_limit = rh->requests_limit;
+  }
+  if (rh->tokens_left >= 0) {
+    k->tokens_left = rh->tokens_left;
+    k->tokens_reset = rh->tokens_reset;
+  }
+  if (status == 401 || status == 403) {
+    k->rejected++;
+    k->rejected_until = now_ms() + KEY_REJECTED_MS;
+  }
+  if (status == 429) {
+    k->throttled++;
+    k->retry_until =
+        now_ms() + (rh->retry_after_ms > 0 ? rh->retry_after_ms
+                                           : KEY_BACKOFF_MS);
+  }
+  sched_changed();
+  key_pool_unlock();
+}
+
+/* Appends [{"requests_left":..,"tokens_left":..,...},...] (no key text) */
+static void key_pool_json(StringBuffer *sb) {
+  key_pool_lock();
+  double now = now_ms();
+  sb_append(sb, "[");
+  for (size_t i = 0; i < key_pool.n; i++) {
+    const ApiKey *k = &key_pool.keys[i];
+    double until = key_blocked_until(k), room = key_headroom(k, now);
+    if (k->rejected_until > until)
+      until = k->rejected_until;
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "%s{\"requests_left\":%ld,\"tokens_left\":%ld,\"room\":%.0f,"
+             "\"in_flight\":%d,\"used\":%lu,\"throttled\":%lu,"
+             "\"rejected\":%lu,\"blocked_ms\":%.0f}",
+             i ? "," : "", k->requests_left, k->tokens_left,
+             room < KEY_UNKNOWN_ROOM / 2 ? room : -1, k->in_flight, k->used,
+             k->throttled, k->rejected, until > now ? until - now : 0);
+    sb_append(sb, buf);
+  }
+  sb_append(sb, "]");
+  key_pool_unlock();
+}
+
+#ifndef _WIN32
+/* RFC 3339 UTC ("2025-01-01T12:00:30Z") -> now_ms() time */
+static double rate_reset_ms(const char *v) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(v, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    return 0;
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  return now_ms() + difftime(timegm(&tm), time(NULL)) * 1000;
+}
+
+/* The tightest of the request, token, input and output token limits */
+static size_t rate_header_cb(char *buf, size_t size, size_t nitems,
+                             void *data) {
+  RateHeaders *rh = data;
+  size_t len = size * nitems;
+  char line[256];
+  if (len >= sizeof(line) || (strncasecmp(buf, "anthropic-ratelimit-", 20) &&
+                              strncasecmp(buf, "retry-after:", 12)))
+    return len;
+  memcpy(line, buf, len);
+  line[len] = '\0';
+  char *colon = strchr(line, ':');
+  if (!colon)
+    return len;
+  *colon = '\0';
+  const char *name = line, *v = colon + 1 + strspn(colon + 1, " ");
+  if (strcasecmp(name, "retry-after") == 0) {
+    rh->retry_after_ms = atof(v) * 1000;
+    return len;
+  }
+  name += 20;
+  size_t n = strlen(name);
+  int remaining = n > 10 && strcasecmp(name + n - 10, "-remaining") == 0;
+  int reset = n > 6 && strcasecmp(name + n - 6, "-reset") == 0;
+  if (strncasecmp(name, "requests-", 9) == 0) {
+    if (strcasecmp(name + 9, "limit") == 0)
+      rh->requests_limit = atol(v);
+    else if (remaining)
+      rh->requests_left = atol(v);
+    else if (reset)
+      rh->requests_reset = rate_reset_ms(v);
+  } else if (strstr(name, "tokens-")) {
+    /* tokens-, input-tokens-, output-tokens-: keep the lowest, and the
+     * latest reset among them */
+    if (remaining && (rh->tokens_left < 0 || atol(v) < rh->tokens_left))
+      rh->tokens_left = atol(v);
+    else if (reset && rate_reset_ms(v) > rh->tokens_reset)
+      rh->tokens_reset = rate_reset_ms(v);
+  }
+  return len;
+}
+#endif
+
+/* Network Logic */
+#ifndef _WIN32
+struct WriteContext {
+  char *data;
+  size_t len;
+};
+
+static size_t write_cb(void *ptr, size_t size, size_t nmemb, void *data) {
+  size_t realsize = size * nmemb;
+  StringBuffer *sb = (StringBuffer *)data;
+  /* curl chunks are not NUL terminated */
+  sb_append_n(sb, (const char *)ptr, realsize);
+  return realsize;
+}
+#endif
+
+
+/* Metrics: request outcomes, per-phase latency histograms, tokens and
+ * upstream retries for the long-running modes, rendered as Prometheus
+ * text by `comgen serve` (GET /metrics) and `comgen daemon metrics`.
+ * Each thread counts into its own shard, so recording is a plain load
+ * and store: no lock, no atomic read-modify-write, no cache line shared
+ * with another worker. A scrape sums the shards. Shards belong to
+ * long-lived threads (serve workers, the daemon) and are never freed. */
+enum {
+  PHASE_CONTEXT,   /* System prompt and facts */
+  PHASE_SERIALIZE, /* JSON request body */
+  PHASE_QUEUE,     /* Waiting in the scheduler for a key */
+  PHASE_TTFB,      /* Request sent to first response byte */
+  PHASE_TOTAL,     /* Whole request, cache hits included */
+  N_PHASES
+};
+static const char *phase_names[N_PHASES] = {"context", "serialize", "queue",
+                                            "ttfb", "total"};
+/* The first eight are hit_source()'s names */
+static const char *outcome_names[] = {"api",     "cache",    "template",
+                                      "similar", "bundle",   "shm",
+                                      "shared",  "offline",  "declined",
+                                      "shed",    "failed"};
+#define N_OUTCOMES (sizeof(outcome_names) / sizeof(outcome_names[0]))
+enum { TOK_INPUT, TOK_OUTPUT, TOK_CACHE_READ, TOK_CACHE_WRITE, N_TOKS };
+static const char *token_names[N_TOKS] = {"input", "output", "cache_read",
+                                          "cache_write"};
+static const char *token_fields[N_TOKS] = {
+    "\"input_tokens\":", "\"output_tokens\":", "\"cache_read_input_tokens\":",
+    "\"cache_creation_input_tokens\":"};
+static const double metric_bounds[] = {0.00005, 0.0002, 0.001, 0.005,
+                                       0.025,   0.1,    0.25,  0.5,
+                                       1,       2.5,    5,     10,   30};
+#define METRIC_BUCKETS (sizeof(metric_bounds) / sizeof(metric_bounds[0]))
+
+/* All counters are uint64_t up to next, so shards sum as arrays */
+typedef struct MetricShard {
+  uint64_t requests[N_OUTCOMES];
+  uint64_t buckets[N_PHASES][METRIC_BUCKETS + 1]; /* Last: +Inf */
+  uint64_t sum_us[N_PHASES];
+  uint64_t tokens[N_TOKS];
+  uint64_t started; /* In flight: started minus requests */
+  uint64_t attempts, retries, upstream_errors;
+  struct MetricShard *next;
+} MetricShard;
+#define METRIC_COUNTERS (offsetof(MetricShard, next) / sizeof(uint64_t))
+
+static MetricShard *metric_shards;
+static __thread MetricShard *metric_shard;
+
+static MetricShard *metric_self(void) {
+  MetricShard *m = metric_shard;
+  if (!m && (m = calloc(1, sizeof(*m)))) {
+    m->next = __atomic_load_n(&metric_shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metric_shards, &m->next, m, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    metric_shard = m;
+  }
+  return m;
+}
+
+/* Only the owning thread writes a shard; scrapes read it concurrently */
+static void metric_bump(uint64_t *c, uint64_t n) {
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static void metric_phase(int phase, double ms) {
+  MetricShard *m = metric_self();
+  if (!m)
+    return;
+  size_t b = 0;
+  while (b < METRIC_BUCKETS && ms / 1000 > metric_bounds[b])
+    b++;
+  metric_bump(&m->buckets[phase][b], 1);
+  metric_bump(&m->sum_us[phase], (uint64_t)(ms * 1000));
+}
+
+/* Counts one finished request; name is an outcome_names entry */
+static void metric_outcome(const char *name) {
+  MetricShard *m = metric_self();
+  size_t i = 0;
+  while (i + 1 < N_OUTCOMES && strcmp(outcome_names[i], name) != 0)
+    i++;
+  if (m)
+    metric_bump(&m->requests[i], 1);
+}
+
+static void metric_started(void) {
+  MetricShard *m = metric_self();
+  if (m)
+    metric_bump(&m->started, 1);
+}
+
+/* One API call: retried after a 429, or failed / not 2xx */
+static void metric_attempt(int retried, int failed) {
+  MetricShard *m = metric_self();
+  if (!m)
+    return;
+  metric_bump(&m->attempts, 1);
+  metric_bump(&m->retries, retried != 0);
+  metric_bump(&m->upstream_errors, failed != 0);
+}
+
+/* Overwrites the usage counts present in json (a reply or SSE event) */
+static void usage_tokens(const char *json, long tokens[N_TOKS]) {
+  for (int t = 0; t < N_TOKS; t++) {
+    const char *p = strstr(json, token_fields[t]);
+    if (p)
+      tokens[t] = atol(p + strlen(token_fields[t]));
+  }
+}
+
+static void metric_tokens(const long tokens[N_TOKS]) {
+  MetricShard *m = metric_self();
+  for (int k = 0; m && k < N_TOKS; k++)
+    if (tokens[k] > 0)
+      metric_bump(&m->tokens[k], (uint64_t)tokens[k]);
+}
+
+static void metric_header(StringBuffer *sb, const char *name,
+                          const char *type, const char *help) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", name, help,
+           name, type);
+  sb_append(sb, buf);
+}
+
+/* Appends every metric in the Prometheus text format */
+static void metrics_text(StringBuffer *sb) {
+  MetricShard total;
+  memset(&total, 0, sizeof(total));
+  uint64_t *sum = (uint64_t *)&total;
+  for (MetricShard *m = __atomic_load_n(&metric_shards, __ATOMIC_ACQUIRE); m;
+       m = m->next)
+    for (size_t i = 0; i < METRIC_COUNTERS; i++)
+      sum[i] += __atomic_load_n((uint64_t *)m + i, __ATOMIC_RELAXED);
+  const MetricShard *t = &total;
+  char buf[256];
+
+  metric_header(sb, "comgen_requests_total", "counter",
+                "Requests answered, by outcome.");
+  uint64_t done = 0, hits = 0;
+  for (size_t i = 0; i < N_OUTCOMES; i++) {
+    snprintf(buf, sizeof(buf), "comgen_requests_total{outcome=\"%s\"} %llu\n",
+             outcome_names[i], (unsigned long long)t->requests[i]);
+    sb_append(sb, buf);
+    done += t->requests[i];
+    if (i >= 1 && i <= 6) /* cache through shared */
+      hits += t->requests[i];
+  }
+  metric_header(sb, "comgen_in_flight", "gauge",
+                "Requests being answered.");
+  snprintf(buf, sizeof(buf), "comgen_in_flight %llu\n",
+           (unsigned long long)(t->started > done ? t->started - done : 0));
+  sb_append(sb, buf);
+  metric_header(sb, "comgen_cache_hit_ratio", "gauge",
+                "Share of cache hits among requests that were not answered "
+                "offline or failed.");
+  uint64_t lookups = hits + t->requests[0];
+  snprintf(buf, sizeof(buf), "comgen_cache_hit_ratio %g\n",
+           lookups ? (double)hits / (double)lookups : 0.0);
+  sb_append(sb, buf);
+
+  metric_header(sb, "comgen_phase_seconds", "histogram",
+                "Latency of each phase of a request.");
+  for (int p = 0; p < N_PHASES; p++) {
+    uint64_t cum = 0;
+    for (size_t b = 0; b <= METRIC_BUCKETS; b++) {
+      cum += t->buckets[p][b];
+      char le[32];
+      if (b < METRIC_BUCKETS)
+        snprintf(le, sizeof(le), "%g", metric_bounds[b]);
+      else
+        snprintf(le, sizeof(le), "+Inf");
+      snprintf(buf, sizeof(buf),
+               "comgen_phase_seconds_bucket{phase=\"%s\",le=\"%s\"} %llu\n",
+               phase_names[p], le, (unsigned long long)cum);
+      sb_append(sb, buf);
+    }
+    snprintf(buf, sizeof(buf),
+             "comgen_phase_seconds_sum{phase=\"%s\"} %.6f\n"
+             "comgen_phase_seconds_count{phase=\"%s\"} %llu\n",
+             phase_names[p], (double)t->sum_us[p] / 1e6, phase_names[p],
+             (unsigned long long)cum);
+    sb_append(sb, buf);
+  }
+
+  metric_header(sb, "comgen_tokens_total", "counter",
+                "API tokens, as reported by the API.");
+  for (int k = 0; k < N_TOKS; k++) {
+    snprintf(buf, sizeof(buf), "comgen_tokens_total{kind=\"%s\"} %llu\n",
+             token_names[k], (unsigned long long)t->tokens[k]);
+    sb_append(sb, buf);
+  }
+  metric_header(sb, "comgen_api_attempts_total", "counter",
+                "API calls sent, retries included.");
+  snprintf(buf, sizeof(buf), "comgen_api_attempts_total %llu\n",
+           (unsigned long long)t->attempts);
+  sb_append(sb, buf);
+  metric_header(sb, "comgen_api_retries_total", "counter",
+                "Rate-limited API calls retried on another key.");
+  snprintf(buf, sizeof(buf), "comgen_api_retries_total %llu\n",
+           (unsigned long long)t->retries);
+  sb_append(sb, buf);
+  metric_header(sb, "comgen_api_errors_total", "counter",
+                "API calls that failed or got a non-2xx status.");
+  snprintf(buf, sizeof(buf), "comgen_api_errors_total %llu\n",
+           (unsigned long long)t->upstream_errors);
+  sb_append(sb, buf);
+
+  metric_header(sb, "comgen_scheduler_queued", "gauge",
+                "Requests waiting for an API key, by priority.");
+  key_pool_lock();
+  for (int p = 0; p < N_PRIOS; p++) {
+    snprintf(buf, sizeof(buf),
+             "comgen_scheduler_queued{priority=\"%s\"} %zu\n", prio_names[p],
+             sched.queued[p]);
+    sb_append(sb, buf);
+  }
+  key_pool_unlock();
+}
+
+#ifndef _WIN32
+/* Streaming: with req->stream_fn set, the reply is requested as
+ * server-sent events and each text delta is handed on as it arrives
+ * (curl builds only) */
+typedef struct {
+  const GenRequest *req;
+  StringBuffer line; /* Partial SSE line */
+  StringBuffer text; /* Reply so far */
+  long tokens[N_TOKS];
+  int complete; /* message_stop arrived: text is the whole reply */
+} SseState;
+
+static void sse_line(SseState *st, const char *line) {
+  if (strncmp(line, "data:", 5) != 0)
+    return;
+  usage_tokens(line, st->tokens);
+  if (strstr(line, "\"message_stop\""))
+    st->complete = 1;
+  if (!strstr(line, "\"content_block_delta\""))
+    return;
+  char *text = extract_content(line);
+  if (!text)
+    return;
+  sb_append(&st->text, text);
+  st->req->stream_fn(text, strlen(text), st->req->stream_arg);
+  free(text);
+}
+
+static size_t sse_write_cb(void *ptr, size_t size, size_t nmemb, void *data) {
+  SseState *st = data;
+  const char *p = ptr, *end = p + size * nmemb;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    size_t len = (size_t)((nl ? nl : end) - p);
+    if (len && p[len - 1] == '\r' && nl)
+      len--;
+    sb_append_n(&st->line, p, len);
+    if (!nl)
+      break;
+    sse_line(st, st->line.data);
+    st->line.len = 0;
+    st->line.data[0] = '\0';
+    p = nl + 1;
+  }
+  return size * nmemb;
+}
+#endif
+
+/* att: optional attached input, appended to the user message. Reentrant:
+ * concurrent calls need their own session curl handle and req. */
+static char *generate_command(ComgenSession *session, GenRequest *req,
+                              const char *prompt, const Attachment *att) {
+  double t = now_ms();
+  StringBuffer extra;
+  sb_init(&extra);
+  if (req->local) {
+    char *paths = analyze_prompt_paths(prompt);
+    if (paths)
+      sb_append(&extra, paths);
+    free(paths);
+    /* Few-shot: what this user actually runs */
+    append_history_context(&extra, prompt);
+  }
+  char *sys_prompt = build_system_prompt(req, extra.data);
+  sb_free(&extra);
+  metric_phase(PHASE_CONTEXT, now_ms() - t);
+
+  t = now_ms();
+  StringBuffer body;
+  sb_init(&body);
+
+  /* Construct JSON body dynamically, escaping straight into it */
+  sb_append(&body, "{\"model\":\"");
+  sb_append_json(&body, session->model, strlen(session->model));
+  sb_append(&body, "\",\"max_tokens\":1024,\"system\":\"");
+  sb_append_json(&body, sys_prompt, strlen(sys_prompt));
+  sb_append(&body, "\",\"messages\":[{\"role\":\"user\",\"content\":\"");
+  sb_append_json(&body, prompt, strlen(prompt));
+  if (att)
+    attachment_render_json(att, &body);
+  sb_append(&body, "\"}]");
+#ifndef _WIN32
+  if (req->stream_fn)
+    sb_append(&body, ",\"stream\":true");
+#endif
+  sb_append(&body, "}");
+  req->request_bytes = body.len;
+  metric_phase(PHASE_SERIALIZE, now_ms() - t);
+
+  free(sys_prompt);
+
+  StringBuffer response;
+  sb_init(&response);
+
+#ifdef _WIN32
+  HINTERNET hRequest = WinHttpOpenRequest(
+      session->hConnect, L"POST", L"/v1/messages", NULL, WINHTTP_NO_REFERER,
+      WINHTTP_DEFAULT_ACCEPT_TYPES, WINHTTP_FLAG_SECURE);
+
+  if (!hRequest) {
+    sb_free(&body);
+    sb_free(&response);
+    return NULL;
+  }
+
+  /* Convert API key to Wide Char safely to avoid format specifier ambiguity */
+  t = now_ms();
+  ApiKey *key = sched_admit(req); /* No rate-limit headers read here */
+  metric_phase(PHASE_QUEUE, now_ms() - t);
+  if (!key && req->error[0]) {
+    WinHttpCloseHandle(hRequest);
+    sb_free(&body);
+    sb_free(&response);
+    return NULL;
+  }
+  const char *api_key = key ? key->key : session->api_key;
+  int key_len = MultiByteToWideChar(CP_UTF8, 0, api_key, -1, NULL, 0);
+  wchar_t *w_api_key = calloc(key_len, sizeof(wchar_t));
+  if (w_api_key) {
+    MultiByteToWideChar(CP_UTF8, 0, api_key, -1, w_api_key, key_len);
+  }
+
+  wchar_t headers[2048];
+  /* Use %ls for wide string which works in both MSVC and Standard C modes */
+  swprintf(headers, 2048,
+           L"Content-Type: application/json\r\n"
+           L"x-api-key: %ls\r\n"
+           L"anthropic-version: 2023-06-01\r\n",
+           w_api_key ? w_api_key : L"");
+
+  if (w_api_key)
+    free(w_api_key);
+
+  BOOL bResults = WinHttpSendRequest(hRequest, headers, -1L, body.data,
+                                     (DWORD)body.len, (DWORD)body.len, 0);
+
+  if (bResults)
+    bResults = WinHttpReceiveResponse(hRequest, NULL);
+
+  if (bResults) {
+    DWORD dwSize = 0, dwDownloaded = 0;
+    do {
+      dwSize = 0;
+      if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+        break;
+      if (!dwSize)
+        break;
+
+      char *temp = malloc(dwSize + 1);
+      if (temp) {
+        ZeroMemory(temp, dwSize + 1);
+        if (WinHttpReadData(hRequest, temp, dwSize, &dwDownloaded)) {
+          sb_append(&response, temp); /* Append handles realloc */
+        }
+        free(temp);
+      }
+    } while (dwSize > 0);
+  } else {
+    printf(C_RED "WinHttp Error: %lu" C_RESET "\n", GetLastError());
+  }
+  WinHttpCloseHandle(hRequest);
+  metric_attempt(0, !bResults);
+  RateHeaders rh = {-1, -1, -1, 0, 0, 0};
+  key_release(key, &rh, 0);
+
+#else
+  curl_easy_setopt(session->curl, CURLOPT_POSTFIELDS, body.data);
+  curl_easy_setopt(session->curl, CURLOPT_HEADERFUNCTION, rate_header_cb);
+  SseState sse;
+  if (req->stream_fn) {
+    sse.req = req;
+    sb_init(&sse.line);
+    sb_init(&sse.text);
+    curl_easy_setopt(session->curl, CURLOPT_WRITEFUNCTION, sse_write_cb);
+  }
+
+  /* A 429 throttles that key and a 401/403 sets it aside; the request
+   * is retried on another key while one has room (each attempt takes
+   * the roomiest) */
+  CURLcode res = CURLE_OK;
+  long status = 0;
+  for (size_t attempt = 0;; attempt++) {
+    t = now_ms();
+    ApiKey *key = sched_admit(req);
+    metric_phase(PHASE_QUEUE, now_ms() - t);
+    if (!key && req->error[0])
+      break; /* Shed */
+    if (key)
+      curl_easy_setopt(session->curl, CURLOPT_HTTPHEADER, key->headers);
+    RateHeaders rh = {-1, -1, -1, 0, 0, 0};
+    curl_easy_setopt(session->curl, CURLOPT_HEADERDATA, &rh);
+    response.len = 0;
+    response.data[0] = '\0';
+    if (req->stream_fn) {
+      sse.line.len = sse.text.len = 0;
+      sse.line.data[0] = sse.text.data[0] = '\0';
+      memset(sse.tokens, 0, sizeof(sse.tokens));
+      sse.complete = 0;
+      curl_easy_setopt(session->curl, CURLOPT_WRITEDATA, &sse);
+    } else {
+      curl_easy_setopt(session->curl, CURLOPT_WRITEDATA, &response);
+    }
+
+    res = curl_easy_perform(session->curl);
+    status = 0;
+    curl_easy_getinfo(session->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (res != CURLE_OK) {
+      fprintf(stderr, C_RED "CURL Error: %s" C_RESET "\n",
+              curl_easy_strerror(res));
+    }
+    curl_off_t ttfb = 0;
+    if (res == CURLE_OK &&
+        curl_easy_getinfo(session->curl, CURLINFO_STARTTRANSFER_TIME_T,
+                          &ttfb) == CURLE_OK)
+      metric_phase(PHASE_TTFB, (double)ttfb / 1000);
+    if (res != CURLE_OK)
+      status = 0;
+    key_release(key, &rh, status);
+    int rejected = status == 401 || status == 403;
+    int retry = (status == 429 || (rejected && key_pool.n > 1)) &&
+                attempt < key_pool.n;
+    metric_attempt(retry, res != CURLE_OK || status / 100 != 2);
+    if (!retry)
+      break; /* A lone key is retried once, after the scheduler's wait */
+  }
+  if (req->stream_fn) {
+    curl_easy_setopt(session->curl, CURLOPT_WRITEFUNCTION, write_cb);
+    sb_free(&body);
+    sb_free(&response);
+    sb_free(&sse.line);
+    /* A cut-off stream would be a truncated, still runnable command */
+    if (res != CURLE_OK || status != 200 || !sse.complete || !sse.text.len) {
+      sb_free(&sse.text);
+      return NULL;
+    }
+    metric_tokens(sse.tokens);
+    if (!req->quiet)
+      fprintf(oneshot ? stderr : stdout,
+              C_DIM "Tokens: %ld in, %ld out" C_RESET "\n",
+              sse.tokens[TOK_INPUT], sse.tokens[TOK_OUTPUT]);
+    return sse.text.data;
+  }
+#endif
+
+  sb_free(&body);
+
+  if (response.len == 0) {
+    sb_free(&response);
+    return NULL;
+  }
+
+  long tokens[N_TOKS] = {0};
+  usage_tokens(response.data, tokens);
+  metric_tokens(tokens);
+  if (!req->quiet)
+    print_token_usage(response.data);
+  char *content = extract_content(response.data);
+  sb_free(&response);
+  return content;
+}
+
+/* Response Cache: an identical prompt in an unchanged context reuses the
+ * earlier answer instead of a round trip. A small in-memory LRU sits in
+ * front of an append-only log in the config dir, which is mmap'd and
+ * indexed lazily; a newer record for a key supersedes older ones. */
+#define CACHE_MAGIC 0x43524743u /* "CGRC" */
+#define CACHE_VERSION 2
+#define CACHE_MEM_ENTRIES 64
+#define CACHE_TTL_SECS (7 * 24 * 3600)
+#define CACHE_MAX_BYTES (32 * 1024 * 1024) /* Compacted to half past this */
+#define CACHE_PROMPT_MAX 1024
+#define CACHE_CMD_MAX 4096
+#define CACHE_F_TEMPLATE 1 /* Prompt and command have literal slots */
+#define LSH_MAGIC 0x534c4743u /* "CGLS" */
+#define MH_HASHES 32
+#define MH_BANDS 8
+#define MH_ROWS (MH_HASHES / MH_BANDS)
+#define MH_MAX_SHINGLES 64
+#define FUZZY_CANDIDATES 64
+#define FUZZY_SUGGEST 0.5 /* Shown while the request is still sent */
+#define FUZZY_ACCEPT 0.9  /* Answered locally if the context matches too */
+#define LSH_TAIL_MAX (1024 * MH_BANDS) /* Unsorted band entries */
+
+typedef struct {
+  uint64_t prompt; /* Normalized prompt */
+  uint64_t ctx;    /* CWD, workspace profile, file list */
+  uint64_t env;    /* Model, OS, shell, user */
+} CacheKey;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} CacheFileHeader;
+
+/* Followed by the prompt and command bytes, padded to 8 */
+typedef struct {
+  uint32_t size;  /* Whole record including padding */
+  uint32_t check; /* Detects torn appends */
+  CacheKey key;
+  int64_t created;
+  uint32_t flags; /* CACHE_F_* */
+  uint16_t prompt_len;
+  uint16_t cmd_len;
+  uint32_t bands[MH_BANDS]; /* MinHash band hashes of the prompt, for LSH */
+} CacheRecord;
+
+typedef struct CacheEntry {
+  CacheKey key;
+  int64_t created;
+  char *cmd;
+  struct CacheEntry *prev, *next;
+} CacheEntry;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t store_id; /* Inode of the store it indexes */
+  uint64_t covered;  /* Store bytes indexed */
+  uint64_t count;
+} LshFileHeader;
+
+typedef struct {
+  uint32_t band;
+  uint32_t off;
+} LshEntry;
+
+/* Disk index slot: latest record offset per key, 0 when empty */
+typedef struct {
+  uint64_t hash;
+  uint32_t off;
+} CacheSlot;
+
+static struct {
+  MappedFile map;
+  uint64_t file_id; /* Inode; changes when another process compacts */
+  size_t scanned;   /* End of the last valid record, 0 if no store */
+  CacheSlot *slots;
+  size_t nslots, used, records;
+  CacheEntry *head, *tail;
+  size_t mem_count;
+  MappedFile lsh_map; /* Sorted LshEntry run for the store's head */
+  const LshEntry *lsh;
+  size_t lsh_count, lsh_covered;
+  LshEntry *lsh_tail; /* Bands of records past lsh_covered */
+  size_t lsh_tail_n, lsh_tail_cap;
+  unsigned long mem_hits, disk_hits, template_hits, fuzzy_hits, suggestions,
+      misses, stores, compactions;
+  double hit_us_total, fuzzy_us_total;
+} cache;
+
+static int cache_key_eq(const CacheKey *a, const CacheKey *b) {
+  return a->prompt == b->prompt && a->ctx == b->ctx && a->env == b->env;
+}
+
+static uint64_t cache_key_hash(const CacheKey *k) {
+  uint64_t h = hash_bytes(k, sizeof(*k), HASH_SEED);
+  return h ? h : 1;
+}
+
+static int cache_expired(int64_t created) {
+  return (int64_t)time(NULL) - created > CACHE_TTL_SECS;
+}
+
+static uint32_t cache_record_check(const char *rec, size_t size) {
+  uint64_t h = hash_bytes(rec + 8, size - 8, HASH_SEED ^ size);
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Lowercases a capitalised first letter ("Show" but not "README"),
+ * collapses whitespace and drops trailing punctuation */
+static void normalize_prompt(const char *in, char *out, size_t size) {
+  size_t o = 0;
+  while (*in && o + 2 < size) {
+    while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+      in++;
+    if (!*in)
+      break;
+    const char *w = in;
+    while (*in && *in != ' ' && *in != '\t' && *in != '\n' && *in != '\r')
+      in++;
+    size_t len = (size_t)(in - w);
+    if (o > 0)
+      out[o++] = ' ';
+    int fold = w[0] >= 'A' && w[0] <= 'Z';
+    for (size_t i = 1; fold && i < len; i++)
+      fold = w[i] >= 'a' && w[i] <= 'z';
+    for (size_t i = 0; i < len && o + 1 < size; i++)
+      out[o++] = (i == 0 && fold) ? (char)(w[i] + 32) : w[i];
+  }
+  while (o > 0 && strchr(".?! ", out[o - 1]))
+    o--;
+  out[o] = '\0';
+}
+
+/* Fuzzy matching: prompts are reduced to canonical words (synonyms folded,
+ * plurals and filler dropped) and shingled into words and word pairs. A
+ * 32-value MinHash of the shingles is cut into 8 bands of 4, and the band
+ * hashes are stored with each record. Records that share a band with the
+ * query become candidates, scored by exact Jaccard similarity. */
+typedef struct {
+  const char *word;
+  const char *canon;
+} Synonym;
+
+/* Sorted by word for bsearch */
+static const Synonym synonyms[] = {
+    {"big", "large"},        {"bigger", "large"},     {"biggest", "large"},
+    {"changed", "modified"},
+    {"cwd", "dir"},          {"decompress", "extract"}, {"del", "remove"},
+    {"delete", "remove"},    {"directories", "dir"},  {"directory", "dir"},
+    {"display", "show"},     {"edited", "modified"},  {"erase", "remove"},
+    {"folder", "dir"},       {"folders", "dir"},      {"get", "show"},
+    {"here", "dir"},         {"huge", "large"},
+    {"larger", "large"},     {"largest", "large"},     {"latest", "new"},
+    {"list", "show"},        {"locate", "find"},      {"newest", "new"},
+    {"number", "count"},     {"oldest", "old"},       {"print", "show"},
+    {"proc", "process"},     {"processes", "process"}, {"procs", "process"},
+    {"recent", "new"},       {"recently", "new"},     {"rm", "remove"},
+    {"search", "find"},      {"smallest", "small"},   {"space", "size"},
+    {"tiny", "small"},       {"unpack", "extract"},
+    {"untar", "extract"},    {"unzip", "extract"},    {"updated", "modified"},
+    {"usage", "size"},       {"view", "show"},
+};
+
+static int synonym_cmp(const void *key, const void *elem) {
+  return strcmp(key, ((const Synonym *)elem)->word);
+}
+
+static int is_filler(const char *w) {
+  static const char *filler[] = {
+      "a",    "all",  "an",   "and",    "any",  "are",   "at",   "be",
+      "by",   "can",  "could","do",     "every","for",   "from", "give",
+      "how",  "i",    "in",   "into",   "is",   "it",    "its",  "me",
+      "my",   "of",   "on",   "please", "some", "than",  "that", "the",
+      "these","this", "those","to",     "want", "what",  "which","with",
+      "you",  "current",
+  };
+  for (size_t i = 0; i < sizeof(filler) / sizeof(*filler); i++)
+    if (strcmp(w, filler[i]) == 0)
+      return 1;
+  return 0;
+}
+
+/* Fillers that still decide the command: "copy a to b" is not "copy b
+ * to a", and the order only survives through these words' bigrams */
+static int is_direction(const char *w) {
+  static const char *direction[] = {"at", "from", "in", "into", "on", "to"};
+  for (size_t i = 0; i < sizeof(direction) / sizeof(*direction); i++)
+    if (strcmp(w, direction[i]) == 0)
+      return 1;
+  return 0;
+}
+
+/* Fillers that set how much the command touches: "delete all logs" is
+ * not "delete some logs". Returns 1 + the word's index, or 0. */
+static int is_quantifier(const char *w) {
+  static const char *quantifier[] = {"all", "any", "each", "every", "some"};
+  for (size_t i = 0; i < sizeof(quantifier) / sizeof(*quantifier); i++)
+    if (strcmp(w, quantifier[i]) == 0)
+      return (int)i + 1;
+  return 0;
+}
+
+/* Bit per quantifier word in text; similar prompts are only answered
+ * from the cache when these agree */
+static unsigned quantifier_mask(const char *text) {
+  unsigned mask = 0;
+  while (*text) {
+    char w[8];
+    size_t len = 0;
+    while (*text && !isalnum((unsigned char)*text))
+      text++;
+    while (isalnum((unsigned char)*text)) {
+      if (len + 1 < sizeof(w))
+        w[len] = (char)tolower((unsigned char)*text);
+      len++;
+      text++;
+    }
+    w[len < sizeof(w) ? len : 0] = '\0';
+    int q = is_quantifier(w);
+    if (q)
+      mask |= 1u << q;
+  }
+  return mask;
+}
+
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  return x ^ (x >> 33);
+}
+
+static int u64_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Sorted, distinct shingle hashes of a prompt; returns the count */
+static size_t prompt_shingles(const char *prompt, uint64_t *out, size_t max) {
+  size_t n = 0;
+  uint64_t prev = 0;
+  const char *p = prompt;
+  while (*p && n + 2 <= max) {
+    char w[32];
+    size_t len = 0;
+    while (*p && !isalnum((unsigned char)*p))
+      p++;
+    while (*p && (isalnum((unsigned char)*p) || *p == '_')) {
+      if (len + 1 < sizeof(w))
+        w[len++] = (char)tolower((unsigned char)*p);
+      p++;
+    }
+    if (!len)
+      break;
+    w[len] = '\0';
+    if (is_filler(w) && !is_direction(w) && !is_quantifier(w))
+      continue;
+
+    const char *canon = w;
+    const Synonym *syn = bsearch(w, synonyms, sizeof(synonyms) /
+                                 sizeof(*synonyms), sizeof(*synonyms),
+                                 synonym_cmp);
+    if (syn) {
+      canon = syn->canon;
+    } else if (len > 4 && (strcmp(w + len - 4, "sses") == 0 ||
+                           strcmp(w + len - 3, "xes") == 0 ||
+                           strcmp(w + len - 4, "ches") == 0)) {
+      w[len - 2] = '\0';
+    } else if (len > 3 && w[len - 1] == 's' && !strchr("su", w[len - 2])) {
+      w[len - 1] = '\0';
+    }
+
+    uint64_t h = hash_bytes(canon, strlen(canon), HASH_SEED);
+    out[n++] = h;
+    if (prev)
+      out[n++] = mix64(prev * 31 + h);
+    prev = h;
+  }
+  qsort(out, n, sizeof(*out), u64_cmp);
+  size_t u = 0;
+  for (size_t i = 0; i < n; i++)
+    if (u == 0 || out[i] != out[u - 1])
+      out[u++] = out[i];
+  return u;
+}
+
+/* Band hashes of the MinHash signature; all zero for an empty prompt */
+static void minhash_bands(const uint64_t *sh, size_t n,
+                          uint32_t bands[MH_BANDS]) {
+  memset(bands, 0, MH_BANDS * sizeof(*bands));
+  if (!n)
+    return;
+  uint32_t mins[MH_HASHES];
+  for (size_t i = 0; i < MH_HASHES; i++)
+    mins[i] = UINT32_MAX;
+  for (size_t j = 0; j < n; j++)
+    for (size_t i = 0; i < MH_HASHES; i++) {
+      uint32_t v = (uint32_t)mix64(sh[j] + i * 0x9e3779b97f4a7c15ULL);
+      if (v < mins[i])
+        mins[i] = v;
+    }
+  for (size_t b = 0; b < MH_BANDS; b++) {
+    uint64_t h = hash_bytes(mins + b * MH_ROWS, MH_ROWS * sizeof(*mins),
+                            HASH_SEED + b);
+    bands[b] = (uint32_t)(h ^ (h >> 32)) | 1;
+  }
+}
+
+static double jaccard(const uint64_t *a, size_t na, const uint64_t *b,
+                      size_t nb) {
+  size_t i = 0, j = 0, common = 0;
+  while (i < na && j < nb) {
+    if (a[i] == b[j]) {
+      common++;
+      i++;
+      j++;
+    } else if (a[i] < b[j]) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  size_t uni = na + nb - common;
+  return uni ? (double)common / (double)uni : 0;
+}
+
+static void cache_make_key(const ComgenSession *s, const EnvContext *env,
+                           const char *norm, CacheKey *k) {
+  k->prompt = hash_bytes(norm, strlen(norm), HASH_SEED);
+  /* Field terminators are hashed too so "ab"+"c" != "a"+"bc" */
+  uint64_t h = hash_bytes(s->model, strlen(s->model) + 1, HASH_SEED);
+  h = hash_bytes(env->os, strlen(env->os) + 1, h);
+  h = hash_bytes(env->shell, strlen(env->shell) + 1, h);
+  k->env = hash_bytes(env->user, strlen(env->user) + 1, h);
+  /* Git state and path scans are left out: they change by the minute and
+   * rarely change the answer */
+  const char *files = env->ls_output ? env->ls_output : "";
+  h = hash_bytes(env->cwd, strlen(env->cwd) + 1, HASH_SEED);
+  h = hash_bytes(env->workspace, strlen(env->workspace) + 1, h);
+  k->ctx = hash_bytes(files, strlen(files) + 1, h);
+}
+
+static void cache_mem_unlink(CacheEntry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    cache.head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    cache.tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void cache_mem_push(CacheEntry *e) {
+  e->next = cache.head;
+  if (cache.head)
+    cache.head->prev = e;
+  cache.head = e;
+  if (!cache.tail)
+    cache.tail = e;
+}
+
+static void cache_mem_put(const CacheKey *k, int64_t created, const char *cmd,
+                          size_t cmd_len) {
+  CacheEntry *e;
+  for (e = cache.head; e; e = e->next)
+    if (cache_key_eq(&e->key, k))
+      break;
+  if (e) {
+    cache_mem_unlink(e);
+    free(e->cmd);
+  } else if (cache.mem_count >= CACHE_MEM_ENTRIES) {
+    e = cache.tail;
+    cache_mem_unlink(e);
+    free(e->cmd);
+  } else if ((e = calloc(1, sizeof(*e)))) {
+    cache.mem_count++;
+  } else {
+    return;
+  }
+  e->key = *k;
+  e->created = created;
+  e->cmd = malloc(cmd_len + 1);
+  if (e->cmd) {
+    memcpy(e->cmd, cmd, cmd_len);
+    e->cmd[cmd_len] = '\0';
+  }
+  cache_mem_push(e);
+}
+
+static void cache_index_reset(void) {
+  unmap_file(&cache.map);
+  unmap_file(&cache.lsh_map);
+  free(cache.slots);
+  free(cache.lsh_tail);
+  cache.slots = NULL;
+  cache.lsh = NULL;
+  cache.lsh_tail = NULL;
+  cache.nslots = cache.used = cache.records = 0;
+  cache.lsh_count = cache.lsh_covered = 0;
+  cache.lsh_tail_n = cache.lsh_tail_cap = 0;
+  cache.scanned = 0;
+  cache.file_id = 0;
+}
+
+static void cache_index_put(uint64_t hash, uint32_t off);
+
+static void cache_index_grow(void) {
+  CacheSlot *old = cache.slots;
+  size_t old_n = cache.nslots;
+  cache.nslots = old_n ? old_n * 2 : 1024;
+  cache.slots = calloc(cache.nslots, sizeof(CacheSlot));
+  cache.used = 0;
+  if (!cache.slots) {
+    cache.nslots = 0;
+    free(old);
+    return;
+  }
+  for (size_t i = 0; i < old_n; i++)
+    if (old[i].off)
+      cache_index_put(old[i].hash, old[i].off);
+  free(old);
+}
+
+static void cache_index_put(uint64_t hash, uint32_t off) {
+  if ((cache.used + 1) * 2 > cache.nslots)
+    cache_index_grow();
+  if (!cache.slots)
+    return;
+  size_t mask = cache.nslots - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    if (!cache.slots[i].off || cache.slots[i].hash == hash) {
+      cache.used += !cache.slots[i].off;
+      cache.slots[i].hash = hash;
+      cache.slots[i].off = off;
+      return;
+    }
+  }
+}
+
+static uint32_t cache_index_get(uint64_t hash) {
+  if (!cache.slots)
+    return 0;
+  size_t mask = cache.nslots - 1;
+  for (size_t i = hash & mask; cache.slots[i].off; i = (i + 1) & mask)
+    if (cache.slots[i].hash == hash)
+      return cache.slots[i].off;
+  return 0;
+}
+
+/* Validated record at off, or NULL */
+static const CacheRecord *cache_record_at(size_t off) {
+  if (!off || off + sizeof(CacheRecord) > cache.map.size || off % 8)
+    return NULL;
+  const CacheRecord *r = (const CacheRecord *)(cache.map.data + off);
+  if (r->size < sizeof(*r) || r->size > cache.map.size - off ||
+      sizeof(*r) + r->prompt_len + r->cmd_len > r->size ||
+      cache_record_check(cache.map.data + off, r->size) != r->check)
+    return NULL;
+  return r;
+}
+
+/* LSH buckets live in a sidecar file: (band, offset) pairs sorted by band
+ * and mmap'd, so a lookup is a binary search per band and startup does no
+ * rebuilding. Bands of records appended since the last merge sit in a
+ * small unsorted tail that is folded in once it grows. */
+static int lsh_entry_cmp(const void *a, const void *b) {
+  const LshEntry *x = a, *y = b;
+  if (x->band != y->band)
+    return (x->band > y->band) - (x->band < y->band);
+  return (x->off > y->off) - (x->off < y->off);
+}
+
+static void lsh_load(void) {
+  char path[1024];
+  get_config_file(path, sizeof(path), "responses.lsh");
+  cache.lsh_covered = sizeof(CacheFileHeader);
+  if (!map_file(path, &cache.lsh_map))
+    return;
+  LshFileHeader h;
+  if (cache.lsh_map.size >= sizeof(h))
+    memcpy(&h, cache.lsh_map.data, sizeof(h));
+  if (cache.lsh_map.size < sizeof(h) || h.magic != LSH_MAGIC ||
+      h.version != CACHE_VERSION || h.store_id != cache.file_id ||
+      h.covered > cache.map.size ||
+      sizeof(h) + h.count * sizeof(LshEntry) != cache.lsh_map.size) {
+    unmap_file(&cache.lsh_map); /* Stale: the tail covers everything */
+    return;
+  }
+  cache.lsh = (const LshEntry *)(cache.lsh_map.data + sizeof(h));
+  cache.lsh_count = (size_t)h.count;
+  cache.lsh_covered = (size_t)h.covered;
+}
+
+static void lsh_tail_add(const uint32_t *bands, uint32_t off) {
+  for (size_t b = 0; b < MH_BANDS; b++) {
+    if (!bands[b])
+      continue;
+    if (cache.lsh_tail_n == cache.lsh_tail_cap) {
+      size_t cap = cache.lsh_tail_cap ? cache.lsh_tail_cap * 2 : 256;
+      LshEntry *t = realloc(cache.lsh_tail, cap * sizeof(*t));
+      if (!t)
+        return;
+      cache.lsh_tail = t;
+      cache.lsh_tail_cap = cap;
+    }
+    cache.lsh_tail[cache.lsh_tail_n].band = bands[b];
+    cache.lsh_tail[cache.lsh_tail_n++].off = off;
+  }
+}
+
+/* Merges the tail into the sorted run and rewrites the sidecar */
+static void lsh_merge(void) {
+  qsort(cache.lsh_tail, cache.lsh_tail_n, sizeof(LshEntry), lsh_entry_cmp);
+  size_t n = cache.lsh_count + cache.lsh_tail_n;
+  LshEntry *all = malloc(n * sizeof(LshEntry));
+  if (!all)
+    return;
+  size_t i = 0, j = 0, o = 0;
+  while (i < cache.lsh_count || j < cache.lsh_tail_n) {
+    if (j == cache.lsh_tail_n ||
+        (i < cache.lsh_count &&
+         lsh_entry_cmp(&cache.lsh[i], &cache.lsh_tail[j]) <= 0))
+      all[o++] = cache.lsh[i++];
+    else
+      all[o++] = cache.lsh_tail[j++];
+  }
+
+  char path[1024], tmp[1100];
+  get_config_file(path, sizeof(path), "responses.lsh");
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  LshFileHeader h = {LSH_MAGIC, CACHE_VERSION, cache.file_id, cache.scanned,
+                     n};
+  FILE *fp = fopen(tmp, "wb");
+  int ok = fp && fwrite(&h, sizeof(h), 1, fp) == 1 &&
+           fwrite(all, sizeof(*all), n, fp) == n;
+  if (fp)
+    ok &= fclose(fp) == 0;
+  free(all);
+  unmap_file(&cache.lsh_map);
+  cache.lsh = NULL;
+  cache.lsh_count = 0;
+#ifdef _WIN32
+  if (ok)
+    unlink(path);
+#endif
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+  cache.lsh_tail_n = 0;
+  lsh_load();
+  if (cache.lsh_covered != cache.scanned) {
+    /* Could not persist: rescan the records into the tail next sync */
+    cache_index_reset();
+  }
+}
+
+/* Remaps the store if it grew and indexes the new records. Records
+ * appended by other comgen processes are picked up the same way. */
+static void cache_sync(void) {
+  char path[1024];
+  get_config_file(path, sizeof(path), "responses");
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    cache_index_reset();
+    return;
+  }
+#ifdef _WIN32
+  uint64_t id = 1;
+#else
+  uint64_t id = (uint64_t)st.st_ino;
+#endif
+  if (id != cache.file_id || (size_t)st.st_size < cache.scanned)
+    cache_index_reset();
+  if (cache.map.data && (size_t)st.st_size == cache.map.size)
+    return;
+  unmap_file(&cache.map);
+  if (!map_file(path, &cache.map))
+    return;
+  cache.file_id = id;
+
+  if (cache.scanned == 0) {
+    CacheFileHeader hdr;
+    if (cache.map.size < sizeof(hdr))
+      return;
+    memcpy(&hdr, cache.map.data, sizeof(hdr));
+    if (hdr.magic != CACHE_MAGIC || hdr.version != CACHE_VERSION)
+      return;
+    cache.scanned = sizeof(hdr);
+    lsh_load();
+  }
+  /* A torn tail stops the scan; the next compaction drops it */
+  const CacheRecord *r;
+  size_t before = cache.scanned;
+  while ((r = cache_record_at(cache.scanned))) {
+    cache_index_put(cache_key_hash(&r->key), (uint32_t)cache.scanned);
+    if (cache.scanned >= cache.lsh_covered)
+      lsh_tail_add(r->bands, (uint32_t)cache.scanned);
+    cache.records++;
+    cache.scanned += r->size;
+  }
+  if (cache.scanned > before && cache.lsh_tail_n > LSH_TAIL_MAX)
+    lsh_merge();
+}
+
+static char *cache_lookup(const CacheKey *k) {
+  for (CacheEntry *e = cache.head; e; e = e->next) {
+    if (!cache_key_eq(&e->key, k))
+      continue;
+    if (cache_expired(e->created) || !e->cmd)
+      break;
+    cache_mem_unlink(e);
+    cache_mem_push(e);
+    cache.mem_hits++;
+    return strdup(e->cmd);
+  }
+
+  cache_sync();
+  const CacheRecord *r = cache_record_at(cache_index_get(cache_key_hash(k)));
+  if (r && cache_key_eq(&r->key, k) && !cache_expired(r->created)) {
+    const char *cmd = (const char *)(r + 1) + r->prompt_len;
+    cache_mem_put(k, r->created, cmd, r->cmd_len);
+    cache.disk_hits++;
+    char *out = malloc(r->cmd_len + 1u);
+    if (out) {
+      memcpy(out, cmd, r->cmd_len);
+      out[r->cmd_len] = '\0';
+    }
+    return out;
+  }
+  return NULL;
+}
+
+typedef struct {
+  double score;
+  int same_ctx;
+  int same_scope; /* Same quantifiers (all, some, ...) as the query */
+  char prompt[96]; /* The cached prompt that matched */
+  char *cmd;       /* malloc'd */
+} FuzzyMatch;
+
+typedef struct {
+  const CacheKey *k;
+  const uint64_t *q;
+  size_t nq;
+  unsigned scope; /* quantifier_mask of the query */
+  uint32_t seen[FUZZY_CANDIDATES];
+  size_t n_seen;
+  const CacheRecord *best;
+  double best_rank;
+  FuzzyMatch *m;
+} FuzzySearch;
+
+static void fuzzy_consider(FuzzySearch *fs, uint32_t off) {
+  for (size_t s = 0; s < fs->n_seen; s++)
+    if (fs->seen[s] == off)
+      return;
+  fs->seen[fs->n_seen++] = off;
+
+  const CacheRecord *r = cache_record_at(off);
+  if (!r || r->key.env != fs->k->env || cache_key_eq(&r->key, fs->k) ||
+      (r->flags & CACHE_F_TEMPLATE) ||
+      cache_expired(r->created) ||
+      cache_index_get(cache_key_hash(&r->key)) != off)
+    return; /* Other platform, exact, template, stale or superseded */
+  char text[CACHE_PROMPT_MAX + 1];
+  uint64_t c[MH_MAX_SHINGLES];
+  memcpy(text, r + 1, r->prompt_len);
+  text[r->prompt_len] = '\0';
+  size_t nc = prompt_shingles(text, c, MH_MAX_SHINGLES);
+  double score = jaccard(fs->q, fs->nq, c, nc);
+  /* Same-directory answers win ties */
+  double rank = score + (r->key.ctx == fs->k->ctx ? 0.001 : 0);
+  if (score >= FUZZY_SUGGEST && rank > fs->best_rank) {
+    fs->best_rank = rank;
+    fs->best = r;
+    fs->m->score = score;
+    fs->m->same_ctx = r->key.ctx == fs->k->ctx;
+    fs->m->same_scope = quantifier_mask(text) == fs->scope;
+  }
+}
+
+/* Best cached answer to a similar prompt for the same model/OS/shell/user,
+ * scoring at least FUZZY_SUGGEST; exact matches are cache_lookup's job.
+ * Newer records in a bucket are tried first. */
+static int fuzzy_lookup(const CacheKey *k, const char *norm, FuzzyMatch *m) {
+  uint64_t q[MH_MAX_SHINGLES];
+  size_t nq = prompt_shingles(norm, q, MH_MAX_SHINGLES);
+  uint32_t bands[MH_BANDS];
+  minhash_bands(q, nq, bands);
+  m->cmd = NULL;
+  if (!nq)
+    return 0;
+
+  FuzzySearch fs = {
+      .k = k, .q = q, .nq = nq, .scope = quantifier_mask(norm), .m = m};
+  for (size_t b = 0; b < MH_BANDS; b++) {
+    for (size_t i = cache.lsh_tail_n; i-- > 0 && fs.n_seen < FUZZY_CANDIDATES;)
+      if (cache.lsh_tail[i].band == bands[b])
+        fuzzy_consider(&fs, cache.lsh_tail[i].off);
+    size_t lo = 0, hi = cache.lsh_count;
+    while (lo < hi) { /* First entry past this band */
+      size_t mid = lo + (hi - lo) / 2;
+      if (cache.lsh[mid].band <= bands[b])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    while (lo-- > 0 && cache.lsh[lo].band == bands[b] &&
+           fs.n_seen < FUZZY_CANDIDATES)
+      fuzzy_consider(&fs, cache.lsh[lo].off);
+  }
+
+  const CacheRecord *best = fs.best;
+  if (!best || !(m->cmd = malloc(best->cmd_len + 1u)))
+    return 0;
+  const char *text = (const char *)(best + 1);
+  memcpy(m->cmd, text + best->prompt_len, best->cmd_len);
+  m->cmd[best->cmd_len] = '\0';
+  snprintf(m->prompt, sizeof(m->prompt), "%.*s", (int)best->prompt_len,
+           text);
+  return 1;
+}
+
+typedef struct {
+  int64_t created;
+  uint32_t off;
+} CacheLive;
+
+static int cache_live_newest_first(const void *a, const void *b) {
+  int64_t x = ((const CacheLive *)a)->created;
+  int64_t y = ((const CacheLive *)b)->created;
+  return (x < y) - (x > y);
+}
+
+/* Serializes writers of the response store across processes; readers
+ * need no lock because the store only grows or is replaced by rename */
+static int store_lock(void) {
+#ifdef _WIN32
+  return -1; /* Windows cannot rename over an open file, which suffices */
+#else
+  char path[1024];
+  get_config_file(path, sizeof(path), "responses.lock");
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+#endif
+}
+
+static void store_unlock(int fd) {
+  if (fd >= 0)
+    close(fd); /* Drops the flock */
+}
+
+/* Rewrites the store with the newest live record per key, up to half the
+ * size cap, then renames it over the old one */
+static void cache_compact(void) {
+  CacheLive *live = malloc((cache.used + 1) * sizeof(CacheLive));
+  if (!live)
+    return;
+  size_t n = 0;
+  for (size_t i = 0; i < cache.nslots; i++) {
+    const CacheRecord *r = cache_record_at(cache.slots[i].off);
+    if (cache.slots[i].off && r && !cache_expired(r->created)) {
+      live[n].created = r->created;
+      live[n++].off = cache.slots[i].off;
+    }
+  }
+  qsort(live, n, sizeof(*live), cache_live_newest_first);
+
+  char path[1024], tmp[1100];
+  get_config_file(path, sizeof(path), "responses");
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) {
+    free(live);
+    return;
+  }
+  CacheFileHeader hdr = {CACHE_MAGIC, CACHE_VERSION};
+  size_t total = fwrite(&hdr, sizeof(hdr), 1, fp) * sizeof(hdr);
+  for (size_t i = 0; i < n; i++) {
+    const CacheRecord *r = (const CacheRecord *)(cache.map.data + live[i].off);
+    if (total + r->size > CACHE_MAX_BYTES / 2)
+      break;
+    total += fwrite(r, 1, r->size, fp);
+  }
+  free(live);
+  int ok = fclose(fp) == 0;
+  unmap_file(&cache.map); /* Windows cannot replace a file still open */
+#ifdef _WIN32
+  if (ok)
+    unlink(path);
+#endif
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+  cache_index_reset();
+  cache.compactions++;
+}
+
+static void cache_store(const CacheKey *k, const char *prompt, const char *cmd,
+                        uint32_t flags) {
+  size_t prompt_len = strlen(prompt), cmd_len = strlen(cmd);
+  if (cmd_len > CACHE_CMD_MAX)
+    return;
+  if (prompt_len > CACHE_PROMPT_MAX)
+    prompt_len = CACHE_PROMPT_MAX;
+  int64_t now = (int64_t)time(NULL);
+  cache_mem_put(k, now, cmd, cmd_len);
+  if (!ensure_config_dir())
+    return;
+
+  size_t size = (sizeof(CacheRecord) + prompt_len + cmd_len + 7) & ~(size_t)7;
+  char *rec = calloc(1, size);
+  if (!rec)
+    return;
+  CacheRecord *r = (CacheRecord *)rec;
+  r->size = (uint32_t)size;
+  r->key = *k;
+  r->created = now;
+  r->prompt_len = (uint16_t)prompt_len;
+  r->cmd_len = (uint16_t)cmd_len;
+  r->flags = flags;
+  uint64_t sh[MH_MAX_SHINGLES];
+  if (!(flags & CACHE_F_TEMPLATE)) /* Templates are not suggested as-is */
+    minhash_bands(sh, prompt_shingles(prompt, sh, MH_MAX_SHINGLES), r->bands);
+  memcpy(rec + sizeof(*r), prompt, prompt_len);
+  memcpy(rec + sizeof(*r) + prompt_len, cmd, cmd_len);
+  r->check = cache_record_check(rec, size);
+
+  /* Appends and compaction hold the store lock, so a record cannot land
+   * in a file another session is about to rename away; missing or
+   * foreign files are replaced by a fresh one, never truncated */
+  int lock_fd = store_lock();
+  cache_sync();
+  char path[1024];
+  get_config_file(path, sizeof(path), "responses");
+  if (cache.scanned) {
+    FILE *fp = fopen(path, "ab");
+    if (fp) {
+      setvbuf(fp, NULL, _IONBF, 0);
+      if (fwrite(rec, 1, size, fp) == size)
+        cache.stores++;
+      fclose(fp);
+    }
+  } else {
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    CacheFileHeader hdr = {CACHE_MAGIC, CACHE_VERSION};
+    int ok = fp && fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(rec, 1, size, fp) == size;
+    if (fp)
+      ok &= fclose(fp) == 0;
+    unmap_file(&cache.map);
+#ifdef _WIN32
+    if (ok)
+      unlink(path);
+#endif
+    if (ok && rename(tmp, path) == 0)
+      cache.stores++;
+    else
+      unlink(tmp);
+  }
+  free(rec);
+
+  cache_sync();
+  if (cache.map.size > CACHE_MAX_BYTES)
+    cache_compact();
+  store_unlock(lock_fd);
+}
+
+static void cache_close(void) {
+  while (cache.head) {
+    CacheEntry *e = cache.head;
+    cache_mem_unlink(e);
+    free(e->cmd);
+    free(e);
+  }
+  cache.mem_count = 0;
+  cache_index_reset();
+}
+
+static void cache_clear(void) {
+  cache_close();
+  char path[1024];
+  get_config_file(path, sizeof(path), "responses");
+  unlink(path);
+  get_config_file(path, sizeof(path), "responses.lsh");
+  unlink(path);
+}
+
+static void print_bundle_stats(void);
+#ifndef _WIN32
+static void print_shm_stats(void);
+#endif
+
+static void print_cache_stats(void) {
+  cache_sync();
+  size_t live = 0;
+  for (size_t i = 0; i < cache.nslots; i++) {
+    const CacheRecord *r = cache_record_at(cache.slots[i].off);
+    live += cache.slots[i].off && r && !cache_expired(r->created);
+  }
+  char size_s[24];
+  format_size(cache.map.size, size_s, sizeof(size_s));
+  unsigned long hits = cache.mem_hits + cache.disk_hits + cache.fuzzy_hits;
+  printf(C_BOLD "Response cache" C_RESET "\n");
+  printf("memory  %zu/%d entries\n", cache.mem_count, CACHE_MEM_ENTRIES);
+  printf("disk    %zu live of %zu records, %s (compacted past %d MB)\n", live,
+         cache.records, size_s, CACHE_MAX_BYTES / (1024 * 1024));
+  printf("lsh     %zu sorted + %zu recent band entries\n", cache.lsh_count,
+         cache.lsh_tail_n);
+  printf("session %lu hits (%lu memory, %lu disk, %lu similar), %lu via "
+         "templates, %lu suggestions, %lu misses, %lu stored, %lu "
+         "compactions\n",
+         hits, cache.mem_hits, cache.disk_hits, cache.fuzzy_hits,
+         cache.template_hits, cache.suggestions, cache.misses, cache.stores,
+         cache.compactions);
+  if (hits)
+    printf("avg hit %.1f us\n", cache.hit_us_total / hits);
+  if (cache.misses)
+    printf("avg similarity search %.1f us\n",
+           cache.fuzzy_us_total / cache.misses);
+  print_bundle_stats();
+#ifndef _WIN32
+  print_shm_stats();
+#endif
+}
+
+/* Offline Intents: common requests (disk usage, who owns a port, extract an
+ * archive, ...) are recognised locally and rendered from built-in templates
+ * for the current platform, with no API round trip. Matching is
+ * conservative: every word must be a known keyword, filler, or slot
+ * (path, port, size, count), so anything unusual still goes to the API. */
+enum {
+  K_SHOW = 1 << 0,
+  K_SIZE = 1 << 1,
+  K_FREE = 1 << 2,
+  K_DISK = 1 << 3,
+  K_DIR = 1 << 4,
+  K_FILE = 1 << 5,
+  K_LARGE = 1 << 6,
+  K_FIND = 1 << 7,
+  K_PORT = 1 << 8,
+  K_LISTEN = 1 << 9,
+  K_PROCESS = 1 << 10,
+  K_KILL = 1 << 11,
+  K_EXTRACT = 1 << 12,
+  K_COUNT = 1 << 13,
+  K_LINE = 1 << 14,
+  K_MEM = 1 << 15,
+};
+
+enum { S_PATH = 1, S_PORT = 2, S_SIZE = 4, S_NUM = 8 };
+
+enum { PLAT_GNU, PLAT_BSD, PLAT_PS, PLAT_CMD, N_PLATFORMS };
+
+typedef struct {
+  const char *word;
+  unsigned bits; /* 0: neutral, allowed in any intent */
+} IntentKeyword;
+
+/* Sorted by word for bsearch; filler words are handled by is_filler */
+static const IntentKeyword intent_keywords[] = {
+    {"above", K_LARGE},     {"available", K_FREE},  {"big", K_LARGE},
+    {"bigger", K_LARGE},    {"biggest", K_LARGE},   {"bound", K_LISTEN},
+    {"check", K_SHOW},      {"count", K_COUNT},     {"cwd", K_DIR},
+    {"decompress", K_EXTRACT}, {"dir", K_DIR},      {"directory", K_DIR},
+    {"disk", K_DISK},       {"display", K_SHOW},    {"does", 0},
+    {"drive", K_DISK},      {"drives", K_DISK},     {"exceeding", K_LARGE},
+    {"extract", K_EXTRACT}, {"file", K_FILE},       {"files", K_FILE},
+    {"filesystem", K_DISK}, {"find", K_FIND},       {"folder", K_DIR},
+    {"free", K_FREE},       {"get", K_SHOW},        {"greater", K_LARGE},
+    {"here", K_DIR},        {"huge", K_LARGE},      {"kill", K_KILL},
+    {"large", K_LARGE},     {"larger", K_LARGE},    {"largest", K_LARGE},
+    {"left", K_FREE},       {"line", K_LINE},       {"lines", K_LINE},
+    {"list", K_SHOW},       {"listen", K_LISTEN},   {"listening", K_LISTEN},
+    {"locate", K_FIND},     {"many", K_COUNT},      {"mem", K_MEM},
+    {"memory", K_MEM},      {"much", 0},            {"number", K_COUNT},
+    {"open", K_LISTEN},     {"over", K_LARGE},      {"partition", K_DISK},
+    {"partitions", K_DISK}, {"pid", K_PROCESS},     {"port", K_PORT},
+    {"ports", K_PORT},      {"print", K_SHOW},      {"process", K_PROCESS},
+    {"processes", K_PROCESS}, {"program", K_PROCESS}, {"ram", K_MEM},
+    {"recursively", 0},     {"remaining", K_FREE},  {"running", 0},
+    {"search", K_FIND},     {"see", K_SHOW},        {"show", K_SHOW},
+    {"size", K_SIZE},       {"space", K_SIZE},      {"stop", K_KILL},
+    {"take", 0},            {"takes", 0},           {"tell", K_SHOW},
+    {"terminate", K_KILL},  {"top", 0},             {"unpack", K_EXTRACT},
+    {"untar", K_EXTRACT},   {"unzip", K_EXTRACT},   {"usage", K_SIZE},
+    {"used", K_SIZE},       {"uses", 0},            {"using", 0},
+    {"view", K_SHOW},       {"who", 0},             {"whose", 0},
+};
+
+typedef struct {
+  const char *name;
+  unsigned need, opt;           /* Keyword bits */
+  unsigned slots_need, slots_opt;
+  const char *tmpl[N_PLATFORMS]; /* NULL leaves the platform to the API */
+} Intent;
+
+/* Templates: {path} (default "."), {?path} (" path" or nothing), {port},
+ * {size} (find units), {psize} (PowerShell units), {num} (default 20) and
+ * {extract}. Other braces are literal. */
+static const Intent intents[] = {
+    {"disk-usage", K_SIZE, K_SHOW | K_DISK | K_DIR | K_FILE, 0, S_PATH,
+     {"du -sh {path}", "du -sh {path}",
+      "\"{0:N1} MB\" -f ((Get-ChildItem {path} -Recurse -File | "
+      "Measure-Object Length -Sum).Sum / 1MB)",
+      "dir /s {path}"}},
+    {"disk-free", K_FREE, K_SHOW | K_DISK | K_SIZE, 0, S_PATH,
+     {"df -h{?path}", "df -h{?path}", "Get-PSDrive -PSProvider FileSystem",
+      "wmic logicaldisk get caption,freespace,size"}},
+    {"memory", K_MEM, K_SHOW | K_FREE | K_SIZE, 0, 0,
+     {"free -h", "vm_stat",
+      "Get-CimInstance Win32_OperatingSystem | Select-Object "
+      "FreePhysicalMemory, TotalVisibleMemorySize",
+      "systeminfo | findstr /c:\"Memory\""}},
+    {"listening-ports", K_PORT, K_SHOW | K_LISTEN | K_PROCESS | K_FIND, 0, 0,
+     {"ss -tulpn", "lsof -nP -iTCP -sTCP:LISTEN",
+      "Get-NetTCPConnection -State Listen",
+      "netstat -ano | findstr LISTENING"}},
+    {"port-owner", K_PORT, K_SHOW | K_LISTEN | K_PROCESS | K_FIND, S_PORT, 0,
+     {"ss -tulpn 'sport = :{port}'", "lsof -nP -i :{port}",
+      "Get-Process -Id (Get-NetTCPConnection -LocalPort {port}).OwningProcess",
+      "netstat -ano | findstr :{port}"}},
+    {"kill-port", K_KILL | K_PORT, K_PROCESS | K_LISTEN, S_PORT, 0,
+     {"fuser -k {port}/tcp", "kill $(lsof -t -i :{port})",
+      "Stop-Process -Id (Get-NetTCPConnection -LocalPort "
+      "{port}).OwningProcess",
+      NULL}},
+    {"extract", K_EXTRACT, K_FILE, S_PATH, 0,
+     {"{extract}", "{extract}", "{extract}", "{extract}"}},
+    {"count-lines", K_COUNT | K_LINE, K_FILE | K_SHOW, S_PATH, 0,
+     {"wc -l {path}", "wc -l {path}",
+      "(Get-Content {path} | Measure-Object -Line).Lines",
+      "find /c /v \"\" {path}"}},
+    {"files-over", K_FILE | K_LARGE, K_SHOW | K_FIND | K_DIR, S_SIZE, S_PATH,
+     {"find {path} -type f -size +{size}", "find {path} -type f -size +{size}",
+      "Get-ChildItem {path} -Recurse -File | Where-Object Length -gt {psize}",
+      NULL}},
+    {"largest-files", K_FILE | K_LARGE, K_SHOW | K_FIND | K_DIR | K_SIZE, 0,
+     S_PATH | S_NUM,
+     {"find {path} -type f -exec du -h {} + | sort -rh | head -n {num}",
+      "find {path} -type f -exec du -h {} + | sort -rh | head -n {num}",
+      "Get-ChildItem {path} -Recurse -File | Sort-Object Length -Descending "
+      "| Select-Object -First {num} FullName, Length",
+      NULL}},
+};
+#define N_INTENTS (sizeof(intents) / sizeof(*intents))
+
+/* Archive suffix -> extraction command per platform; Windows 10+ ships a
+ * bsdtar that also reads zip */
+static const struct {
+  const char *suffix;
+  const char *tmpl[N_PLATFORMS];
+} extractors[] = {
+    {".tar.gz", {"tar -xzf {path}", "tar -xzf {path}", "tar -xzf {path}",
+                 "tar -xzf {path}"}},
+    {".tgz", {"tar -xzf {path}", "tar -xzf {path}", "tar -xzf {path}",
+              "tar -xzf {path}"}},
+    {".tar.bz2", {"tar -xjf {path}", "tar -xjf {path}", "tar -xjf {path}",
+                  "tar -xjf {path}"}},
+    {".tar.xz", {"tar -xJf {path}", "tar -xJf {path}", "tar -xJf {path}",
+                 "tar -xJf {path}"}},
+    {".tar", {"tar -xf {path}", "tar -xf {path}", "tar -xf {path}",
+              "tar -xf {path}"}},
+    {".zip", {"unzip {path}", "unzip {path}",
+              "Expand-Archive -Path {path} -DestinationPath .",
+              "tar -xf {path}"}},
+    {".gz", {"gunzip -k {path}", "gunzip -k {path}", NULL, NULL}},
+    {".7z", {"7z x {path}", "7z x {path}", "7z x {path}", "7z x {path}"}},
+    {".rar", {"unrar x {path}", "unrar x {path}", NULL, NULL}},
+};
+
+typedef struct {
+  unsigned bits, slots;
+  char path[512];
+  unsigned port;
+  unsigned long long size; /* Bytes */
+  unsigned num;
+} IntentQuery;
+
+static int keyword_cmp(const void *key, const void *elem) {
+  return strcmp(key, ((const IntentKeyword *)elem)->word);
+}
+
+static int platform_family(const EnvContext *env) {
+  char shell[sizeof(env->shell)];
+  size_t i = 0;
+  for (; env->shell[i] && i + 1 < sizeof(shell); i++)
+    shell[i] = (char)tolower((unsigned char)env->shell[i]);
+  shell[i] = '\0';
+  if (strstr(shell, "pwsh") || strstr(shell, "powershell"))
+    return PLAT_PS;
+#ifdef _WIN32
+  return PLAT_CMD;
+#else
+  if (strncmp(env->os, "Darwin", 6) == 0 || strstr(env->os, "macOS") ||
+      strstr(env->os, "BSD"))
+    return PLAT_BSD;
+  return PLAT_GNU;
+#endif
+}
+
+/* "100M", "1.5gb", "2 GiB" (unit passed separately) -> bytes, 0 if not a
+ * size */
+static unsigned long long parse_size(const char *num, const char *unit) {
+  char *num_end;
+  double v = strtod(num, &num_end);
+  if (num_end == num || v <= 0 || !isdigit((unsigned char)num[0]))
+    return 0;
+  const char *end = *num_end || !unit ? num_end : unit;
+  static const char *units = "kmgt";
+  const char *u = strchr(units, tolower((unsigned char)*end));
+  if (!*end || !u)
+    return 0;
+  const char *rest = end + 1;
+  if (strcasecmp(rest, "") != 0 && strcasecmp(rest, "b") != 0 &&
+      strcasecmp(rest, "ib") != 0)
+    return 0;
+  for (const char *p = units; p <= u; p++)
+    v *= 1024;
+  return (unsigned long long)v;
+}
+
+static int all_digits(const char *s) {
+  if (!*s)
+    return 0;
+  for (; *s; s++)
+    if (!isdigit((unsigned char)*s))
+      return 0;
+  return 1;
+}
+
+static int path_like(const char *t) {
+  if (t[0] == '/' || t[0] == '~' || strncmp(t, "./", 2) == 0 ||
+      strncmp(t, "../", 3) == 0 || strchr(t, '/') || strchr(t, '\\'))
+    return 1;
+  const char *dot = strchr(t, '.');
+  return dot && dot > t && isalpha((unsigned char)dot[1]);
+}
+
+static int set_path(IntentQuery *q, const char *p, size_t len) {
+  if (q->slots & S_PATH || len == 0 || len >= sizeof(q->path))
+    return 0;
+  memcpy(q->path, p, len);
+  q->path[len] = '\0';
+  q->slots |= S_PATH;
+  return 1;
+}
+
+/* Fills q from the prompt; returns 0 on any word it cannot account for */
+static int parse_intent_query(const char *prompt, IntentQuery *q) {
+  memset(q, 0, sizeof(*q));
+  char tok[512], prev[32] = "";
+  const char *p = prompt;
+  for (;;) {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (!*p)
+      return 1;
+    if (*p == '"' || *p == '\'') { /* Quoted names are paths */
+      const char *end = strchr(p + 1, *p);
+      if (!end || !set_path(q, p + 1, (size_t)(end - p - 1)))
+        return 0;
+      p = end + 1;
+      continue;
+    }
+    size_t len = strcspn(p, " \t");
+    if (len >= sizeof(tok))
+      return 0;
+    memcpy(tok, p, len);
+    p += len;
+    while (len > 0 && strchr(",;?!.", tok[len - 1]))
+      len--;
+    tok[len] = '\0';
+    if (!len)
+      continue;
+
+    /* Slots */
+    const char *next = p + strspn(p, " \t");
+    char unit[8] = "";
+    size_t ulen = strcspn(next, " \t,;?!.");
+    if (ulen < sizeof(unit)) {
+      memcpy(unit, next, ulen);
+      unit[ulen] = '\0';
+    }
+    if (tok[0] == ':' && all_digits(tok + 1)) {
+      if (q->slots & S_PORT || atol(tok + 1) > 65535)
+        return 0;
+      q->port = (unsigned)atol(tok + 1);
+      q->slots |= S_PORT;
+      q->bits |= K_PORT;
+      continue;
+    }
+    if (all_digits(tok) && (strcmp(prev, "port") == 0 ||
+                            strcmp(prev, "ports") == 0)) {
+      if (q->slots & S_PORT || atol(tok) < 1 || atol(tok) > 65535)
+        return 0;
+      q->port = (unsigned)atol(tok);
+      q->slots |= S_PORT;
+      continue;
+    }
+    unsigned long long size = parse_size(tok, NULL);
+    if (!size && isdigit((unsigned char)tok[0]) &&
+        (size = parse_size(tok, unit)))
+      p = next + ulen; /* "100 MB": the unit was the next word */
+    if (size) {
+      if (q->slots & S_SIZE)
+        return 0;
+      q->size = size;
+      q->slots |= S_SIZE;
+      continue;
+    }
+    if (all_digits(tok)) {
+      if (q->slots & S_NUM || atol(tok) < 1 || atol(tok) > 100000)
+        return 0;
+      q->num = (unsigned)atol(tok);
+      q->slots |= S_NUM;
+      continue;
+    }
+    if (path_like(tok)) {
+      if (!set_path(q, tok, len))
+        return 0;
+      continue;
+    }
+
+    /* Keywords */
+    for (const char *w = tok; *w;) {
+      char word[32];
+      size_t wl = 0;
+      while (*w && !isalnum((unsigned char)*w))
+        w++;
+      while (isalnum((unsigned char)*w)) {
+        if (wl + 1 < sizeof(word))
+          word[wl++] = (char)tolower((unsigned char)*w);
+        w++;
+      }
+      if (!wl)
+        break;
+      word[wl] = '\0';
+      snprintf(prev, sizeof(prev), "%s", word);
+      if (is_filler(word) || (wl == 1 && word[0] == 's')) /* what's */
+        continue;
+      const IntentKeyword *kw =
+          bsearch(word, intent_keywords,
+                  sizeof(intent_keywords) / sizeof(*intent_keywords),
+                  sizeof(*intent_keywords), keyword_cmp);
+      if (kw) {
+        q->bits |= kw->bits;
+        continue;
+      }
+      /* An unknown word naming something in the CWD is a path */
+      struct stat st;
+      if (stat(tok, &st) != 0 || !set_path(q, tok, len))
+        return 0;
+      break;
+    }
+  }
+}
+
+static const Intent *match_intent(const IntentQuery *q) {
+  const Intent *best = NULL;
+  int best_weight = -1;
+  for (size_t i = 0; i < N_INTENTS; i++) {
+    const Intent *in = &intents[i];
+    if ((q->bits & in->need) != in->need || (q->bits & ~(in->need | in->opt)) ||
+        (q->slots & in->slots_need) != in->slots_need ||
+        (q->slots & ~(in->slots_need | in->slots_opt)))
+      continue;
+    int weight = 0;
+    for (unsigned b = in->need | in->slots_need; b; b &= b - 1)
+      weight++;
+    if (weight > best_weight) {
+      best_weight = weight;
+      best = in;
+    }
+  }
+  return best;
+}
+
+/* Appends arg to out, quoted for the platform when it needs it */
+static void quote_arg(StringBuffer *out, const char *arg, int plat) {
+  static const char *safe = "abcdefghijklmnopqrstuvwxyz"
+                            "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-./:@%+=,";
+  if (plat == PLAT_GNU || plat == PLAT_BSD) {
+    if (strncmp(arg, "~/", 2) == 0) { /* Keep tilde expansion */
+      sb_append(out, "~/");
+      arg += 2;
+    }
+    if (*arg && strspn(arg, safe) == strlen(arg)) {
+      sb_append(out, arg);
+      return;
+    }
+    sb_append(out, "'");
+    for (const char *c = arg; *c; c++)
+      sb_append(out, *c == '\'' ? "'\\''" : (char[]){*c, 0});
+    sb_append(out, "'");
+  } else if (plat == PLAT_PS) {
+    if (*arg && strspn(arg, safe) == strlen(arg) && arg[0] != '-') {
+      sb_append(out, arg);
+      return;
+    }
+    sb_append(out, "'");
+    for (const char *c = arg; *c; c++)
+      sb_append(out, *c == '\'' ? "''" : (char[]){*c, 0});
+    sb_append(out, "'");
+  } else {
+    int plain = *arg && strcspn(arg, " &|<>^()%!\"") == strlen(arg);
+    if (!plain)
+      sb_append(out, "\"");
+    sb_append(out, arg); /* cmd has no escape for '"' inside quotes */
+    if (!plain)
+      sb_append(out, "\"");
+  }
+}
+
+/* A path slot: quoted, except that a plain glob ("*.py", "src/x*.c") stays
+ * bare so the shell expands it; quotes would pass the literal pattern */
+static void path_arg(StringBuffer *out, const char *path, int plat) {
+  static const char *glob = "abcdefghijklmnopqrstuvwxyz"
+                            "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-./*?";
+  if ((plat == PLAT_GNU || plat == PLAT_BSD) && path[0] != '-' &&
+      strpbrk(path, "*?") && strspn(path, glob) == strlen(path))
+    sb_append(out, path);
+  else
+    quote_arg(out, path, plat);
+}
+
+/* Size in the largest unit that divides it exactly: find wants 100M,
+ * PowerShell 100MB */
+static void format_size_unit(unsigned long long bytes, int ps, char *out,
+                             size_t size) {
+  static const char *find_units[] = {"c", "k", "M", "G", "T"};
+  static const char *ps_units[] = {"", "KB", "MB", "GB", "TB"};
+  int u = 0;
+  while (u < 4 && bytes >= 1024 && bytes % 1024 == 0) {
+    bytes /= 1024;
+    u++;
+  }
+  snprintf(out, size, "%llu%s", bytes, ps ? ps_units[u] : find_units[u]);
+}
+
+/* Renders a template; returns NULL when the platform has no template or a
+ * slot cannot be filled */
+static char *render_intent(const char *tmpl, const IntentQuery *q, int plat) {
+  if (!tmpl)
+    return NULL;
+  StringBuffer out;
+  sb_init(&out);
+  for (const char *t = tmpl; *t;) {
+    const char *close = *t == '{' ? strchr(t, '}') : NULL;
+    if (!close || close == t + 1) {
+      sb_append_n(&out, t, 1);
+      t++;
+      continue;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "%.*s", (int)(close - t - 1), t + 1);
+    char buf[32];
+    if (strcmp(name, "path") == 0) {
+      path_arg(&out, q->slots & S_PATH ? q->path : ".", plat);
+    } else if (strcmp(name, "?path") == 0) {
+      if (q->slots & S_PATH) {
+        sb_append(&out, " ");
+        path_arg(&out, q->path, plat);
+      }
+    } else if (strcmp(name, "port") == 0) {
+      snprintf(buf, sizeof(buf), "%u", q->port);
+      sb_append(&out, buf);
+    } else if (strcmp(name, "size") == 0 || strcmp(name, "psize") == 0) {
+      format_size_unit(q->size, name[0] == 'p', buf, sizeof(buf));
+      sb_append(&out, buf);
+    } else if (strcmp(name, "num") == 0) {
+      snprintf(buf, sizeof(buf), "%u", q->slots & S_NUM ? q->num : 20);
+      sb_append(&out, buf);
+    } else if (strcmp(name, "extract") == 0) {
+      size_t plen = strlen(q->path);
+      char *cmd = NULL;
+      for (size_t i = 0; i < sizeof(extractors) / sizeof(*extractors); i++) {
+        size_t slen = strlen(extractors[i].suffix);
+        if (plen > slen &&
+            strcasecmp(q->path + plen - slen, extractors[i].suffix) == 0) {
+          cmd = render_intent(extractors[i].tmpl[plat], q, plat);
+          break;
+        }
+      }
+      if (!cmd) {
+        sb_free(&out);
+        return NULL;
+      }
+      sb_append(&out, cmd);
+      free(cmd);
+    } else {
+      sb_append_n(&out, t, (size_t)(close - t + 1));
+    }
+    t = close + 1;
+  }
+  return out.data;
+}
+
+/* Offline answer for prompt, or NULL; *name is the matched intent */
+static char *offline_intent(const EnvContext *env, const char *prompt,
+                            const char **name) {
+  IntentQuery q;
+  if (!parse_intent_query(prompt, &q))
+    return NULL;
+  const Intent *in = match_intent(&q);
+  if (!in)
+    return NULL;
+  int plat = platform_family(env);
+  *name = in->name;
+  return render_intent(in->tmpl[plat], &q, plat);
+}
+
+/* Command Templates: literals (numbers, sizes, durations, quoted names,
+ * paths) are abstracted out of the prompt, so "files over 100MB" and
+ * "files over 2GB" share one cache entry. When an answer is stored, each
+ * literal is located in the command in some form (100MB as 100M, 3 days
+ * as -mtime +3 or -mmin +4320) and replaced by a \x1f-delimited slot
+ * reference; a hit re-renders the slots from the new prompt. Anything
+ * ambiguous is simply not templated. */
+#define CANON_MAX_SLOTS 4
+#define SLOT_MARK '\x1f'
+
+enum { LIT_NUM, LIT_SIZE, LIT_DUR, LIT_WORD };
+
+typedef struct {
+  int type;
+  char text[256];           /* Words as written, without quotes */
+  unsigned long long value; /* Number, bytes or seconds */
+} Literal;
+
+typedef struct {
+  char canon[CACHE_PROMPT_MAX + 1];
+  Literal lit[CANON_MAX_SLOTS];
+  size_t n;
+} CanonPrompt;
+
+static const struct {
+  const char *name;
+  unsigned long long secs;
+} duration_units[] = {
+    {"s", 1},         {"sec", 1},       {"secs", 1},       {"second", 1},
+    {"seconds", 1},   {"min", 60},      {"mins", 60},      {"minute", 60},
+    {"minutes", 60},  {"h", 3600},      {"hr", 3600},      {"hrs", 3600},
+    {"hour", 3600},   {"hours", 3600},  {"d", 86400},      {"day", 86400},
+    {"days", 86400},  {"w", 604800},    {"week", 604800},  {"weeks", 604800},
+    {"month", 2592000}, {"months", 2592000}, {"year", 31536000},
+    {"years", 31536000},
+};
+
+/* Seconds for "3 days" / "2h" style input, 0 if not a duration */
+static unsigned long long parse_duration(const char *num, const char *unit) {
+  char *end;
+  unsigned long long n = strtoull(num, &end, 10);
+  if (end == num || !isdigit((unsigned char)num[0]) || n == 0)
+    return 0;
+  const char *u = *end ? end : unit;
+  if (!u)
+    return 0;
+  for (size_t i = 0; i < sizeof(duration_units) / sizeof(*duration_units);
+       i++) {
+    /* Attached units must be unambiguous: 5d, 2h, 30min (5m is a size) */
+    if (strcasecmp(u, duration_units[i].name) == 0 &&
+        (!*end || strlen(u) > 1 || *u == 'd' || *u == 'h' || *u == 'w'))
+      return n * duration_units[i].secs;
+  }
+  return 0;
+}
+
+/* Splits literals out of a normalized prompt; returns the slot count, or 0
+ * (with no template) when there are none or too many */
+static size_t canonicalize_prompt(const char *norm, CanonPrompt *cp) {
+  StringBuffer out;
+  sb_init(&out);
+  cp->n = 0;
+  int overflow = 0;
+  for (const char *p = norm; *p;) {
+    if (*p == ' ') {
+      sb_append_n(&out, p++, 1);
+      continue;
+    }
+    Literal lit = {0};
+    const char *placeholder = NULL;
+    size_t len = strcspn(p, " ");
+    const char *close = NULL;
+    if ((*p == '\'' || *p == '"') && (close = strchr(p + 1, *p)) &&
+        close - p - 1 < (long)sizeof(lit.text) && close > p + 1) {
+      lit.type = LIT_WORD;
+      snprintf(lit.text, sizeof(lit.text), "%.*s", (int)(close - p - 1),
+               p + 1);
+      placeholder = "<str>";
+      len = (size_t)(close - p + 1);
+    } else if (len < sizeof(lit.text)) {
+      char tok[sizeof(lit.text)], unit[16] = "";
+      snprintf(tok, sizeof(tok), "%.*s", (int)len, p);
+      const char *next = p + len + (p[len] == ' ');
+      size_t ulen = strcspn(next, " ");
+      if (*next && ulen < sizeof(unit))
+        snprintf(unit, sizeof(unit), "%.*s", (int)ulen, next);
+      unsigned long long dur = parse_duration(tok, NULL), size = 0;
+      int with_unit = 0; /* "3 days": the unit is the next word */
+      if (!dur && all_digits(tok) && unit[0])
+        with_unit = (dur = parse_duration(tok, unit)) != 0;
+      if (!dur && !(size = parse_size(tok, NULL)) &&
+          isdigit((unsigned char)tok[0]) && unit[0])
+        with_unit = (size = parse_size(tok, unit)) != 0;
+      if (with_unit)
+        len = (size_t)(next + ulen - p);
+      if (dur) {
+        lit.type = LIT_DUR;
+        lit.value = dur;
+        placeholder = "<dur>";
+      } else if (size) {
+        lit.type = LIT_SIZE;
+        lit.value = size;
+        placeholder = "<size>";
+      } else if (all_digits(tok) && len < 10) {
+        lit.type = LIT_NUM;
+        lit.value = strtoull(tok, NULL, 10);
+        placeholder = "<n>";
+      } else if (path_like(tok)) {
+        lit.type = LIT_WORD;
+        snprintf(lit.text, sizeof(lit.text), "%s", tok);
+        placeholder = "<path>";
+      } else if (isdigit((unsigned char)tok[0]) && strchr(tok, '.') &&
+                 strspn(tok, "0123456789.:") == len) {
+        lit.type = LIT_WORD; /* Addresses and versions: 10.0.0.1, 3.12 */
+        snprintf(lit.text, sizeof(lit.text), "%s", tok);
+        placeholder = "<addr>";
+      }
+    }
+    if (placeholder && cp->n < CANON_MAX_SLOTS) {
+      cp->lit[cp->n++] = lit;
+      sb_append(&out, placeholder);
+    } else {
+      overflow |= placeholder != NULL;
+      sb_append_n(&out, p, len);
+    }
+    p += len;
+  }
+  snprintf(cp->canon, sizeof(cp->canon), "%s", out.data ? out.data : "");
+  sb_free(&out);
+  if (overflow)
+    cp->n = 0;
+  return cp->n;
+}
+
+/* Text of slot l in form f; returns 0 when the value does not fit the form
+ * (e.g. 5 hours as whole days) */
+static int literal_form(const Literal *l, char f, int plat, StringBuffer *out) {
+  char buf[32];
+  static const struct {
+    char form;
+    unsigned long long secs;
+  } dur_forms[] = {{'d', 86400}, {'h', 3600}, {'m', 60}, {'s', 1},
+                   {'w', 604800}};
+  switch (l->type) {
+  case LIT_NUM:
+    snprintf(buf, sizeof(buf), "%llu", l->value);
+    break;
+  case LIT_SIZE:
+    if (f == 'b') {
+      snprintf(buf, sizeof(buf), "%llu", l->value);
+    } else {
+      format_size_unit(l->value, f == 'p', buf, sizeof(buf));
+      if (f == 'l')
+        for (char *c = buf; *c; c++)
+          *c = (char)tolower((unsigned char)*c);
+    }
+    break;
+  case LIT_DUR:
+    for (size_t i = 0; i < sizeof(dur_forms) / sizeof(*dur_forms); i++)
+      if (dur_forms[i].form == f) {
+        if (l->value % dur_forms[i].secs)
+          return 0;
+        snprintf(buf, sizeof(buf), "%llu", l->value / dur_forms[i].secs);
+        sb_append(out, buf);
+        return 1;
+      }
+    return 0;
+  default:
+    quote_arg(out, l->text, plat);
+    return 1;
+  }
+  sb_append(out, buf);
+  return 1;
+}
+
+typedef struct {
+  size_t start, len;
+  size_t slot;
+  char form;
+} SlotSpan;
+
+static int is_word_char(char c) {
+  return isalnum((unsigned char)c) || (c && strchr("_./~-", c));
+}
+
+/* Whether cmd[0..end) leaves a single or double quote open */
+static int in_quotes(const char *cmd, const char *end) {
+  char q = 0;
+  for (const char *p = cmd; p < end; p++) {
+    if (q != '\'' && *p == '\\' && p + 1 < end)
+      p++;
+    else if (q && *p == q)
+      q = 0;
+    else if (!q && (*p == '\'' || *p == '"'))
+      q = *p;
+  }
+  return q != 0;
+}
+
+/* Finds needle in cmd at token boundaries; numbers must not touch a
+ * redirection or variable (2>/dev/null, $1). Spans inside quotes are
+ * never slots: the value is quoted when rendered, and quotes within
+ * quotes would let it break out ('a;touch x;b'). */
+static size_t find_bounded(const char *cmd, const char *needle, int numeric,
+                           SlotSpan *spans, size_t max, size_t slot,
+                           char form) {
+  size_t n = 0, nl = strlen(needle);
+  for (const char *h = strstr(cmd, needle); h && nl;
+       h = strstr(h + 1, needle)) {
+    if (in_quotes(cmd, h))
+      continue;
+    char before = h > cmd ? h[-1] : ' ', after = h[nl] ? h[nl] : ' ';
+    if (numeric ? (isalnum((unsigned char)before) || strchr("._$&", before) ||
+                   isalnum((unsigned char)after) || strchr("._>&", after))
+                : (is_word_char(before) || is_word_char(after)))
+      continue;
+    if (n < max)
+      spans[n] = (SlotSpan){(size_t)(h - cmd), nl, slot, form};
+    n++;
+  }
+  return n;
+}
+
+static int span_cmp(const void *a, const void *b) {
+  size_t x = ((const SlotSpan *)a)->start, y = ((const SlotSpan *)b)->start;
+  return (x > y) - (x < y);
+}
+
+/* Command -> template with slot references; NULL unless every literal was
+ * found unambiguously */
+static char *templatize_command(const char *cmd, const CanonPrompt *cp,
+                                int plat) {
+  SlotSpan spans[16];
+  size_t n_spans = 0;
+  for (size_t i = 0; i < cp->n; i++) {
+    const Literal *l = &cp->lit[i];
+    const char *forms = l->type == LIT_NUM    ? "n"
+                        : l->type == LIT_SIZE ? "pflb"
+                        : l->type == LIT_DUR  ? "dhmsw"
+                                              : "s";
+    size_t found = 0;
+    for (const char *f = forms; *f && !found; f++) {
+      StringBuffer form;
+      sb_init(&form);
+      if (!literal_form(l, *f, plat, &form) || !form.data) {
+        sb_free(&form);
+        continue;
+      }
+      size_t room = sizeof(spans) / sizeof(*spans) - n_spans;
+      if (l->type == LIT_WORD) {
+        /* Quoted as the command has it, or bare if it needs no quoting */
+        char *quoted[3] = {NULL, NULL, NULL};
+        size_t tl = strlen(l->text);
+        if ((quoted[0] = malloc(tl + 3)))
+          snprintf(quoted[0], tl + 3, "'%s'", l->text);
+        if ((quoted[1] = malloc(tl + 3)))
+          snprintf(quoted[1], tl + 3, "\"%s\"", l->text);
+        if (strcmp(form.data, l->text) == 0)
+          quoted[2] = strdup(l->text);
+        for (int q = 0; q < 3 && !found; q++)
+          if (quoted[q])
+            found = find_bounded(cmd, quoted[q], 0, spans + n_spans, room, i,
+                                 's');
+        for (int q = 0; q < 3; q++)
+          free(quoted[q]);
+      } else {
+        found = find_bounded(cmd, form.data, 1, spans + n_spans, room, i, *f);
+        if (found > 1)
+          found = 0; /* "1" twice: cannot tell which one is ours */
+      }
+      sb_free(&form);
+    }
+    if (!found || found > sizeof(spans) / sizeof(*spans) - n_spans)
+      return NULL;
+    n_spans += found;
+  }
+
+  qsort(spans, n_spans, sizeof(*spans), span_cmp);
+  StringBuffer out;
+  sb_init(&out);
+  size_t pos = 0;
+  for (size_t i = 0; i < n_spans; i++) {
+    if (spans[i].start < pos) { /* Overlapping literals */
+      sb_free(&out);
+      return NULL;
+    }
+    char ref[4] = {SLOT_MARK, (char)('0' + spans[i].slot), spans[i].form,
+                   SLOT_MARK};
+    sb_append_n(&out, cmd + pos, spans[i].start - pos);
+    sb_append_n(&out, ref, sizeof(ref));
+    pos = spans[i].start + spans[i].len;
+  }
+  sb_append(&out, cmd + pos);
+  return out.data;
+}
+
+static char *render_template(const char *tmpl, const CanonPrompt *cp,
+                             int plat) {
+  StringBuffer out;
+  sb_init(&out);
+  for (const char *t = tmpl; *t;) {
+    const char *mark = strchr(t, SLOT_MARK);
+    if (!mark) {
+      sb_append(&out, t);
+      break;
+    }
+    sb_append_n(&out, t, (size_t)(mark - t));
+    size_t slot = (size_t)(mark[1] - '0');
+    /* Templates from older caches or other people's bundles may still
+     * have a slot inside quotes */
+    if (!mark[1] || !mark[2] || mark[3] != SLOT_MARK || slot >= cp->n ||
+        in_quotes(out.data, out.data + out.len) ||
+        !literal_form(&cp->lit[slot], mark[2], plat, &out)) {
+      sb_free(&out);
+      return NULL;
+    }
+    t = mark + 4;
+  }
+  return out.data;
+}
+
+/* Cache Bundles: `comgen cache export` writes the current user's cached
+ * answers to a file that can be shared, e.g. with dotfiles, and `comgen
+ * cache import` merges bundles into ~/.config/comgen/bundle. Keys are the
+ * normalized (or canonical template) prompt hashes, which do not depend on
+ * the machine, tagged with the platform family. The layout is a header, a
+ * key-sorted entry table and a string pool, all fixed-width little-endian,
+ * so the installed bundle is mmap'd and binary searched as is. */
+#define BUNDLE_MAGIC 0x4e424743u /* "CGBN" */
+#define BUNDLE_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t pool_size;
+  uint32_t check; /* Of the entries and pool */
+  uint32_t reserved;
+  int64_t created;
+} BundleHeader;
+
+typedef struct {
+  uint64_t key; /* CacheKey.prompt */
+  int64_t created;
+  uint32_t prompt_off, cmd_off; /* Into the string pool */
+  uint16_t prompt_len, cmd_len;
+  uint8_t flags; /* CACHE_F_* */
+  uint8_t plat;  /* PLAT_* */
+  uint16_t reserved;
+} BundleEntry;
+
+typedef struct {
+  MappedFile map;
+  const BundleHeader *h;
+  const BundleEntry *entries;
+  const char *pool;
+} Bundle;
+
+static struct {
+  int loaded;
+  Bundle b;
+  unsigned long hits;
+} bundle;
+
+static int bundle_entry_cmp(const void *a, const void *b) {
+  const BundleEntry *x = a, *y = b;
+  if (x->key != y->key)
+    return (x->key > y->key) - (x->key < y->key);
+  if (x->plat != y->plat)
+    return x->plat - y->plat;
+  return (x->created < y->created) - (x->created > y->created);
+}
+
+static uint32_t bundle_check(const char *data, size_t size) {
+  uint64_t h = hash_bytes(data, size, HASH_SEED ^ BUNDLE_MAGIC);
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Maps and validates the layout; verify also checks the checksum, every
+ * string range and the sort order, for bundles from elsewhere */
+static int bundle_open(const char *path, Bundle *b, int verify) {
+  memset(b, 0, sizeof(*b));
+  if (!map_file(path, &b->map))
+    return 0;
+  const BundleHeader *h = (const BundleHeader *)b->map.data;
+  size_t body = b->map.size - sizeof(*h); /* Checked first below */
+  if (b->map.size < sizeof(*h) || h->magic != BUNDLE_MAGIC ||
+      h->version != BUNDLE_VERSION ||
+      (uint64_t)h->count * sizeof(BundleEntry) + h->pool_size != body ||
+      (verify && bundle_check(b->map.data + sizeof(*h), body) != h->check)) {
+    unmap_file(&b->map);
+    return 0;
+  }
+  b->h = h;
+  b->entries = (const BundleEntry *)(h + 1);
+  b->pool = (const char *)(b->entries + h->count);
+  for (uint32_t i = 0; verify && i < h->count; i++) {
+    const BundleEntry *e = &b->entries[i];
+    if ((uint64_t)e->prompt_off + e->prompt_len > h->pool_size ||
+        (uint64_t)e->cmd_off + e->cmd_len > h->pool_size ||
+        e->plat >= N_PLATFORMS ||
+        (i && bundle_entry_cmp(&b->entries[i - 1], e) > 0)) {
+      unmap_file(&b->map);
+      b->h = NULL;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void bundle_load(void) {
+  if (bundle.loaded)
+    return;
+  char path[1024];
+  get_config_file(path, sizeof(path), "bundle");
+  bundle_open(path, &bundle.b, 0);
+  bundle.loaded = 1;
+}
+
+/* Command for prompt (normalized, or canonical with CACHE_F_TEMPLATE),
+ * whose hash is key, on this platform from the installed bundle, or
+ * NULL. The stored prompt must match too: the hash alone may collide. */
+static char *bundle_lookup(uint64_t key, const char *prompt, int plat,
+                           uint32_t flags) {
+  bundle_load();
+  const Bundle *b = &bundle.b;
+  if (!b->h)
+    return NULL;
+  size_t lo = 0, hi = b->h->count;
+  while (lo < hi) { /* First entry with this key */
+    size_t mid = lo + (hi - lo) / 2;
+    if (b->entries[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < b->h->count && b->entries[lo].key == key; lo++) {
+    const BundleEntry *e = &b->entries[lo];
+    if (e->plat != plat || (e->flags & CACHE_F_TEMPLATE) != flags ||
+        (uint64_t)e->cmd_off + e->cmd_len > b->h->pool_size ||
+        (uint64_t)e->prompt_off + e->prompt_len > b->h->pool_size ||
+        e->prompt_len != strlen(prompt) ||
+        memcmp(b->pool + e->prompt_off, prompt, e->prompt_len) != 0)
+      continue;
+    char *out = malloc(e->cmd_len + 1u);
+    if (out) {
+      memcpy(out, b->pool + e->cmd_off, e->cmd_len);
+      out[e->cmd_len] = '\0';
+    }
+    return out;
+  }
+  return NULL;
+}
+
+/* Writes entries (sorted; strings in their source pools) as a bundle */
+typedef struct {
+  BundleEntry e;
+  const char *prompt, *cmd;
+} BundleItem;
+
+static int bundle_item_cmp(const void *a, const void *b) {
+  return bundle_entry_cmp(&((const BundleItem *)a)->e,
+                          &((const BundleItem *)b)->e);
+}
+
+static int bundle_write(const char *path, BundleItem *items, size_t n) {
+  StringBuffer data;
+  sb_init(&data);
+  if (!data.data)
+    return 0;
+  BundleHeader h = {BUNDLE_MAGIC, BUNDLE_VERSION, (uint32_t)n, 0, 0, 0,
+                    (int64_t)time(NULL)};
+  sb_append_n(&data, (const char *)&h, sizeof(h));
+  size_t table = data.len;
+  for (size_t i = 0; i < n; i++)
+    sb_append_n(&data, (const char *)&items[i].e, sizeof(BundleEntry));
+  if (data.len != table + n * sizeof(BundleEntry)) {
+    sb_free(&data);
+    return 0;
+  }
+  size_t pool = data.len;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t prompt_off = (uint32_t)(data.len - pool);
+    sb_append_n(&data, items[i].prompt, items[i].e.prompt_len);
+    uint32_t cmd_off = (uint32_t)(data.len - pool);
+    sb_append_n(&data, items[i].cmd, items[i].e.cmd_len);
+    /* Appends may move the buffer */
+    BundleEntry *e = (BundleEntry *)(data.data + table) + i;
+    e->prompt_off = prompt_off;
+    e->cmd_off = cmd_off;
+  }
+  BundleHeader *hp = (BundleHeader *)data.data;
+  hp->pool_size = (uint32_t)(data.len - pool);
+  hp->check = bundle_check(data.data + sizeof(h), data.len - sizeof(h));
+
+  char tmp[1100];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *fp = fopen(tmp, "wb");
+  int ok = fp && fwrite(data.data, 1, data.len, fp) == data.len;
+  if (fp)
+    ok &= fclose(fp) == 0;
+  sb_free(&data);
+#ifdef _WIN32
+  if (ok)
+    unlink(path);
+#endif
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return 0;
+  }
+  return 1;
+}
+
+/* The latest live answer per prompt for this model, OS, shell and user;
+ * answers from every directory are included */
+static int bundle_export(const ComgenSession *session, const char *path) {
+  CacheKey here;
+  cache_make_key(session, &env_ctx, "", &here);
+  cache_sync();
+  BundleItem *items = malloc((cache.used + 1) * sizeof(BundleItem));
+  if (!items)
+    return 1;
+  size_t n = 0;
+  int plat = platform_family(&env_ctx);
+  for (size_t i = 0; i < cache.nslots; i++) {
+    const CacheRecord *r = cache_record_at(cache.slots[i].off);
+    if (!cache.slots[i].off || !r || r->key.env != here.env ||
+        cache_expired(r->created))
+      continue;
+    BundleItem *it = &items[n++];
+    memset(&it->e, 0, sizeof(it->e));
+    it->e.key = r->key.prompt;
+    it->e.created = r->created;
+    it->e.prompt_len = r->prompt_len;
+    it->e.cmd_len = r->cmd_len;
+    it->e.flags = (uint8_t)r->flags;
+    it->e.plat = (uint8_t)plat;
+    it->prompt = (const char *)(r + 1);
+    it->cmd = it->prompt + r->prompt_len;
+  }
+  /* The same prompt asked in several directories: keep the newest */
+  qsort(items, n, sizeof(*items), bundle_item_cmp);
+  size_t u = 0;
+  for (size_t i = 0; i < n; i++)
+    if (!u || items[i].e.key != items[u - 1].e.key)
+      items[u++] = items[i];
+  int ok = bundle_write(path, items, u);
+  free(items);
+  if (!ok) {
+    fprintf(stderr, C_RED "Could not write %s" C_RESET "\n", path);
+    return 1;
+  }
+  printf(C_GREEN "Exported %zu answers to %s" C_RESET "\n", u, path);
+  return 0;
+}
+
+/* Merges bundles into the installed one: each incoming bundle is already
+ * sorted, so one sort of the concatenation (O(n log n)) and a linear pass
+ * that keeps the newest entry per key and platform suffice */
+static int bundle_import(char **files, int n_files) {
+  char path[1024];
+  get_config_file(path, sizeof(path), "bundle");
+  if (!ensure_config_dir())
+    return 1;
+  Bundle *src = calloc((size_t)n_files + 1, sizeof(Bundle));
+  if (!src)
+    return 1;
+  int rc = 0;
+  size_t total = 0, n_src = 0;
+  bundle_open(path, &src[n_src], 1);
+  if (src[n_src].h)
+    total += src[n_src++].h->count;
+  size_t existing = total;
+  for (int i = 0; i < n_files; i++) {
+    if (!bundle_open(files[i], &src[n_src], 1)) {
+      fprintf(stderr, C_RED "%s: not a valid comgen bundle" C_RESET "\n",
+              files[i]);
+      rc = 1;
+      continue;
+    }
+    total += src[n_src++].h->count;
+  }
+
+  BundleItem *items = malloc((total + 1) * sizeof(BundleItem));
+  size_t n = 0, u = 0;
+  for (size_t s = 0; items && s < n_src; s++)
+    for (uint32_t i = 0; i < src[s].h->count; i++) {
+      const BundleEntry *e = &src[s].entries[i];
+      items[n].e = *e;
+      items[n].prompt = src[s].pool + e->prompt_off;
+      items[n++].cmd = src[s].pool + e->cmd_off;
+    }
+  if (items) {
+    qsort(items, n, sizeof(*items), bundle_item_cmp);
+    for (size_t i = 0; i < n; i++)
+      if (!u || items[i].e.key != items[u - 1].e.key ||
+          items[i].e.plat != items[u - 1].e.plat)
+        items[u++] = items[i];
+  }
+  if (!items || (n_src && !bundle_write(path, items, u))) {
+    fprintf(stderr, C_RED "Could not write %s" C_RESET "\n", path);
+    rc = 1;
+  } else if (n_src) {
+    printf(C_GREEN "Bundle has %zu answers (%zu new) in %s" C_RESET "\n", u,
+           u - (existing < u ? existing : u), path);
+  }
+  free(items);
+  for (size_t s = 0; s < n_src; s++)
+    unmap_file(&src[s].map);
+  free(src);
+  return rc;
+}
+
+static void print_bundle_stats(void) {
+  bundle_load();
+  if (bundle.b.h)
+    printf("bundle  %u team answers, %lu hits\n", bundle.b.h->count,
+           bundle.hits);
+}
+
+#ifndef _WIN32
+/* Shared Cache (opt-in, shared_cache=<name> in the config): a
+ * system-wide table of answers in POSIX shared memory, so users of one
+ * host reuse each other's answers to environment-level prompts. Entries
+ * are partitioned by a fingerprint of model, OS, shell and platform, so a
+ * hit is only seen by users it is valid for; answers naming the user,
+ * their home or their directory are not published, and entries expire
+ * after SHM_TTL_SECS. Open addressing over fixed-size
+ * slots, each guarded by a seqlock: readers copy a slot and retry if its
+ * sequence changed, so lookups take no lock and no syscall; a writer
+ * claims a slot by CAS on an even sequence and skips it if another
+ * writer holds it. The segment is mode 0660 in its creator's primary
+ * group: everyone in that group can add answers the others are shown. */
+#define SHM_MAGIC 0x4d484743u /* "CGHM" */
+#define SHM_VERSION 1
+#define SHM_SLOTS 16384
+#define SHM_PROBE 8
+#define SHM_CMD_MAX 472
+#define SHM_TTL_SECS (24 * 3600)
+
+typedef struct {
+  uint32_t magic; /* Written last by the creator */
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+} ShmHeader;
+
+typedef struct {
+  uint32_t seq; /* Odd while being written */
+  uint16_t cmd_len;
+  uint16_t reserved;
+  uint64_t key; /* CacheKey.prompt, 0 = empty */
+  uint64_t fp;  /* Model, OS, shell, platform, CacheKey.ctx */
+  int64_t created;
+  char cmd[SHM_CMD_MAX];
+} ShmSlot;
+
+static struct {
+  char name[64]; /* Empty: off */
+  int tried;
+  ShmHeader *h;
+  ShmSlot *slots;
+  unsigned long hits, stores;
+} shm_cache;
+
+static void shm_cache_open(void) {
+  if (shm_cache.tried || !shm_cache.name[0])
+    return;
+  shm_cache.tried = 1;
+  char name[sizeof(shm_cache.name) + 1] = "/";
+  strcat(name, shm_cache.name + (shm_cache.name[0] == '/'));
+  size_t size = sizeof(ShmHeader) + (size_t)SHM_SLOTS * sizeof(ShmSlot);
+  int created = 1;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+  if (fd >= 0) {
+    /* umask would strip the group bits */
+    if (fchmod(fd, 0660) != 0 || ftruncate(fd, (off_t)size) != 0) {
+      close(fd);
+      shm_unlink(name);
+      return;
+    }
+  } else if (errno == EEXIST) {
+    created = 0;
+    struct stat st;
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0 || fstat(fd, &st) != 0 ||
+        (size_t)st.st_size != size) {
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+  } else {
+    return;
+  }
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return;
+  ShmHeader *h = p;
+  if (created) {
+    h->version = SHM_VERSION;
+    h->slots = SHM_SLOTS;
+    h->slot_size = sizeof(ShmSlot);
+    __atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  }
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+      h->version != SHM_VERSION || h->slots != SHM_SLOTS ||
+      h->slot_size != sizeof(ShmSlot)) {
+    munmap(p, size); /* Another layout, or its creator is mid-setup */
+    return;
+  }
+  shm_cache.h = h;
+  shm_cache.slots = (ShmSlot *)(h + 1);
+}
+
+static uint64_t shm_fingerprint(const ComgenSession *s, const EnvContext *env,
+                                int plat) {
+  uint64_t h = hash_bytes(s->model, strlen(s->model) + 1, HASH_SEED);
+  h = hash_bytes(env->os, strlen(env->os) + 1, h);
+  h = hash_bytes(env->shell, strlen(env->shell) + 1, h);
+  return hash_bytes(&plat, sizeof(plat), h);
+}
+
+/* Whether cmd is free of the user's own name, home and directory, and so
+ * valid for other users wherever they are */
+static int shm_publishable(const EnvContext *env, const char *cmd) {
+  const char *home = getenv("HOME");
+  if (strchr(cmd, '~') || strstr(cmd, "HOME") || strstr(cmd, "PWD") ||
+      (home && strlen(home) > 1 && strstr(cmd, home)) ||
+      (strlen(env->cwd) > 1 && strstr(cmd, env->cwd)))
+    return 0;
+  size_t ul = strlen(env->user);
+  for (const char *p = cmd; ul && (p = strstr(p, env->user)); p++)
+    if ((p == cmd || !isalnum((unsigned char)p[-1])) &&
+        !isalnum((unsigned char)p[ul]))
+      return 0;
+  return 1;
+}
+
+/* malloc'd command for (key, fp), or NULL */
+static char *shm_cache_lookup(uint64_t key, uint64_t fp) {
+  shm_cache_open();
+  if (!shm_cache.h)
+    return NULL;
+  size_t base = (size_t)(mix64(key ^ fp) % SHM_SLOTS);
+  for (size_t i = 0; i < SHM_PROBE; i++) {
+    ShmSlot *s = &shm_cache.slots[(base + i) % SHM_SLOTS];
+    for (int tries = 0; tries < 4; tries++) {
+      uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue; /* Being written */
+      uint64_t k = s->key, f = s->fp;
+      int64_t created = s->created;
+      uint16_t len = s->cmd_len;
+      char cmd[SHM_CMD_MAX];
+      if (k == key && f == fp && len < SHM_CMD_MAX)
+        memcpy(cmd, s->cmd, len);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+        continue; /* Torn: read again */
+      if (!k)
+        return NULL; /* Slots are never emptied: the chain ends here */
+      if (k != key || f != fp || len >= SHM_CMD_MAX)
+        break;
+      if (time(NULL) - created > SHM_TTL_SECS)
+        return NULL; /* Expired; the next store reuses the slot */
+      char *out = malloc(len + 1u);
+      if (out) {
+        memcpy(out, cmd, len);
+        out[len] = '\0';
+        shm_cache.hits++;
+      }
+      return out;
+    }
+  }
+  return NULL;
+}
+
+/* Publishes cmd for (key, fp) in its own slot, an empty one or the
+ * oldest of the probe window. Best effort: a busy slot is skipped. */
+static void shm_cache_store(uint64_t key, uint64_t fp, const char *cmd) {
+  shm_cache_open();
+  size_t len = strlen(cmd);
+  if (!shm_cache.h || !key || len >= SHM_CMD_MAX)
+    return;
+  size_t base = (size_t)(mix64(key ^ fp) % SHM_SLOTS);
+  ShmSlot *victim = NULL;
+  for (size_t i = 0; i < SHM_PROBE; i++) {
+    ShmSlot *s = &shm_cache.slots[(base + i) % SHM_SLOTS];
+    uint64_t k = __atomic_load_n(&s->key, __ATOMIC_RELAXED);
+    if (!k || (k == key && s->fp == fp)) {
+      victim = s;
+      break;
+    }
+    if (!victim || s->created < victim->created)
+      victim = s;
+  }
+  uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  victim->key = key;
+  victim->fp = fp;
+  victim->created = (int64_t)time(NULL);
+  victim->cmd_len = (uint16_t)len;
+  memcpy(victim->cmd, cmd, len);
+  __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+  shm_cache.stores++;
+}
+
+static void print_shm_stats(void) {
+  shm_cache_open();
+  if (!shm_cache.h)
+    return;
+  size_t used = 0;
+  for (size_t i = 0; i < SHM_SLOTS; i++)
+    used += __atomic_load_n(&shm_cache.slots[i].key, __ATOMIC_RELAXED) != 0;
+  printf("shared  %zu/%d slots in /%s, %lu hits, %lu published\n", used,
+         SHM_SLOTS, shm_cache.name + (shm_cache.name[0] == '/'),
+         shm_cache.hits, shm_cache.stores);
+}
+#endif
+
+/* Cache Simulator: every request that reaches the response cache is
+ * logged as a fixed-size event (key hashes, prompt bands, request size,
+ * API latency) in ~/.config/comgen/events. `comgen cache-sim` replays the
+ * log straight from the mapping through LRU, LFU, ARC and TTL caches of
+ * several sizes, keyed exactly, by template, or by template plus MinHash
+ * bands, to show what a policy and size would have saved. */
+#define EVENT_MAGIC 0x56454743u /* "CGEV" */
+#define EVENT_VERSION 1
+#define EVENT_LOG_MAX (64 * 1024 * 1024) /* Then rotated to events.1 */
+#define SIM_FUZZY_BANDS 4 /* Shared bands (of MH_BANDS) for a fuzzy hit */
+#define SIM_MAX_SIZES 8
+#define SIM_NIL UINT32_MAX
+
+typedef struct {
+  int64_t ms;       /* Wall clock */
+  uint64_t exact;   /* Prompt, context and environment */
+  uint64_t tmpl;    /* Canonical template key, 0 without literals */
+  uint64_t env;     /* Fuzzy hits need the same model, OS, shell, user */
+  uint32_t bands[MH_BANDS];
+  uint32_t tokens;  /* Estimated request tokens, 0 when not sent */
+  uint32_t latency; /* API round trip in ms, 0 when not sent */
+} SimEvent;
+
+static void event_make(SimEvent *ev, const CacheKey *k, const CacheKey *tk,
+                       int templated, const char *norm, double latency_ms,
+                       size_t request_bytes) {
+  memset(ev, 0, sizeof(*ev));
+  ev->ms = (int64_t)time(NULL) * 1000;
+  ev->exact = cache_key_hash(k);
+  ev->tmpl = templated ? cache_key_hash(tk) : 0;
+  ev->env = k->env;
+  uint64_t sh[MH_MAX_SHINGLES];
+  minhash_bands(sh, prompt_shingles(norm, sh, MH_MAX_SHINGLES), ev->bands);
+  if (latency_ms > 0) {
+    ev->tokens = (uint32_t)(request_bytes / 4);
+    ev->latency = (uint32_t)latency_ms;
+  }
+}
+
+/* Appends ev; outside cache_lock, so its own lock keeps rotation whole */
+static void event_write(const SimEvent *ev) {
+#ifndef _WIN32
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&lock);
+#endif
+  char path[1024];
+  get_config_file(path, sizeof(path), "events");
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size > EVENT_LOG_MAX) {
+    char old[1100];
+    snprintf(old, sizeof(old), "%s.1", path);
+#ifdef _WIN32
+    unlink(old);
+#endif
+    rename(path, old);
+  }
+  FILE *fp = fopen(path, "ab");
+  if (fp) {
+    setvbuf(fp, NULL, _IONBF, 0);
+    if (ftell(fp) == 0) {
+      CacheFileHeader hdr = {EVENT_MAGIC, EVENT_VERSION};
+      fwrite(&hdr, sizeof(hdr), 1, fp);
+    }
+    fwrite(ev, sizeof(*ev), 1, fp);
+    fclose(fp);
+  }
+#ifndef _WIN32
+  pthread_mutex_unlock(&lock);
+#endif
+}
+
+enum { SIM_LRU, SIM_LFU, SIM_ARC, SIM_TTL };
+enum { KEY_EXACT, KEY_PARAM, KEY_FUZZY, N_KEY_MODES };
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_LISTS }; /* LRU/TTL use T1 */
+
+typedef struct {
+  uint64_t key, env;
+  int64_t time;  /* Insertion (TTL) or last use (LFU ties) */
+  uint32_t freq; /* LFU */
+  uint32_t prev, next, heap_pos;
+  uint8_t list;
+} SimNode;
+
+typedef struct {
+  uint32_t band, node;
+  uint64_t key; /* Detects a reused node */
+} SimBand;
+
+typedef struct {
+  int policy;
+  size_t cap;
+  int64_t ttl_ms;
+  SimNode *nodes;
+  uint32_t n_nodes, free_head;
+  uint32_t *slots; /* key -> node, open addressing */
+  size_t mask;
+  uint32_t head[ARC_LISTS], tail[ARC_LISTS];
+  size_t len[ARC_LISTS];
+  size_t arc_p;
+  uint32_t *heap; /* LFU min-heap by (freq, time) */
+  size_t heap_n;
+  SimBand *bands; /* Direct-mapped band -> node, for fuzzy keys */
+  size_t band_mask;
+} SimCache;
+
+static size_t pow2_at_least(size_t n) {
+  size_t p = 16;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+static int sim_init(SimCache *c, int policy, size_t cap, int64_t ttl_ms,
+                    int fuzzy) {
+  memset(c, 0, sizeof(*c));
+  c->policy = policy;
+  c->cap = cap;
+  c->ttl_ms = ttl_ms;
+  /* ARC also tracks up to cap evicted keys */
+  size_t n = policy == SIM_ARC ? 2 * cap + 1 : cap + 1;
+  c->n_nodes = (uint32_t)n;
+  c->nodes = malloc(n * sizeof(SimNode));
+  c->mask = pow2_at_least(n * 2) - 1;
+  c->slots = malloc((c->mask + 1) * sizeof(uint32_t));
+  c->heap = policy == SIM_LFU ? malloc(n * sizeof(uint32_t)) : NULL;
+  if (fuzzy) {
+    c->band_mask = pow2_at_least(cap * MH_BANDS * 2) - 1;
+    c->bands = calloc(c->band_mask + 1, sizeof(SimBand));
+  }
+  if (!c->nodes || !c->slots || (policy == SIM_LFU && !c->heap) ||
+      (fuzzy && !c->bands))
+    return 0;
+  memset(c->slots, 0xff, (c->mask + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < n; i++)
+    c->nodes[i].next = i + 1 < n ? i + 1 : SIM_NIL;
+  c->free_head = 0;
+  for (int l = 0; l < ARC_LISTS; l++)
+    c->head[l] = c->tail[l] = SIM_NIL;
+  return 1;
+}
+
+static void sim_free(SimCache *c) {
+  free(c->nodes);
+  free(c->slots);
+  free(c->heap);
+  free(c->bands);
+}
+
+static uint32_t sim_find(const SimCache *c, uint64_t key, size_t *slot) {
+  size_t i = mix64(key) & c->mask;
+  while (c->slots[i] != SIM_NIL && c->nodes[c->slots[i]].key != key)
+    i = (i + 1) & c->mask;
+  *slot = i;
+  return c->slots[i];
+}
+
+static void sim_unmap(SimCache *c, uint64_t key) {
+  size_t i;
+  if (sim_find(c, key, &i) == SIM_NIL)
+    return;
+  for (size_t j = (i + 1) & c->mask; c->slots[j] != SIM_NIL;
+       j = (j + 1) & c->mask) {
+    size_t home = mix64(c->nodes[c->slots[j]].key) & c->mask;
+    if (((j - home) & c->mask) >= ((j - i) & c->mask)) {
+      c->slots[i] = c->slots[j];
+      i = j;
+    }
+  }
+  c->slots[i] = SIM_NIL;
+}
+
+static void sim_list_remove(SimCache *c, uint32_t i) {
+  SimNode *n = &c->nodes[i];
+  if (n->prev != SIM_NIL)
+    c->nodes[n->prev].next = n->next;
+  else
+    c->head[n->list] = n->next;
+  if (n->next != SIM_NIL)
+    c->nodes[n->next].prev = n->prev;
+  else
+    c->tail[n->list] = n->prev;
+  c->len[n->list]--;
+}
+
+static void sim_list_push(SimCache *c, int list, uint32_t i) {
+  SimNode *n = &c->nodes[i];
+  n->list = (uint8_t)list;
+  n->prev = SIM_NIL;
+  n->next = c->head[list];
+  if (n->next != SIM_NIL)
+    c->nodes[n->next].prev = i;
+  else
+    c->tail[list] = i;
+  c->head[list] = i;
+  c->len[list]++;
+}
+
+static uint32_t sim_alloc(SimCache *c, uint64_t key, uint64_t env,
+                          int64_t now, size_t slot) {
+  uint32_t i = c->free_head;
+  c->free_head = c->nodes[i].next;
+  SimNode *n = &c->nodes[i];
+  n->key = key;
+  n->env = env;
+  n->time = now;
+  n->freq = 1;
+  c->slots[slot] = i;
+  return i;
+}
+
+static void sim_release(SimCache *c, uint32_t i) {
+  sim_unmap(c, c->nodes[i].key);
+  c->nodes[i].next = c->free_head;
+  c->free_head = i;
+}
+
+static int lfu_less(const SimCache *c, uint32_t a, uint32_t b) {
+  const SimNode *x = &c->nodes[a], *y = &c->nodes[b];
+  return x->freq != y->freq ? x->freq < y->freq : x->time < y->time;
+}
+
+static void lfu_set(SimCache *c, size_t pos, uint32_t i) {
+  c->heap[pos] = i;
+  c->nodes[i].heap_pos = (uint32_t)pos;
+}
+
+static void lfu_sift_up(SimCache *c, size_t pos) {
+  uint32_t i = c->heap[pos];
+  while (pos > 0 && lfu_less(c, i, c->heap[(pos - 1) / 2])) {
+    lfu_set(c, pos, c->heap[(pos - 1) / 2]);
+    pos = (pos - 1) / 2;
+  }
+  lfu_set(c, pos, i);
+}
+
+static void lfu_sift_down(SimCache *c, size_t pos) {
+  uint32_t i = c->heap[pos];
+  for (;;) {
+    size_t l = 2 * pos + 1, m = l;
+    if (l >= c->heap_n)
+      break;
+    if (l + 1 < c->heap_n && lfu_less(c, c->heap[l + 1], c->heap[l]))
+      m = l + 1;
+    if (!lfu_less(c, c->heap[m], i))
+      break;
+    lfu_set(c, pos, c->heap[m]);
+    pos = m;
+  }
+  lfu_set(c, pos, i);
+}
+
+/* ARC REPLACE: demote the LRU page of T1 or T2 to its ghost list */
+static void arc_replace(SimCache *c, int in_b2) {
+  int from = c->len[ARC_T1] &&
+                     (c->len[ARC_T1] > c->arc_p ||
+                      (in_b2 && c->len[ARC_T1] == c->arc_p))
+                 ? ARC_T1
+                 : ARC_T2;
+  uint32_t v = c->tail[from];
+  if (v == SIM_NIL)
+    return;
+  sim_list_remove(c, v);
+  sim_list_push(c, from == ARC_T1 ? ARC_B1 : ARC_B2, v);
+}
+
+static void arc_drop_lru(SimCache *c, int list) {
+  uint32_t v = c->tail[list];
+  sim_list_remove(c, v);
+  sim_release(c, v);
+}
+
+/* Adaptive Replacement Cache (Megiddo and Modha) */
+static int arc_access(SimCache *c, uint64_t key, uint64_t env, int64_t now,
+                      uint32_t *node) {
+  size_t slot;
+  uint32_t i = sim_find(c, key, &slot);
+  size_t cap = c->cap;
+  if (i != SIM_NIL && c->nodes[i].list <= ARC_T2) {
+    sim_list_remove(c, i);
+    sim_list_push(c, ARC_T2, i);
+    *node = i;
+    return 1;
+  }
+  if (i != SIM_NIL) { /* Ghost hit: adapt p toward the list that missed */
+    int in_b2 = c->nodes[i].list == ARC_B2;
+    size_t b1 = c->len[ARC_B1], b2 = c->len[ARC_B2];
+    if (!in_b2)
+      c->arc_p += b1 >= b2 ? 1 : b2 / b1;
+    else
+      c->arc_p -= c->arc_p < (b2 >= b1 ? 1 : b1 / b2)
+                      ? c->arc_p
+                      : (b2 >= b1 ? 1 : b1 / b2);
+    if (c->arc_p > cap)
+      c->arc_p = cap;
+    arc_replace(c, in_b2);
+    sim_list_remove(c, i);
+    sim_list_push(c, ARC_T2, i);
+    c->nodes[i].env = env;
+    c->nodes[i].time = now;
+    *node = i;
+    return 0;
+  }
+  size_t l1 = c->len[ARC_T1] + c->len[ARC_B1];
+  size_t total = l1 + c->len[ARC_T2] + c->len[ARC_B2];
+  if (l1 == cap) {
+    if (c->len[ARC_T1] < cap) {
+      arc_drop_lru(c, ARC_B1);
+      arc_replace(c, 0);
+    } else {
+      arc_drop_lru(c, ARC_T1);
+    }
+  } else if (total >= cap) {
+    if (total == 2 * cap)
+      arc_drop_lru(c, ARC_B2);
+    arc_replace(c, 0);
+  }
+  sim_find(c, key, &slot); /* Deletions may have shifted it */
+  i = sim_alloc(c, key, env, now, slot);
+  sim_list_push(c, ARC_T1, i);
+  *node = i;
+  return 0;
+}
+
+/* Looks key up, inserting it on a miss; returns 1 on a hit. node is set
+ * to the key's (resident) node either way. */
+static int sim_access(SimCache *c, uint64_t key, uint64_t env, int64_t now,
+                      uint32_t *node) {
+  if (c->policy == SIM_ARC)
+    return arc_access(c, key, env, now, node);
+  size_t slot;
+  uint32_t i = sim_find(c, key, &slot);
+  if (i != SIM_NIL) {
+    *node = i;
+    SimNode *n = &c->nodes[i];
+    if (c->policy == SIM_LFU) {
+      n->freq++;
+      n->time = now;
+      lfu_sift_down(c, n->heap_pos);
+      return 1;
+    }
+    sim_list_remove(c, i);
+    sim_list_push(c, ARC_T1, i);
+    if (c->policy == SIM_TTL && now - n->time > c->ttl_ms) {
+      n->time = now; /* Expired: refetched */
+      return 0;
+    }
+    return 1;
+  }
+  if (c->policy == SIM_LFU && c->heap_n == c->cap) {
+    uint32_t v = c->heap[0];
+    lfu_set(c, 0, c->heap[--c->heap_n]);
+    if (c->heap_n)
+      lfu_sift_down(c, 0);
+    sim_release(c, v);
+    sim_find(c, key, &slot);
+  } else if (c->policy != SIM_LFU && c->len[ARC_T1] == c->cap) {
+    arc_drop_lru(c, ARC_T1);
+    sim_find(c, key, &slot);
+  }
+  i = sim_alloc(c, key, env, now, slot);
+  if (c->policy == SIM_LFU) {
+    c->heap[c->heap_n] = i;
+    c->nodes[i].heap_pos = (uint32_t)c->heap_n;
+    lfu_sift_up(c, c->heap_n++);
+  } else {
+    sim_list_push(c, ARC_T1, i);
+  }
+  *node = i;
+  return 0;
+}
+
+static int sim_resident(const SimCache *c, uint32_t i) {
+  return c->policy != SIM_ARC || c->nodes[i].list <= ARC_T2;
+}
+
+/* A resident entry for the same environment sharing SIM_FUZZY_BANDS
+ * bands with ev; each band remembers its latest entry only */
+static int sim_fuzzy_hit(const SimCache *c, const SimEvent *ev) {
+  uint32_t cand[MH_BANDS];
+  int votes[MH_BANDS];
+  size_t n = 0;
+  for (size_t b = 0; b < MH_BANDS; b++) {
+    if (!ev->bands[b])
+      continue;
+    const SimBand *s = &c->bands[mix64(ev->bands[b] + b) & c->band_mask];
+    if (s->band != ev->bands[b] || c->nodes[s->node].key != s->key ||
+        !sim_resident(c, s->node) || c->nodes[s->node].env != ev->env)
+      continue;
+    size_t k = 0;
+    while (k < n && cand[k] != s->node)
+      k++;
+    if (k == n) {
+      cand[n] = s->node;
+      votes[n++] = 0;
+    }
+    if (++votes[k] >= SIM_FUZZY_BANDS)
+      return 1;
+  }
+  return 0;
+}
+
+static void sim_add_bands(SimCache *c, const SimEvent *ev, uint32_t node) {
+  for (size_t b = 0; b < MH_BANDS; b++) {
+    if (!ev->bands[b])
+      continue;
+    SimBand *s = &c->bands[mix64(ev->bands[b] + b) & c->band_mask];
+    s->band = ev->bands[b];
+    s->node = node;
+    s->key = ev->exact;
+  }
+}
+
+typedef struct {
+  const char *name;
+  int policy;
+  int64_t ttl_ms;
+} SimPolicy;
+
+static const SimPolicy sim_policies[] = {
+    {"LRU", SIM_LRU, 0},
+    {"LFU", SIM_LFU, 0},
+    {"ARC", SIM_ARC, 0},
+    {"TTL-1h", SIM_TTL, 3600 * 1000LL},
+    {"TTL-1d", SIM_TTL, 24 * 3600 * 1000LL},
+    {"TTL-7d", SIM_TTL, (int64_t)CACHE_TTL_SECS * 1000},
+};
+
+static const char *key_mode_names[N_KEY_MODES] = {"exact", "param", "fuzzy"};
+
+typedef struct {
+  const SimEvent *events;
+  size_t n_events;
+  uint32_t avg_tokens, avg_latency; /* Stand-ins for events not sent */
+  const SimPolicy *policy;
+  size_t cap;
+  int keys; /* KEY_* */
+  /* Results */
+  size_t hits;
+  unsigned long long tokens, latency_ms;
+  int failed;
+#ifndef _WIN32
+  /* Completion, shared by a sweep */
+  pthread_mutex_t *lock;
+  pthread_cond_t *done_cond;
+  size_t *pending;
+#endif
+} SimRun;
+
+static void sim_run_job(void *arg) {
+  SimRun *r = arg;
+  SimCache c;
+  if (!sim_init(&c, r->policy->policy, r->cap, r->policy->ttl_ms,
+                r->keys == KEY_FUZZY)) {
+    r->failed = 1;
+  } else {
+    for (size_t e = 0; e < r->n_events; e++) {
+      const SimEvent *ev = &r->events[e];
+      uint32_t node, tnode;
+      int fuzzy = r->keys == KEY_FUZZY && sim_fuzzy_hit(&c, ev);
+      int hit = sim_access(&c, ev->exact, ev->env, ev->ms, &node);
+      if (r->keys != KEY_EXACT && ev->tmpl)
+        hit |= sim_access(&c, ev->tmpl, ev->env, ev->ms, &tnode);
+      if (r->keys == KEY_FUZZY)
+        sim_add_bands(&c, ev, node);
+      if (hit || fuzzy) {
+        r->hits++;
+        r->tokens += ev->tokens ? ev->tokens : r->avg_tokens;
+        r->latency_ms += ev->latency ? ev->latency : r->avg_latency;
+      }
+    }
+  }
+  sim_free(&c);
+#ifndef _WIN32
+  pthread_mutex_lock(r->lock);
+  if (--*r->pending == 0)
+    pthread_cond_signal(r->done_cond);
+  pthread_mutex_unlock(r->lock);
+#endif
+}
+
+/* comgen cache-sim [--sizes a,b,...] [events-file...] */
+static int cache_sim(int argc, char **argv) {
+  size_t sizes[SIM_MAX_SIZES] = {64, 256, 1024, 4096, 16384};
+  size_t n_sizes = 5;
+  char paths[16][1024];
+  size_t n_paths = 0;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      n_sizes = 0;
+      for (char *p = argv[++i]; *p && n_sizes < SIM_MAX_SIZES;) {
+        char *end;
+        unsigned long v = strtoul(p, &end, 10);
+        if (end == p || v == 0 || v > (1u << 24)) {
+          fprintf(stderr, C_RED "Bad size list: %s" C_RESET "\n", argv[i]);
+          return 1;
+        }
+        sizes[n_sizes++] = v;
+        p = end + (*end == ',');
+      }
+    } else if (n_paths < 16) {
+      snprintf(paths[n_paths++], sizeof(paths[0]), "%s", argv[i]);
+    }
+  }
+  if (!n_paths) {
+    get_config_file(paths[1], sizeof(paths[1]), "events");
+    snprintf(paths[0], sizeof(paths[0]), "%.1000s.1", paths[1]);
+    n_paths = 2; /* Rotated log first */
+  }
+
+  /* One contiguous run of events; a single file is used in place */
+  MappedFile maps[16];
+  size_t n_events = 0;
+  for (size_t i = 0; i < n_paths; i++) {
+    CacheFileHeader hdr;
+    if (!map_file(paths[i], &maps[i]))
+      continue;
+    if (maps[i].size >= sizeof(hdr))
+      memcpy(&hdr, maps[i].data, sizeof(hdr));
+    if (maps[i].size < sizeof(hdr) || hdr.magic != EVENT_MAGIC ||
+        hdr.version != EVENT_VERSION) {
+      fprintf(stderr, C_RED "%s: not a comgen event log" C_RESET "\n",
+              paths[i]);
+      unmap_file(&maps[i]);
+      continue;
+    }
+    n_events += (maps[i].size - sizeof(hdr)) / sizeof(SimEvent);
+  }
+  const SimEvent *events = NULL;
+  SimEvent *joined = NULL;
+  size_t n_maps = 0, last = 0;
+  for (size_t i = 0; i < n_paths; i++)
+    if (maps[i].data) {
+      n_maps++;
+      last = i;
+    }
+  if (n_maps == 1) {
+    events = (const SimEvent *)(maps[last].data + sizeof(CacheFileHeader));
+  } else if (n_events && (joined = malloc(n_events * sizeof(SimEvent)))) {
+    size_t o = 0;
+    for (size_t i = 0; i < n_paths; i++) {
+      if (!maps[i].data)
+        continue;
+      size_t n = (maps[i].size - sizeof(CacheFileHeader)) / sizeof(SimEvent);
+      memcpy(joined + o, maps[i].data + sizeof(CacheFileHeader),
+             n * sizeof(SimEvent));
+      o += n;
+    }
+    events = joined;
+  }
+  if (!events || !n_events) {
+    fprintf(stderr, "No events to replay. comgen logs one per request to "
+                    "the response cache.\n");
+    for (size_t i = 0; i < n_paths; i++)
+      unmap_file(&maps[i]);
+    return 1;
+  }
+
+  unsigned long long tok_sum = 0, lat_sum = 0;
+  size_t sent = 0;
+  for (size_t e = 0; e < n_events; e++)
+    if (events[e].latency) {
+      tok_sum += events[e].tokens;
+      lat_sum += events[e].latency;
+      sent++;
+    }
+
+  size_t n_policies = sizeof(sim_policies) / sizeof(*sim_policies);
+  size_t n_runs = n_policies * n_sizes * N_KEY_MODES;
+  SimRun *runs = calloc(n_runs, sizeof(SimRun));
+  if (!runs) {
+    free(joined);
+    for (size_t i = 0; i < n_paths; i++)
+      unmap_file(&maps[i]);
+    return 1;
+  }
+#ifndef _WIN32
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+  size_t pending = n_runs;
+#endif
+  double t0 = now_ms();
+  for (size_t k = 0; k < N_KEY_MODES; k++)
+    for (size_t p = 0; p < n_policies; p++)
+      for (size_t s = 0; s < n_sizes; s++) {
+        SimRun *r = &runs[(k * n_policies + p) * n_sizes + s];
+        r->events = events;
+        r->n_events = n_events;
+        r->avg_tokens = sent ? (uint32_t)(tok_sum / sent) : 0;
+        r->avg_latency = sent ? (uint32_t)(lat_sum / sent) : 0;
+        r->policy = &sim_policies[p];
+        r->cap = sizes[s];
+        r->keys = (int)k;
+#ifndef _WIN32
+        r->lock = &lock;
+        r->done_cond = &done_cond;
+        r->pending = &pending;
+#endif
+      }
+  /* Each configuration replays independently on the worker pool */
+  for (size_t i = 0; i < n_runs; i++)
+    pool_submit(sim_run_job, &runs[i]);
+#ifndef _WIN32
+  pthread_mutex_lock(&lock);
+  while (pending)
+    pthread_cond_wait(&done_cond, &lock);
+  pthread_mutex_unlock(&lock);
+#endif
+  double elapsed = now_ms() - t0;
+
+  printf(C_BOLD "%zu events (%zu sent to the API, avg %u tokens, %u ms)"
+                C_RESET "\n",
+         n_events, sent, runs[0].avg_tokens, runs[0].avg_latency);
+  printf("%-7s %-7s %8s %7s %13s %10s\n", "keys", "policy", "size", "hit%",
+         "tokens saved", "time saved");
+  for (size_t i = 0; i < n_runs; i++) {
+    const SimRun *r = &runs[i];
+    char lat[24];
+    format_age((long long)(r->latency_ms / 1000), lat, sizeof(lat));
+    if (r->failed)
+      printf("%-7s %-7s %8zu   (out of memory)\n", key_mode_names[r->keys],
+             r->policy->name, r->cap);
+    else
+      printf("%-7s %-7s %8zu %6.1f%% %13llu %10s\n", key_mode_names[r->keys],
+             r->policy->name, r->cap, 100.0 * r->hits / n_events, r->tokens,
+             lat);
+  }
+  printf(C_DIM "%zu replays in %.0f ms (%.1fM events/s)" C_RESET "\n", n_runs,
+         elapsed, elapsed > 0 ? n_events * n_runs / elapsed / 1000 : 0);
+
+  free(runs);
+  free(joined);
+  for (size_t i = 0; i < n_paths; i++)
+    unmap_file(&maps[i]);
+  return 0;
+}
+
+/* How a command was answered without (or despite) the API */
+typedef struct {
+  double us;          /* Lookup time, -1 when the answer came from the API */
+  double score;       /* 1 for exact hits, Jaccard similarity for fuzzy ones */
+  char prompt[96];    /* Similar cached prompt */
+  const char *intent; /* Offline intent name */
+  int fallback;       /* Intent used because the API failed */
+  int templated;      /* Rendered from a template with new literals */
+  int bundled;        /* From an imported team bundle */
+  int shm;            /* From the host's shared cache */
+  int shared;         /* Answer of an identical request already in flight */
+  int local;          /* The input itself, already a shell command */
+} CacheHit;
+
+/* The response cache, bundle and event log are shared by comgen serve's
+ * workers; lookups and stores hold cache_mutex, API calls do not */
+#ifndef _WIN32
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void cache_lock(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&cache_mutex);
+#endif
+}
+
+static void cache_unlock(void) {
+#ifndef _WIN32
+  pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+#ifndef _WIN32
+/* Singleflight: a miss whose key is already on its way to the API waits
+ * for that answer instead of sending the same request again */
+typedef struct Flight {
+  uint64_t key;
+  char *cmd; /* The leader's answer, NULL if it failed */
+  int done, waiters;
+  struct Flight *next;
+} Flight;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t landed;
+  Flight *head;
+  unsigned long shared;
+} flights = {.lock = PTHREAD_MUTEX_INITIALIZER,
+             .landed = PTHREAD_COND_INITIALIZER};
+
+/* Returns the new Flight when the caller should send the request, or NULL
+ * after waiting for an identical one; *cmd then gets a copy of its answer */
+static Flight *flight_begin(uint64_t key, char **cmd) {
+  pthread_mutex_lock(&flights.lock);
+  Flight *f = flights.head;
+  while (f && f->key != key)
+    f = f->next;
+  if (!f) {
+    if ((f = calloc(1, sizeof(*f)))) {
+      f->key = key;
+      f->next = flights.head;
+      flights.head = f;
+    }
+    pthread_mutex_unlock(&flights.lock);
+    return f;
+  }
+  f->waiters++;
+  while (!f->done)
+    pthread_cond_wait(&flights.landed, &flights.lock);
+  *cmd = f->cmd ? strdup(f->cmd) : NULL;
+  flights.shared++;
+  if (--f->waiters == 0) {
+    free(f->cmd);
+    free(f);
+  }
+  pthread_mutex_unlock(&flights.lock);
+  return NULL;
+}
+
+static void flight_end(Flight *f, const char *cmd) {
+  pthread_mutex_lock(&flights.lock);
+  Flight **p = &flights.head;
+  while (*p != f)
+    p = &(*p)->next;
+  *p = f->next;
+  f->done = 1;
+  if (f->waiters) {
+    f->cmd = cmd ? strdup(cmd) : NULL;
+    pthread_cond_broadcast(&flights.landed);
+  } else {
+    free(f);
+  }
+  pthread_mutex_unlock(&flights.lock);
+}
+#endif
+
+/* generate_command behind the response cache. A similar cached prompt is
+ * shown as a suggestion while the request is sent, or answers outright
+ * when it is near-identical and from the same context. Attachments bypass
+ * the cache because their content is not part of the key. */
+static char *lookup_or_generate(ComgenSession *session, GenRequest *req,
+                             const char *prompt, const Attachment *att,
+                             CacheHit *hit) {
+  memset(hit, 0, sizeof(*hit));
+  hit->us = -1;
+  if (!att && !force_api) {
+    double t = now_ms();
+    char *cmd = offline_intent(req->env, prompt, &hit->intent);
+    if (cmd) {
+      hit->us = (now_ms() - t) * 1000;
+      return cmd;
+    }
+  }
+  char norm[CACHE_PROMPT_MAX + 1];
+  normalize_prompt(prompt, norm, sizeof(norm));
+  if (att || !norm[0])
+    return generate_command(session, req, prompt, att);
+  /* (Offline intents were tried above unless --api) */
+
+  CacheKey k;
+  SimEvent ev;
+  double t0 = now_ms();
+  cache_make_key(session, req->env, norm, &k);
+  if (req->ephemeral) /* Never this user's answers, nor in their store */
+    k.env = hash_bytes("serve", 5, k.env);
+  cache_lock();
+  char *cmd = cache_lookup(&k);
+
+  /* Same request with other literals: render the stored template */
+  CanonPrompt cp;
+  CacheKey tk = k;
+  int plat = platform_family(req->env);
+  if (canonicalize_prompt(norm, &cp)) {
+    tk.prompt = hash_bytes(cp.canon, strlen(cp.canon), ~HASH_SEED);
+    char *tmpl = cmd ? NULL : cache_lookup(&tk);
+    if (tmpl && (cmd = render_template(tmpl, &cp, plat))) {
+      hit->templated = 1;
+      cache.template_hits++;
+    }
+    free(tmpl);
+  }
+  /* Then the team bundle, which ignores the directory */
+  if (!cmd && (cmd = bundle_lookup(k.prompt, norm, plat, 0)))
+    hit->bundled = 1;
+  if (!cmd && cp.n) {
+    char *tmpl = bundle_lookup(tk.prompt, cp.canon, plat, CACHE_F_TEMPLATE);
+    if (tmpl && (cmd = render_template(tmpl, &cp, plat)))
+      hit->bundled = hit->templated = 1;
+    free(tmpl);
+  }
+  bundle.hits += hit->bundled;
+#ifndef _WIN32
+  /* Then what other users of this host published (shared_cache) */
+  uint64_t fp = shm_fingerprint(session, req->env, plat);
+  if (!cmd && (cmd = shm_cache_lookup(k.prompt, fp)))
+    hit->shm = 1;
+#endif
+  if (cmd) {
+    hit->us = (now_ms() - t0) * 1000;
+    hit->score = 1;
+    cache.hit_us_total += hit->us;
+    cache_unlock();
+    event_make(&ev, &k, &tk, cp.n > 0, norm, 0, 0);
+    event_write(&ev);
+    return cmd;
+  }
+  cache.misses++;
+
+  FuzzyMatch fm;
+  double t1 = now_ms();
+  int similar = fuzzy_lookup(&k, norm, &fm);
+  cache.fuzzy_us_total += (now_ms() - t1) * 1000;
+  if (similar && fm.same_ctx && fm.same_scope && fm.score >= FUZZY_ACCEPT) {
+    hit->us = (now_ms() - t0) * 1000;
+    hit->score = fm.score;
+    memcpy(hit->prompt, fm.prompt, sizeof(hit->prompt));
+    cache.fuzzy_hits++;
+    cache.hit_us_total += hit->us;
+    cache_unlock();
+    event_make(&ev, &k, &tk, cp.n > 0, norm, 0, 0);
+    event_write(&ev);
+    return fm.cmd;
+  }
+  cache.suggestions += similar != 0;
+  cache_unlock();
+  if (similar) {
+    if (!req->quiet) {
+      FILE *out = oneshot ? stderr : stdout;
+      fprintf(out,
+              "\r" C_DIM "Similar (%.2f) to \"%s\":" C_RESET " %s\n" C_DIM
+              "%s" C_RESET,
+              fm.score, fm.prompt, fm.cmd, oneshot ? "" : "Thinking...\r");
+      fflush(out);
+    }
+    free(fm.cmd);
+  }
+
+#ifndef _WIN32
+  Flight *flight = flight_begin(cache_key_hash(&k), &cmd);
+  if (!flight && cmd) {
+    hit->us = (now_ms() - t0) * 1000;
+    hit->shared = 1;
+    return cmd;
+  }
+#endif
+  double t_api = now_ms();
+  cmd = generate_command(session, req, prompt, att);
+#ifndef _WIN32
+  if (flight)
+    flight_end(flight, cmd);
+#endif
+  if (cmd && strncmp(cmd, "ERROR:", 6) != 0) {
+    char *tmpl = cp.n ? templatize_command(cmd, &cp, plat) : NULL;
+    event_make(&ev, &k, &tk, cp.n > 0, norm, now_ms() - t_api,
+               req->request_bytes);
+    cache_lock();
+    if (req->ephemeral) {
+      int64_t now = (int64_t)time(NULL);
+      if (strlen(cmd) <= CACHE_CMD_MAX)
+        cache_mem_put(&k, now, cmd, strlen(cmd));
+      if (tmpl && strlen(tmpl) <= CACHE_CMD_MAX)
+        cache_mem_put(&tk, now, tmpl, strlen(tmpl));
+    } else {
+      cache_store(&k, norm, cmd, 0);
+      if (tmpl)
+        cache_store(&tk, cp.canon, tmpl, CACHE_F_TEMPLATE);
+#ifndef _WIN32
+      if (shm_publishable(req->env, cmd))
+        shm_cache_store(k.prompt, fp, cmd);
+#endif
+    }
+    cache_unlock();
+    event_write(&ev);
+    free(tmpl);
+  } else if (!cmd && force_api &&
+             (cmd = offline_intent(req->env, prompt, &hit->intent)))
+    hit->fallback = 1; /* API down: a template beats nothing */
+  return cmd;
+}
+
+static void print_cache_hit(FILE *out, const CacheHit *hit) {
+  if (hit->local)
+    fprintf(out, C_DIM "(shell command, not sent)" C_RESET "\n");
+  else if (hit->shared)
+    fprintf(out, C_DIM "(shared with an identical request, %.0f ms)" C_RESET
+                       "\n", hit->us / 1000);
+  else if (hit->fallback)
+    fprintf(out, C_DIM "(offline: %s, API unavailable)" C_RESET "\n",
+            hit->intent);
+  else if (hit->intent)
+    fprintf(out, C_DIM "(offline: %s, %.0f us)" C_RESET "\n", hit->intent,
+            hit->us);
+  else if (hit->bundled)
+    fprintf(out, C_DIM "(team bundle%s, %.0f us)" C_RESET "\n",
+            hit->templated ? " template" : "", hit->us);
+  else if (hit->shm)
+    fprintf(out, C_DIM "(shared cache, %.0f us)" C_RESET "\n", hit->us);
+  else if (hit->templated)
+    fprintf(out, C_DIM "(cached template, %.0f us)" C_RESET "\n", hit->us);
+  else if (hit->score >= 1)
+    fprintf(out, C_DIM "(cached, %.0f us)" C_RESET "\n", hit->us);
+  else
+    fprintf(out, C_DIM "(cached, %.2f similar to \"%s\", %.0f us)" C_RESET "\n",
+            hit->score, hit->prompt, hit->us);
+}
+
+static const char *hit_source(const CacheHit *hit) {
+  if (hit->us < 0)
+    return hit->fallback ? "offline" : "api";
+  return hit->intent     ? "offline"
+         : hit->shared   ? "shared"
+         : hit->bundled  ? "bundle"
+         : hit->shm      ? "shm"
+         : hit->templated ? "template"
+         : hit->score < 1 ? "similar"
+                          : "cache";
+}
+
+/* lookup_or_generate, counted in the metrics */
+static char *generate_cached(ComgenSession *session, GenRequest *req,
+                             const char *prompt, const Attachment *att,
+                             CacheHit *hit) {
+  double t = now_ms();
+  metric_started();
+  char *cmd = lookup_or_generate(session, req, prompt, att, hit);
+  metric_phase(PHASE_TOTAL, now_ms() - t);
+  metric_outcome(!cmd                             ? req->error[0] ? "shed"
+                                                                  : "failed"
+                 : strncmp(cmd, "ERROR:", 6) == 0 ? "declined"
+                                                  : hit_source(hit));
+  return cmd;
+}
+
+/* History Import: `comgen import-history` streams shell history once and
+ * keeps the most frequent commands in a Space-Saving summary (a fixed set
+ * of counters, so memory stays bounded for any file size). The best are
+ * ranked by frequency and recency and written to the config dir, where
+ * they seed few-shot examples and offline suggestions. */
+#define HIST_COUNTERS 4096
+#define HIST_SLOTS (HIST_COUNTERS * 2)
+#define HIST_KEEP 1000
+#define HIST_CMD_MAX 256
+#define HIST_WORDS 12
+#define HIST_EXAMPLES 3
+#define HIST_TOOLS 8
+
+typedef struct {
+  uint64_t hash;
+  unsigned long count, error; /* error: overestimate from a replaced entry */
+  unsigned long long last;    /* Line sequence of the latest occurrence */
+  int heap_pos;
+  char cmd[HIST_CMD_MAX];
+} HistCounter;
+
+typedef struct {
+  HistCounter c[HIST_COUNTERS];
+  int heap[HIST_COUNTERS];  /* Min-heap of counter indices by count */
+  int slots[HIST_SLOTS];    /* hash -> counter index, -1 when empty */
+  size_t n;
+  unsigned long long seq;
+} SpaceSaving;
+
+static void ss_swap(SpaceSaving *ss, int a, int b) {
+  int t = ss->heap[a];
+  ss->heap[a] = ss->heap[b];
+  ss->heap[b] = t;
+  ss->c[ss->heap[a]].heap_pos = a;
+  ss->c[ss->heap[b]].heap_pos = b;
+}
+
+static void ss_sift_down(SpaceSaving *ss, int i) {
+  for (;;) {
+    int l = 2 * i + 1, r = l + 1, m = i;
+    if (l < (int)ss->n && ss->c[ss->heap[l]].count < ss->c[ss->heap[m]].count)
+      m = l;
+    if (r < (int)ss->n && ss->c[ss->heap[r]].count < ss->c[ss->heap[m]].count)
+      m = r;
+    if (m == i)
+      return;
+    ss_swap(ss, i, m);
+    i = m;
+  }
+}
+
+static int ss_find(const SpaceSaving *ss, uint64_t hash, size_t *slot) {
+  size_t mask = HIST_SLOTS - 1, i = hash & mask;
+  while (ss->slots[i] >= 0 && ss->c[ss->slots[i]].hash != hash)
+    i = (i + 1) & mask;
+  *slot = i;
+  return ss->slots[i];
+}
+
+/* Linear-probing delete with backward shift, so no tombstones build up */
+static void ss_unindex(SpaceSaving *ss, uint64_t hash) {
+  size_t mask = HIST_SLOTS - 1, i;
+  if (ss_find(ss, hash, &i) < 0)
+    return;
+  for (size_t j = (i + 1) & mask; ss->slots[j] >= 0; j = (j + 1) & mask) {
+    size_t home = ss->c[ss->slots[j]].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      ss->slots[i] = ss->slots[j];
+      i = j;
+    }
+  }
+  ss->slots[i] = -1;
+}
+
+static void ss_add(SpaceSaving *ss, const char *cmd, size_t len) {
+  uint64_t hash = hash_bytes(cmd, len, HASH_SEED);
+  size_t slot;
+  int idx = ss_find(ss, hash, &slot);
+  ss->seq++;
+  if (idx >= 0) {
+    ss->c[idx].count++;
+    ss->c[idx].last = ss->seq;
+    ss_sift_down(ss, ss->c[idx].heap_pos);
+    return;
+  }
+  HistCounter *c;
+  if (ss->n < HIST_COUNTERS) {
+    idx = (int)ss->n;
+    c = &ss->c[idx];
+    c->count = 0;
+    c->error = 0;
+    c->heap_pos = (int)ss->n;
+    ss->heap[ss->n++] = idx;
+    /* A new count of 1 is never above its parent: no sift up needed */
+  } else {
+    /* Evict the minimum; the newcomer inherits its count as error */
+    idx = ss->heap[0];
+    c = &ss->c[idx];
+    ss_unindex(ss, c->hash);
+    ss_find(ss, hash, &slot);
+    c->error = c->count;
+  }
+  c->hash = hash;
+  c->count++;
+  c->last = ss->seq;
+  memcpy(c->cmd, cmd, len);
+  c->cmd[len] = '\0';
+  ss->slots[slot] = idx;
+  ss_sift_down(ss, c->heap_pos);
+}
+
+static int is_trivial_command(const char *cmd) {
+  static const char *trivial[] = {"bg",    "c",   "cd",      "clear", "exit",
+                                  "fg",    "history", "jobs", "l",     "la",
+                                  "ll",    "logout",  "ls",   "pwd",   "q",
+                                  "reset"};
+  size_t w = strcspn(cmd, " \t;|&");
+  for (size_t i = 0; i < sizeof(trivial) / sizeof(*trivial); i++)
+    if (strlen(trivial[i]) == w && strncmp(cmd, trivial[i], w) == 0)
+      return 1;
+  return 0;
+}
+
+/* Commands that probably carry credentials are neither imported from
+ * shell history nor written to comgen's own */
+static int looks_secret(const char *cmd) {
+  static const char *marks[] = {"password", "passwd", "secret", "token",
+                                "api_key",  "apikey", "authorization",
+                                "bearer ",  "private_key", "_key=",
+                                "sk-ant-",  "ghp_",   "github_pat_",
+                                "xoxb-",    "xoxp-"};
+  char lower[HIST_CMD_MAX];
+  size_t i = 0;
+  for (; cmd[i] && i + 1 < sizeof(lower); i++)
+    lower[i] = (char)tolower((unsigned char)cmd[i]);
+  lower[i] = '\0';
+  for (size_t m = 0; m < sizeof(marks) / sizeof(*marks); m++)
+    if (strstr(lower, marks[m]))
+      return 1;
+  /* mysql -uroot -phunter2: the password is glued to -p */
+  if (strstr(lower, "mysql") || strstr(lower, "mariadb"))
+    for (const char *p = lower; (p = strstr(p, " -p")); p++)
+      if (p[3] && p[3] != ' ')
+        return 1;
+  const char *url = strstr(lower, "://"); /* user:pass@host */
+  return url && strchr(url, '@') && strchr(url + 3, ':');
+}
+
+/* One history line -> command in place, or NULL to skip it. Handles zsh
+ * extended (": 1700000000:0;cmd") and metafied lines, bash timestamps,
+ * fish ("- cmd: ...") and multi-line entries (skipped). */
+static char *history_command(char *line, int *continued) {
+  size_t len = strcspn(line, "\r\n");
+  line[len] = '\0';
+  int was_continued = *continued;
+  *continued = len > 0 && line[len - 1] == '\\';
+  if (was_continued || *continued)
+    return NULL;
+
+  char *cmd = line;
+  if (cmd[0] == ':' && cmd[1] == ' ' && isdigit((unsigned char)cmd[2])) {
+    char *semi = strchr(cmd, ';');
+    if (!semi)
+      return NULL;
+    cmd = semi + 1;
+  } else if (cmd[0] == '#' && all_digits(cmd + 1)) {
+    return NULL;
+  } else if (strncmp(cmd, "- cmd: ", 7) == 0) {
+    cmd += 7;
+  } else if (cmd[0] == ' ' && strncmp(cmd, "  when: ", 8) == 0) {
+    return NULL;
+  }
+
+  /* zsh metafication: 0x83 escapes the next byte XOR 32 */
+  char *o = cmd;
+  for (char *p = cmd; *p; p++) {
+    if ((unsigned char)*p == 0x83 && p[1])
+      *o++ = (char)(*++p ^ 32);
+    else
+      *o++ = *p;
+  }
+  *o = '\0';
+
+  while (*cmd == ' ' || *cmd == '\t')
+    cmd++;
+  len = strlen(cmd);
+  while (len > 0 && (cmd[len - 1] == ' ' || cmd[len - 1] == '\t'))
+    cmd[--len] = '\0';
+  if (!len || len >= HIST_CMD_MAX || is_trivial_command(cmd) ||
+      looks_secret(cmd))
+    return NULL;
+  return cmd;
+}
+
+/* Streams one history file into ss; returns lines read or -1 */
+static long long import_history_file(SpaceSaving *ss, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+  char line[8192];
+  long long lines = 0;
+  int continued = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (!strchr(line, '\n') && !feof(fp)) {
+      /* Overlong line: drop the rest of it */
+      int ch;
+      while ((ch = fgetc(fp)) != EOF && ch != '\n')
+        ;
+      continued = 0;
+      lines++;
+      continue;
+    }
+    lines++;
+    char *cmd = history_command(line, &continued);
+    if (cmd)
+      ss_add(ss, cmd, strlen(cmd));
+  }
+  fclose(fp);
+  return lines;
+}
+
+/* An executable prog on PATH (or at its path), builtins aside */
+static int executable_on_path(const char *prog) {
+#ifdef _WIN32
+  (void)prog;
+  return 1; /* PATHEXT lookup is not worth it here */
+#else
+  struct stat st;
+  if (strchr(prog, '/'))
+    return stat(prog, &st) == 0;
+  const char *path = getenv("PATH");
+  while (path && *path) {
+    size_t dl = strcspn(path, ":");
+    char full[1200];
+    snprintf(full, sizeof(full), "%.*s/%s", (int)dl, path, prog);
+    if (dl && stat(full, &st) == 0 && !S_ISDIR(st.st_mode))
+      return 1;
+    path += dl + (path[dl] == ':');
+  }
+  return 0;
+#endif
+}
+
+static int command_on_path(const char *cmd) {
+  char prog[128];
+  size_t w = strcspn(cmd, " \t;|&<>()");
+  if (w == 0 || w >= sizeof(prog))
+    return 0;
+  memcpy(prog, cmd, w);
+  prog[w] = '\0';
+  static const char *builtins[] = {
+      ".",     "[",      "alias", "bg",     "cd",    "command", "declare",
+      "echo",  "eval",   "exec",  "exit",   "export", "fg",     "for",
+      "hash",  "if",     "jobs",  "kill",   "popd",  "printf",  "pushd",
+      "read",  "set",    "source", "test",  "trap",  "type",    "ulimit",
+      "umask", "unalias", "unset", "until", "wait",  "while"};
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); i++)
+    if (strcmp(prog, builtins[i]) == 0)
+      return 1;
+  return executable_on_path(prog);
+}
+
+typedef struct {
+  double score;
+  unsigned long count;
+  char *cmd;
+  uint64_t words[HIST_WORDS];
+  size_t n_words;
+} HistEntry;
+
+static int hist_entry_cmp(const void *a, const void *b) {
+  double x = ((const HistEntry *)a)->score, y = ((const HistEntry *)b)->score;
+  return (x < y) - (x > y);
+}
+
+/* Lowercased alnum words of at least two characters, minus filler */
+static size_t text_words(const char *s, uint64_t *out, size_t max) {
+  size_t n = 0;
+  while (*s && n < max) {
+    char w[32];
+    size_t len = 0;
+    while (*s && !isalnum((unsigned char)*s))
+      s++;
+    while (isalnum((unsigned char)*s)) {
+      if (len + 1 < sizeof(w))
+        w[len++] = (char)tolower((unsigned char)*s);
+      s++;
+    }
+    w[len] = '\0';
+    if (len >= 2 && !is_filler(w))
+      out[n++] = hash_bytes(w, len, HASH_SEED);
+  }
+  return n;
+}
+
+static int import_history(int argc, char **argv) {
+  double t0 = now_ms();
+  SpaceSaving *ss = malloc(sizeof(SpaceSaving));
+  if (!ss)
+    return 1;
+  ss->n = 0;
+  ss->seq = 0;
+  memset(ss->slots, 0xff, sizeof(ss->slots));
+
+  char paths[5][1024];
+  size_t n_paths = 0;
+  const char *home = getenv("HOME");
+  if (argc > 0) {
+    for (int i = 0; i < argc && n_paths < 5; i++)
+      snprintf(paths[n_paths++], sizeof(paths[0]), "%s", argv[i]);
+  } else if (home) {
+    /* Oldest habits first, comgen's own history last */
+    snprintf(paths[n_paths++], sizeof(paths[0]), "%s/.bash_history", home);
+    const char *histfile = getenv("HISTFILE");
+    snprintf(paths[n_paths++], sizeof(paths[0]), "%s",
+             histfile ? histfile : "");
+    snprintf(paths[n_paths++], sizeof(paths[0]), "%s/.zsh_history", home);
+    snprintf(paths[n_paths++], sizeof(paths[0]),
+             "%s/.local/share/fish/fish_history", home);
+    get_config_file(paths[n_paths++], sizeof(paths[0]), "history");
+  }
+
+  long long total = 0;
+  for (size_t i = 0; i < n_paths; i++) {
+    int dup = !paths[i][0];
+    for (size_t j = 0; j < i && !dup; j++)
+      dup = strcmp(paths[i], paths[j]) == 0;
+    if (dup)
+      continue;
+    long long lines = import_history_file(ss, paths[i]);
+    if (lines >= 0) {
+      printf("%-40s %lld lines\n", paths[i], lines);
+      total += lines;
+    }
+  }
+
+  /* Rank: frequency, discounted by up to half for old commands */
+  HistEntry *ranked = malloc(ss->n * sizeof(HistEntry) + 1);
+  size_t n = 0;
+  for (size_t i = 0; ranked && i < ss->n; i++) {
+    const HistCounter *c = &ss->c[i];
+    if (!command_on_path(c->cmd))
+      continue; /* Typos, prompts typed into comgen, removed tools */
+    ranked[n].score = (double)(c->count - c->error) *
+                      (0.5 + 0.5 * (double)c->last / (double)ss->seq);
+    ranked[n].count = c->count;
+    ranked[n++].cmd = (char *)c->cmd;
+  }
+  if (ranked)
+    qsort(ranked, n, sizeof(*ranked), hist_entry_cmp);
+
+  int rc = 1;
+  char path[1024], tmp[1100];
+  get_config_file(path, sizeof(path), "commands");
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *fp = ranked && ensure_config_dir() ? fopen(tmp, "w") : NULL;
+  if (fp) {
+    fprintf(fp, "# comgen import-history: score\tcount\tcommand\n");
+    for (size_t i = 0; i < n && i < HIST_KEEP; i++)
+      fprintf(fp, "%.2f\t%lu\t%s\n", ranked[i].score, ranked[i].count,
+              ranked[i].cmd);
+    if (fclose(fp) == 0 && rename(tmp, path) == 0)
+      rc = 0;
+    else
+      unlink(tmp);
+  }
+  if (rc == 0) {
+    printf(C_GREEN "Imported %lld lines in %.0f ms; kept %zu commands in %s"
+                   C_RESET "\n",
+           total, now_ms() - t0, n < HIST_KEEP ? n : (size_t)HIST_KEEP, path);
+    for (size_t i = 0; i < n && i < 5; i++)
+      printf(C_DIM "  %5lux  %s" C_RESET "\n", ranked[i].count,
+             ranked[i].cmd);
+  } else {
+    fprintf(stderr, C_RED "Could not write %s" C_RESET "\n", path);
+  }
+  free(ranked);
+  free(ss);
+  return rc;
+}
+
+/* The imported index, loaded on first use */
+static struct {
+  int loaded;
+  HistEntry *entries;
+  size_t n;
+} history_index;
+
+static void load_history_index(void) {
+  if (history_index.loaded)
+    return;
+  history_index.loaded = 1;
+  char path[1024];
+  get_config_file(path, sizeof(path), "commands");
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+  HistEntry *entries = calloc(HIST_KEEP, sizeof(HistEntry));
+  char line[HIST_CMD_MAX + 64];
+  size_t n = 0;
+  while (entries && n < HIST_KEEP && fgets(line, sizeof(line), fp)) {
+    char *tab1 = strchr(line, '\t'), *tab2 = tab1 ? strchr(tab1 + 1, '\t') : 0;
+    if (line[0] == '#' || !tab2)
+      continue;
+    line[strcspn(line, "\r\n")] = '\0';
+    HistEntry *e = &entries[n];
+    e->score = atof(line);
+    e->count = strtoul(tab1 + 1, NULL, 10);
+    if (!(e->cmd = strdup(tab2 + 1)))
+      break;
+    e->n_words = text_words(e->cmd, e->words, HIST_WORDS);
+    n++;
+  }
+  fclose(fp);
+  history_index.entries = entries;
+  history_index.n = n;
+}
+
+/* Indices of up to max imported commands sharing the most words with the
+ * prompt, best first; ties go to the higher ranked (earlier) entry */
+static size_t relevant_history(const char *prompt, size_t *out, size_t max) {
+  load_history_index();
+  uint64_t q[16];
+  size_t nq = text_words(prompt, q, 16), n = 0;
+  size_t best_overlap[HIST_EXAMPLES] = {0};
+  if (max > HIST_EXAMPLES)
+    max = HIST_EXAMPLES;
+  for (size_t i = 0; i < history_index.n; i++) {
+    const HistEntry *e = &history_index.entries[i];
+    size_t overlap = 0;
+    for (size_t a = 0; a < nq; a++)
+      for (size_t b = 0; b < e->n_words; b++)
+        if (q[a] == e->words[b]) {
+          overlap++;
+          break;
+        }
+    if (!overlap)
+      continue;
+    size_t pos = n < max ? n : max;
+    while (pos > 0 && best_overlap[pos - 1] < overlap)
+      pos--;
+    if (pos >= max)
+      continue;
+    size_t last = n < max ? n : max - 1;
+    for (size_t k = last; k > pos; k--) {
+      out[k] = out[k - 1];
+      best_overlap[k] = best_overlap[k - 1];
+    }
+    out[pos] = i;
+    best_overlap[pos] = overlap;
+    if (n < max)
+      n++;
+  }
+  return n;
+}
+
+/* "|Past:cmd ;; cmd|Tools:git,docker,..." few-shot context from the
+ * imported history; nothing before `comgen import-history` */
+static void append_history_context(StringBuffer *sb, const char *prompt) {
+  size_t idx[HIST_EXAMPLES];
+  size_t n = relevant_history(prompt, idx, HIST_EXAMPLES);
+  if (n) {
+    sb_append(sb, "|Past:");
+    for (size_t i = 0; i < n; i++) {
+      if (i)
+        sb_append(sb, " ;; ");
+      sb_append(sb, history_index.entries[idx[i]].cmd);
+    }
+  }
+  char tools[HIST_TOOLS][32];
+  size_t n_tools = 0;
+  for (size_t i = 0; i < history_index.n && n_tools < HIST_TOOLS; i++) {
+    const char *cmd = history_index.entries[i].cmd;
+    if (strncmp(cmd, "sudo ", 5) == 0)
+      cmd += 5;
+    size_t w = strcspn(cmd, " \t;|&");
+    if (w == 0 || w >= sizeof(tools[0]) || memchr(cmd, '/', w))
+      continue;
+    size_t t = 0;
+    while (t < n_tools && (strlen(tools[t]) != w || strncmp(tools[t], cmd, w)))
+      t++;
+    if (t < n_tools)
+      continue;
+    snprintf(tools[n_tools++], sizeof(tools[0]), "%.*s", (int)w, cmd);
+  }
+  for (size_t i = 0; i < n_tools; i++) {
+    sb_append(sb, i ? "," : "|Tools:");
+    sb_append(sb, tools[i]);
+  }
+}
+
+/* Offline fallback when generation failed */
+static void print_history_suggestions(FILE *out, const char *prompt) {
+  size_t idx[HIST_EXAMPLES];
+  size_t n = relevant_history(prompt, idx, HIST_EXAMPLES);
+  if (!n)
+    return;
+  fprintf(out, C_DIM "From your history:" C_RESET "\n");
+  for (size_t i = 0; i < n; i++)
+    fprintf(out, "  " C_CYAN "%s" C_RESET "\n",
+            history_index.entries[idx[i]].cmd);
+}
+
+/* Shell Passthrough: input that is already a shell command ("ls -la",
+ * "git status", "du -sh * | sort -h") skips the API and goes straight to
+ * the confirm step. A command word (builtin or on PATH) is required in
+ * every command position, no English filler may appear outside quotes,
+ * and the arguments need some shell evidence: flags, paths, globs,
+ * assignments, quotes, operators, or a subcommand of a multi-command
+ * tool. Bare numbers are not evidence ("kill port 22" is prose). Prefix
+ * a line with '?' to always ask the model, or '!' to always run it. */
+#define SHELL_MAX_TOKENS 64
+
+static int is_subcommand_tool(const char *w, size_t len) {
+  static const char *tools[] = {
+      "apt",  "brew",    "cargo", "docker", "dnf",    "gh",   "git",
+      "go",   "helm",    "kubectl", "make", "npm",    "pip",  "pnpm",
+      "podman", "systemctl", "terraform", "tmux", "yarn",
+  };
+  for (size_t i = 0; i < sizeof(tools) / sizeof(*tools); i++)
+    if (strlen(tools[i]) == len && strncmp(w, tools[i], len) == 0)
+      return 1;
+  return 0;
+}
+
+/* 1 when line looks like a shell command rather than a request */
+static int is_shell_command(const char *line) {
+  const char *p = line;
+  size_t n = 0;
+  int evidence = 0, command_pos = 1, tool = 0, plain_args = 0;
+  int builtin_only = 0; /* "read", "set", "wait": English words too */
+  while (*p) {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (!*p)
+      break;
+    if (++n > SHELL_MAX_TOKENS)
+      return 0;
+    /* Operators end a command; the next word is a command again */
+    if (strchr("|&;<>", *p) || (isdigit((unsigned char)*p) && p[1] == '>')) {
+      int ends = *p == '|' || *p == ';' || (*p == '&' && p[1] == '&');
+      while (*p && strchr("|&;<>0123456789", *p))
+        p++;
+      evidence = 1;
+      command_pos = ends;
+      continue;
+    }
+    char word[256];
+    size_t len = 0;
+    int quoted = 0, special = 0;
+    while (*p && *p != ' ' && *p != '\t' && !strchr("|&;<>", *p)) {
+      if (*p == '\'' || *p == '"') {
+        char q = *p++;
+        while (*p && *p != q)
+          p += (q == '"' && *p == '\\' && p[1]) ? 2 : 1;
+        if (!*p)
+          return 0; /* Unbalanced quote: an apostrophe in prose */
+        p++;
+        quoted = 1;
+        continue;
+      }
+      if (*p == '\\' && p[1])
+        p++;
+      /* Flags, paths, globs, assignments, expansions; not bare numbers,
+       * which prose has too ("over 100MB", "port 22") */
+      if (strchr("/.~*?[]=$`-:", *p))
+        special = 1;
+      if (len + 1 < sizeof(word))
+        word[len++] = *p;
+      p++;
+    }
+    word[len] = '\0';
+    /* "files." or "this, that": sentence punctuation, not a path */
+    if (len > 1 && strchr(".,?!", word[len - 1]) &&
+        isalpha((unsigned char)word[len - 2]))
+      return 0;
+    if (command_pos) {
+      /* VAR=value prefixes and sudo keep the command position */
+      if (strchr(word, '=') && !quoted) {
+        evidence = 1;
+        continue;
+      }
+      if (quoted || !command_on_path(word))
+        return 0;
+      if (n == 1 && isalpha((unsigned char)word[0]) &&
+          !executable_on_path(word))
+        builtin_only = 1;
+      command_pos = strcmp(word, "sudo") == 0 || strcmp(word, "env") == 0 ||
+                    strcmp(word, "time") == 0 || strcmp(word, "nohup") == 0;
+      if (!command_pos)
+        tool = is_subcommand_tool(word, len);
+      continue;
+    }
+    char lower[256];
+    for (size_t i = 0; i <= len; i++)
+      lower[i] = (char)tolower((unsigned char)word[i]);
+    struct stat st;
+    if (!quoted && !special && is_filler(lower))
+      return 0;
+    if (quoted || special || stat(word, &st) == 0)
+      evidence = 1;
+    else
+      plain_args++;
+  }
+  if (n == 0 || command_pos || (builtin_only && !evidence))
+    return 0;
+  /* "git status", "docker compose up": plain words after a tool */
+  return evidence || plain_args == 0 || (tool && plain_args <= 3);
+}
+
+/* Runs a plain "cd [dir]" in comgen itself, so it sticks */
+static int change_directory(const char *line) {
+  while (*line == ' ')
+    line++;
+  if (strncmp(line, "cd", 2) != 0 || (line[2] && line[2] != ' ') ||
+      strpbrk(line, "|&;<>$`'\"\\"))
+    return 0;
+  const char *arg = line + 2;
+  while (*arg == ' ')
+    arg++;
+  char target[1024];
+  size_t len = strcspn(arg, " ");
+  if (arg[len + strspn(arg + len, " ")])
+    return 0; /* More than one argument */
+  const char *home = getenv("HOME");
+  if (len == 0 || (len == 1 && arg[0] == '~'))
+    snprintf(target, sizeof(target), "%s", home ? home : "/");
+  else if (len == 1 && arg[0] == '-' && getenv("OLDPWD"))
+    snprintf(target, sizeof(target), "%s", getenv("OLDPWD"));
+  else if (arg[0] == '~' && arg[1] == '/' && home)
+    snprintf(target, sizeof(target), "%s%.*s", home, (int)len - 1, arg + 1);
+  else
+    snprintf(target, sizeof(target), "%.*s", (int)len, arg);
+
+  char old[1024];
+  if (!getcwd(old, sizeof(old)))
+    old[0] = '\0';
+  if (chdir(target) != 0) {
+    printf(C_RED "cd: %s: %s" C_RESET "\n", target, strerror(errno));
+    return 1;
+  }
+  char now[1024];
+  if (getcwd(now, sizeof(now))) {
+#ifndef _WIN32
+    int settled = probes_settle();
+    env_set("OLDPWD", old, settled);
+    env_set("PWD", now, settled);
+#endif
+    printf(C_DIM "%s" C_RESET "\n", now);
+  }
+  return 1;
+}
+
+/* persistent_shell=1: executed commands share one shell (coproc_run) */
+static int persistent_shell;
+/* capture_output=1, output_log=<file>: see Output Capture */
+static int capture_output;
+static char output_log[1024];
+
+/* Config Management */
+static void get_config_path(char *buf, size_t size) {
+#ifdef _WIN32
+  const char *appdata = getenv("APPDATA");
+  if (!appdata)
+    appdata = getenv("USERPROFILE");
+  snprintf(buf, size, "%s\\comgen", appdata);
+#else
+  const char *home = getenv("HOME");
+  snprintf(buf, size, "%s/.config/comgen", home);
+#endif
+}
+
+/* Full path of a file inside the config dir */
+static void get_config_file(char *buf, size_t size, const char *name) {
+  get_config_path(buf, size);
+  strncat(buf, "/", size - strlen(buf) - 1);
+  strncat(buf, name, size - strlen(buf) - 1);
+#ifdef _WIN32
+  for (int i = 0; buf[i]; i++)
+    if (buf[i] == '/')
+      buf[i] = '\\';
+#endif
+}
+
+static int ensure_config_dir(void) {
+  char path[1024];
+  get_config_path(path, sizeof(path));
+#ifdef _WIN32
+  return _mkdir(path) == 0 || errno == EEXIST;
+#else
+  /* Try creating parent .config first just in case */
+  char parent[1024];
+  snprintf(parent, sizeof(parent), "%s/.config", getenv("HOME"));
+  mkdir(parent, 0755);
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+static void load_config_file(ComgenSession *s) {
+  char path[1024];
+  get_config_file(path, sizeof(path), "config");
+
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    char *eq = strchr(line, '=');
+    if (eq) {
+      *eq = 0;
+      char *key = line;
+      char *val = eq + 1;
+      val[strcspn(val, "\r\n")] = 0;
+
+      if (strcmp(key, "api_key") == 0) {
+        /* The first key is the session's; all of them form the pool */
+        if (!s->api_key)
+          s->api_key = strdup(val);
+        key_pool_add(val);
+      } else if (strcmp(key, "model") == 0) {
+        if (s->model)
+          free(s->model);
+        s->model = strdup(val);
+      }
+      else if (strcmp(key, "persistent_shell") == 0)
+        persistent_shell = atoi(val) != 0;
+      else if (strcmp(key, "capture_output") == 0)
+        capture_output = atoi(val) != 0;
+      else if (strcmp(key, "output_log") == 0) {
+        const char *home = getenv("HOME");
+        if (val[0] == '~' && val[1] == '/' && home)
+          snprintf(output_log, sizeof(output_log), "%s%s", home, val + 1);
+        else
+          snprintf(output_log, sizeof(output_log), "%s", val);
+        capture_output = 1; /* The log is written from the capture */
+      }
+#ifndef _WIN32
+      else if (strcmp(key, "shared_cache") == 0)
+        snprintf(shm_cache.name, sizeof(shm_cache.name), "%s", val);
+#endif
+    }
+  }
+  fclose(fp);
+}
+
+static void save_config_file(const char *key, const char *model) {
+  if (!ensure_config_dir())
+    return;
+
+  char path[1024];
+  get_config_file(path, sizeof(path), "config");
+
+  FILE *fp = fopen(path, "w");
+  if (fp) {
+    fprintf(fp, "api_key=%s\n", key);
+    if (model)
+      fprintf(fp, "model=%s\n", model);
+    fclose(fp);
+    printf(C_GREEN "Configuration saved to %s" C_RESET "\n", path);
+  } else {
+    printf(C_RED "Failed to save config to %s" C_RESET "\n", path);
+  }
+}
+
+/* Initialization & Cleanup */
+static int session_init(ComgenSession *s) {
+  s->api_key = NULL;
+  s->model = NULL;
+
+  /* 1. Try Config */
+  key_pool_clear();
+  load_config_file(s);
+
+  /* 2. Try Env (Override) */
+  char *env_key = getenv("ANTHROPIC_API_KEY");
+  if (env_key) {
+    if (s->api_key)
+      free(s->api_key);
+    s->api_key = strdup(env_key);
+    key_pool_clear();
+    key_pool_add(env_key);
+  }
+  /* Separate one-shot runs start on different keys */
+  key_pool.next = (size_t)(now_ms() * 1000);
+
+#ifndef _WIN32
+  char *env_shm = getenv("COMGEN_SHARED_CACHE");
+  if (env_shm)
+    snprintf(shm_cache.name, sizeof(shm_cache.name), "%s", env_shm);
+#endif
+
+  char *env_model = getenv("COMGEN_MODEL");
+  if (env_model) {
+    if (s->model)
+      free(s->model);
+    s->model = strdup(env_model);
+  }
+
+  /* Defaults */
+  if (!s->model)
+    s->model = strdup(DEFAULT_MODEL);
+
+  if (!s->api_key)
+    return 0;
+
+#ifdef _WIN32
+  s->hSession = WinHttpOpen(L"comgen/2.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+                            WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+  if (!s->hSession)
+    return 0;
+
+  s->hConnect = WinHttpConnect(s->hSession, L"api.anthropic.com",
+                               INTERNET_DEFAULT_HTTPS_PORT, 0);
+  if (!s->hConnect) {
+    WinHttpCloseHandle(s->hSession);
+    return 0;
+  }
+#else
+  s->curl = curl_easy_init();
+  if (!s->curl)
+    return 0;
+
+  struct curl_slist *headers = NULL;
+  char auth_header[256];
+  snprintf(auth_header, sizeof(auth_header), "x-api-key: %s", s->api_key);
+
+  headers = curl_slist_append(headers, "Content-Type: application/json");
+  headers = curl_slist_append(headers, auth_header);
+  headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
+
+  /* COMGEN_API_URL: another endpoint, e.g. a local mock for benchmarks */
+  const char *url = getenv("COMGEN_API_URL");
+  curl_easy_setopt(s->curl, CURLOPT_URL,
+                   url ? url : "https://api.anthropic.com/v1/messages");
+  curl_easy_setopt(
+      s->curl, CURLOPT_HTTPHEADER,
+      headers); /* Headers stored in handle? No, must keep list alive? */
+  /* Actually CURLOPT_HTTPHEADER pointer must be valid during perform.
+     Optimisation: We can create headers once and store in session, or
+     re-create. Let's store them in session to be perfectly safe and efficient.
+   */
+  /* Simplified: Set them here, but we need to keep headers valid. */
+  /* Fix: Add headers to struct or make static logic. For now, we will NOT free
+     headers until exit if we set them here? CURL documentation says: "The
+     linked list must be kept available until the transfer is done" So we can
+     attach them to the handle permanently? No, easy_perform uses them.
+     Optimization solution: Attached headers once in init. */
+
+  /* Hack: We need to store persistent headers pointer in session to free it
+     later, but ComgenSession definition is minimal. Let's just set it and
+     forget strict purity or add `struct curl_slist *headers` to ComgenSession.
+   */
+  /* For this generated code, I'll attach it and let OS cleanup at exit,
+     or ideally add void* internal_data to session. */
+
+  /* Let's modify the struct locally if needed, or re-alloc headers per request
+     (small overhead). Actually, re-alloc headers per request is safer if we
+     don't change struct definition too much. BUT we want optimizations! Let's
+     rely on the fact we only start curl once. */
+
+  /* Wait, I can't modify the struct definition inside this function easily
+     without forward declaration. Let's just attach headers once and keep them.
+     Mem leak on exit is acceptable for CLI tool OS reclamation. */
+  curl_easy_setopt(s->curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(s->curl, CURLOPT_WRITEFUNCTION, write_cb);
+#endif
+  return 1;
+}
+
+static void session_cleanup(ComgenSession *s) {
+  if (s->api_key)
+    free(s->api_key);
+  if (s->model)
+    free(s->model);
+#ifdef _WIN32
+  if (s->hConnect)
+    WinHttpCloseHandle(s->hConnect);
+  if (s->hSession)
+    WinHttpCloseHandle(s->hSession);
+#else
+  if (s->curl)
+    curl_easy_cleanup(s->curl);
+#endif
+}
+
+#ifndef _WIN32
+/* Command Execution: a command without shell syntax (quotes, globs,
+ * expansions, redirections, assignments, builtins) is split on blanks
+ * and exec'd directly; anything else runs under /bin/sh -c, as with
+ * system(). Both go through posix_spawn, which glibc implements with
+ * vfork semantics, so no copy of comgen's address space is made. Like
+ * system(), comgen ignores SIGINT and SIGQUIT while it waits; the child
+ * starts with default dispositions (SIGPIPE included, which the daemon
+ * ignores) and an empty signal mask. */
+#define EXEC_MAX_ARGS 256
+
+extern char **environ;
+
+/* Builtins and keywords of sh, bash and zsh with no executable of their
+ * own; a word missed here still reaches sh through run_command's ENOENT
+ * fallback */
+static const char *shell_builtins[] = {
+    "cd",       "export",   "unset",    "alias",     "unalias",  "source",
+    ".",        "exec",     "eval",     "set",       "ulimit",   "umask",
+    "read",     "exit",     "trap",     "shift",     "wait",     "jobs",
+    "fg",       "bg",       "hash",     "type",      "command",  "builtin",
+    "local",    "readonly", "declare",  "typeset",   "history",  "shopt",
+    "setopt",   "unsetopt", "if",       "for",       "while",    "until",
+    "case",     "select",   "time",     "function",  "!",        ":",
+    "pushd",    "popd",     "dirs",     "let",       "getopts",  "return",
+    "break",    "continue", "times",    "logout",    "disown",   "suspend",
+    "enable",   "caller",   "help",     "bind",      "fc",       "mapfile",
+    "readarray", "complete", "compgen", "compopt",   "coproc",   "autoload",
+    "bindkey",  "emulate",  "functions", "rehash",   "whence",   "where",
+    "zmodload", "noglob",   "print",    NULL};
+
+/* Splits cmd into argv (backed by buf) when no shell is needed */
+static int split_simple_command(const char *cmd, char *buf, size_t size,
+                                char **argv) {
+  if (strlen(cmd) >= size || strpbrk(cmd, "|&;<>()$`\\\"'*?[]{}~#\n"))
+    return 0;
+  strcpy(buf, cmd);
+  int argc = 0;
+  for (char *tok = strtok(buf, " \t"); tok; tok = strtok(NULL, " \t")) {
+    if (argc == EXEC_MAX_ARGS)
+      return 0;
+    argv[argc++] = tok;
+  }
+  argv[argc] = NULL;
+  if (!argc || strchr(argv[0], '='))
+    return 0;
+  for (const char **b = shell_builtins; *b; b++)
+    if (strcmp(argv[0], *b) == 0)
+      return 0;
+  return 1;
+}
+
+typedef struct {
+  struct sigaction intr, quit;
+  sigset_t mask;
+} HeldSignals;
+
+/* While a command has the terminal, as system() does */
+static void hold_signals(HeldSignals *h) {
+  struct sigaction ign;
+  memset(&ign, 0, sizeof(ign));
+  ign.sa_handler = SIG_IGN;
+  sigemptyset(&ign.sa_mask);
+  sigaction(SIGINT, &ign, &h->intr);
+  sigaction(SIGQUIT, &ign, &h->quit);
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &h->mask);
+}
+
+static void release_signals(const HeldSignals *h) {
+  sigaction(SIGINT, &h->intr, NULL);
+  sigaction(SIGQUIT, &h->quit, NULL);
+  sigprocmask(SIG_SETMASK, &h->mask, NULL);
+}
+
+static void spawn_attr_init(posix_spawnattr_t *attr) {
+  posix_spawnattr_init(attr);
+  sigset_t none, dfl;
+  sigemptyset(&none);
+  sigemptyset(&dfl);
+  sigaddset(&dfl, SIGINT);
+  sigaddset(&dfl, SIGQUIT);
+  sigaddset(&dfl, SIGPIPE);
+  sigaddset(&dfl, SIGCHLD);
+  posix_spawnattr_setsigmask(attr, &none);
+  posix_spawnattr_setsigdefault(attr, &dfl);
+  posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGMASK |
+                                     POSIX_SPAWN_SETSIGDEF);
+}
+
+/* Output Capture (opt-in, capture_output=1): a spawned command's stdout
+ * and stderr reach the terminal through pipes, and comgen keeps the
+ * first and last few KB of each with byte and line counts. Memory stays
+ * fixed however much a command prints; /output shows the last run.
+ * With output_log=<file> both streams are also appended to that file;
+ * on Linux they are moved there with tee(2) and splice(2), so the log
+ * copy never passes through comgen's memory. Commands see pipes rather
+ * than a terminal (no colours, pagers or full-screen programs), hence
+ * opt-in; commands in a persistent_shell are not captured. */
+#define CAPTURE_HEAD 4096
+#define CAPTURE_TAIL 4096
+#define CAPTURE_CHUNK 65536 /* A default pipe's capacity */
+#define CAPTURE_POLL_MS 100 /* Checks whether the command has exited */
+
+typedef struct {
+  char head[CAPTURE_HEAD];
+  char tail[CAPTURE_TAIL]; /* Ring: byte n of the stream at n % size */
+  unsigned long long bytes, lines;
+  char last; /* For an unterminated last line */
+} OutputCapture;
+
+static struct {
+  int valid;
+  char cmd[256];
+  OutputCapture out, err;
+} last_run;
+
+typedef struct {
+  int fd;         /* Read end of the command's pipe, -1 at EOF */
+  int term;       /* Where it is shown */
+  int scratch[2]; /* tee(2) target for the log, -1 without */
+  OutputCapture *cap;
+} CaptureStream;
+
+static void capture_add(OutputCapture *c, const char *buf, size_t n) {
+  if (c->bytes < CAPTURE_HEAD) {
+    size_t k = CAPTURE_HEAD - (size_t)c->bytes;
+    memcpy(c->head + c->bytes, buf, n < k ? n : k);
+  }
+  for (size_t i = n > CAPTURE_TAIL ? n - CAPTURE_TAIL : 0; i < n;) {
+    size_t at = (size_t)((c->bytes + i) % CAPTURE_TAIL);
+    size_t k = n - i < CAPTURE_TAIL - at ? n - i : CAPTURE_TAIL - at;
+    memcpy(c->tail + at, buf + i, k);
+    i += k;
+  }
+  for (const char *p = buf; (p = memchr(p, '\n', n - (size_t)(p - buf)));
+       p++)
+    c->lines++;
+  c->bytes += n;
+  if (n)
+    c->last = buf[n - 1];
+}
+
+static void write_all(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return;
+    p += w;
+    n -= (size_t)w;
+  }
+}
+
+/* Moves what is buffered on s to the terminal, capture and log; returns
+ * 0 at EOF. *log_fd becomes -1 if the log cannot be written. */
+static int capture_pump(CaptureStream *s, int *log_fd, char *buf) {
+  ssize_t n;
+#ifdef __linux__
+  if (*log_fd >= 0 && s->scratch[0] >= 0) {
+    /* Duplicate into scratch, then move the original to the log */
+    n = tee(s->fd, s->scratch[1], CAPTURE_CHUNK, 0);
+    if (n == 0)
+      return 0;
+    if (n > 0) {
+      ssize_t moved = 0;
+      while (moved < n) {
+        ssize_t m = splice(s->fd, NULL, *log_fd, NULL, (size_t)(n - moved),
+                           SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+          continue;
+        if (m <= 0)
+          break;
+        moved += m;
+      }
+      if (moved < n)
+        *log_fd = -1; /* Log failed: drop the rest of the teed bytes */
+      while (moved < n) {
+        ssize_t m = read(s->fd, buf, (size_t)(n - moved));
+        if (m <= 0)
+          break;
+        moved += m;
+      }
+      for (ssize_t got = 0, r; got < n; got += r) {
+        if ((r = read(s->scratch[0], buf, (size_t)(n - got))) <= 0)
+          return 0;
+        capture_add(s->cap, buf, (size_t)r);
+        write_all(s->term, buf, (size_t)r);
+      }
+      return 1;
+    }
+    if (errno == EINTR)
+      return 1;
+    close(s->scratch[0]); /* e.g. a log on a filesystem without splice */
+    close(s->scratch[1]);
+    s->scratch[0] = s->scratch[1] = -1;
+  }
+#endif
+  n = read(s->fd, buf, CAPTURE_CHUNK);
+  if (n < 0 && errno == EINTR)
+    return 1;
+  if (n <= 0)
+    return 0;
+  capture_add(s->cap, buf, (size_t)n);
+  write_all(s->term, buf, (size_t)n);
+  if (*log_fd >= 0)
+    write_all(*log_fd, buf, (size_t)n);
+  return 1;
+}
+
+/* Relays the command's output until it exits and the pipes are drained.
+ * A background job that keeps them open is given CAPTURE_POLL_MS after
+ * that, not waited for. Returns the wait status. */
+static int capture_run(pid_t pid, CaptureStream *s, int log_fd) {
+  char *buf = malloc(CAPTURE_CHUNK);
+  int status = -1, exited = 0;
+  double drain_until = 0;
+  while (buf && (s[0].fd >= 0 || s[1].fd >= 0)) {
+    struct pollfd pfd[2] = {{s[0].fd, POLLIN, 0}, {s[1].fd, POLLIN, 0}};
+    int r = poll(pfd, 2, exited ? 0 : CAPTURE_POLL_MS);
+    if (r < 0 && errno != EINTR)
+      break;
+    if (exited && (r == 0 || now_ms() > drain_until))
+      break;
+    for (int i = 0; r > 0 && i < 2; i++)
+      if (pfd[i].revents && !capture_pump(&s[i], &log_fd, buf)) {
+        close(s[i].fd);
+        s[i].fd = -1;
+      }
+    if (!exited && waitpid(pid, &status, WNOHANG) == pid) {
+      exited = 1;
+      drain_until = now_ms() + CAPTURE_POLL_MS;
+    }
+  }
+  free(buf);
+  for (int i = 0; i < 2; i++)
+    if (s[i].fd >= 0)
+      close(s[i].fd);
+  while (!exited && waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  return status;
+}
+
+/* Relays and captures a spawned command's output, given the read ends of
+ * its stdout and stderr pipes; returns its wait status */
+static int capture_command(pid_t pid, const char *cmd, int out_fd,
+                           int err_fd) {
+  memset(&last_run, 0, sizeof(last_run));
+  last_run.valid = 1;
+  snprintf(last_run.cmd, sizeof(last_run.cmd), "%s", cmd);
+  CaptureStream s[2] = {
+      {out_fd, STDOUT_FILENO, {-1, -1}, &last_run.out},
+      {err_fd, STDERR_FILENO, {-1, -1}, &last_run.err}};
+  /* Not O_APPEND, which splice(2) refuses; comgen appends by seeking */
+  int log_fd = output_log[0]
+                   ? open(output_log, O_RDWR | O_CREAT | O_CLOEXEC, 0600)
+                   : -1;
+  if (log_fd >= 0) {
+    off_t end = lseek(log_fd, 0, SEEK_END);
+    char last = '\n';
+    if (end > 0 && pread(log_fd, &last, 1, end - 1) == 1 && last != '\n')
+      write_all(log_fd, "\n", 1); /* The previous output was unterminated */
+    write_all(log_fd, "$ ", 2);
+    write_all(log_fd, cmd, strlen(cmd));
+    write_all(log_fd, "\n", 1);
+#ifdef __linux__
+    for (int i = 0; i < 2; i++) {
+      if (pipe(s[i].scratch) != 0) {
+        s[i].scratch[0] = s[i].scratch[1] = -1;
+        continue;
+      }
+      fcntl(s[i].scratch[0], F_SETFD, FD_CLOEXEC);
+      fcntl(s[i].scratch[1], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+  }
+  int status = capture_run(pid, s, log_fd);
+  for (int i = 0; i < 2; i++)
+    if (s[i].scratch[0] >= 0) {
+      close(s[i].scratch[0]);
+      close(s[i].scratch[1]);
+    }
+  if (log_fd >= 0)
+    close(log_fd);
+  return status;
+}
+
+static unsigned long long capture_lines(const OutputCapture *c) {
+  return c->lines + (c->bytes && c->last != '\n');
+}
+
+static void print_capture(const char *name, const OutputCapture *c) {
+  char size[24];
+  format_size(c->bytes, size, sizeof(size));
+  printf(C_DIM "%s: %llu lines, %s" C_RESET "\n", name, capture_lines(c),
+         size);
+  if (!c->bytes)
+    return;
+  fwrite(c->head, 1, c->bytes < CAPTURE_HEAD ? c->bytes : CAPTURE_HEAD,
+         stdout);
+  if (c->bytes > CAPTURE_HEAD) {
+    unsigned long long rest = c->bytes - CAPTURE_HEAD;
+    size_t tail = rest < CAPTURE_TAIL ? (size_t)rest : CAPTURE_TAIL;
+    if (rest > tail)
+      printf("\n" C_DIM "... %llu bytes ..." C_RESET "\n", rest - tail);
+    for (size_t i = 0; i < tail; i++)
+      putchar(c->tail[(c->bytes - tail + i) % CAPTURE_TAIL]);
+  }
+  if (c->last != '\n')
+    putchar('\n');
+}
+
+/* /output */
+static void print_last_run(void) {
+  if (!last_run.valid) {
+    printf(C_DIM "No captured output (capture_output=1 in the config)"
+                 C_RESET "\n");
+    return;
+  }
+  printf(C_DIM "$ %s" C_RESET "\n", last_run.cmd);
+  print_capture("stdout", &last_run.out);
+  print_capture("stderr", &last_run.err);
+}
+
+/* One line after a captured command */
+static void print_capture_summary(void) {
+  char out[24], err[24];
+  format_size(last_run.out.bytes, out, sizeof(out));
+  format_size(last_run.err.bytes, err, sizeof(err));
+  printf(C_DIM "Output: %llu lines (%s), stderr %llu lines (%s); /output "
+               "shows head and tail" C_RESET "\n",
+         capture_lines(&last_run.out), out, capture_lines(&last_run.err),
+         err);
+}
+
+/* Runs cmd in the foreground; returns its wait status, or -1 with errno
+ * set when it could not be started */
+static int run_command(const char *cmd) {
+  char buf[4096];
+  char *argv[EXEC_MAX_ARGS + 1];
+  char *sh_argv[] = {"sh", "-c", (char *)cmd, NULL};
+  int direct = split_simple_command(cmd, buf, sizeof(buf), argv);
+
+  /* Captured: stdout and stderr become pipes */
+  int out[2] = {-1, -1}, errp[2] = {-1, -1};
+  int capture = capture_output && pipe(out) == 0;
+  if (capture && pipe(errp) != 0) {
+    close(out[0]);
+    close(out[1]);
+    capture = 0;
+  }
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  if (capture) {
+    int fds[4] = {out[0], out[1], errp[0], errp[1]};
+    for (int i = 0; i < 4; i++)
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, errp[1], STDERR_FILENO);
+  }
+
+  HeldSignals held;
+  hold_signals(&held);
+  posix_spawnattr_t attr;
+  spawn_attr_init(&attr);
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid;
+  int err = direct ? posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ)
+                   : ENOENT;
+  /* Not on PATH: sh runs it if it is a builtin, or reports it */
+  if (err == ENOENT && (!direct || !strchr(argv[0], '/')))
+    err = posix_spawn(&pid, "/bin/sh", &fa, &attr, sh_argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  if (capture) {
+    close(out[1]);
+    close(errp[1]);
+  }
+  int status = -1;
+  if (!err && capture)
+    status = capture_command(pid, cmd, out[0], errp[0]);
+  else if (!err)
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+  else if (capture) {
+    close(out[0]);
+    close(errp[0]);
+  }
+  release_signals(&held);
+  if (err)
+    errno = err;
+  return status;
+}
+
+/* Shell Coprocess (opt-in, persistent_shell=1 in the config): executed
+ * commands go to one long-lived bash or zsh rather than a new process
+ * each, so shell startup is paid once and cd, export or an activated
+ * virtualenv carry over to the next command. The shell keeps comgen's
+ * terminal as stdin, stdout and stderr. Each command arrives on fd 8 as
+ * comgen's directory, the command lines and a per-session sentinel
+ * line; the shell answers on fd 9 with the exit status, $PWD and each
+ * of coproc_vars ("NAME=value", or "NAME" when unset), NUL separated
+ * and ended by an empty field. Commands run with both fds closed, so
+ * nothing they start holds the control pipes. comgen then follows the
+ * shell's directory and those variables, so the context it sends
+ * matches the shell. Startup files are not read. A shell that exits
+ * (e.g. `exit`) is replaced on the next command. */
+#define COPROC_CMD_FD 8
+#define COPROC_REPLY_FD 9
+
+static const char *coproc_vars[] = {"OLDPWD",       "PATH",
+                                    "VIRTUAL_ENV",  "CONDA_DEFAULT_ENV",
+                                    "CONDA_PREFIX", "IN_NIX_SHELL",
+                                    NULL};
+
+static struct {
+  pid_t pid; /* 0: not running */
+  int cmd_fd, reply_fd;
+  char sentinel[40];
+} coproc;
+
+static void coproc_close(void) {
+  close(coproc.cmd_fd);
+  close(coproc.reply_fd);
+  coproc.pid = 0;
+}
+
+static int coproc_start(void) {
+  int cmd[2], reply[2];
+  if (pipe(cmd) != 0)
+    return 0;
+  if (pipe(reply) != 0) {
+    close(cmd[0]);
+    close(cmd[1]);
+    return 0;
+  }
+  fcntl(cmd[1], F_SETFD, FD_CLOEXEC);
+  fcntl(reply[0], F_SETFD, FD_CLOEXEC);
+  snprintf(coproc.sentinel, sizeof(coproc.sentinel), "__comgen_%016llx",
+           (unsigned long long)mix64((uint64_t)now_ms() ^
+                                     ((uint64_t)getpid() << 32)));
+
+  StringBuffer vars, driver;
+  sb_init(&vars);
+  for (const char **v = coproc_vars; *v; v++) {
+    sb_append(&vars, " ");
+    sb_append(&vars, *v);
+  }
+  sb_init(&driver);
+  char buf[2048];
+  snprintf(buf, sizeof(buf),
+           "trap : INT QUIT\n"
+           "while IFS= read -r __cg_dir <&%d; do\n"
+           "  __cg_cmd=\n"
+           "  while IFS= read -r __cg_l <&%d && [ \"$__cg_l\" != %s ]; do\n"
+           "    __cg_cmd=\"$__cg_cmd$__cg_l\n\"\n"
+           "  done\n"
+           "  [ \"$PWD\" = \"$__cg_dir\" ] || cd -- \"$__cg_dir\"\n"
+           "  eval \"$__cg_cmd\" %d<&- %d>&-\n"
+           "  printf '%%s\\0%%s\\0' \"$?\" \"$PWD\" >&%d\n"
+           "  for __cg_n in%s; do\n"
+           "    eval \"__cg_v=\\${$__cg_n-}; __cg_s=\\${$__cg_n+=}\"\n"
+           "    printf '%%s%%s%%s\\0' \"$__cg_n\" \"$__cg_s\" \"$__cg_v\" "
+           ">&%d\n"
+           "  done\n"
+           "  printf '\\0' >&%d\n"
+           "done\n",
+           COPROC_CMD_FD, COPROC_CMD_FD, coproc.sentinel, COPROC_CMD_FD,
+           COPROC_REPLY_FD, COPROC_REPLY_FD, vars.data, COPROC_REPLY_FD,
+           COPROC_REPLY_FD);
+  sb_append(&driver, buf);
+  sb_free(&vars);
+
+  /* $SHELL when it is bash or zsh */
+  const char *shell = getenv("SHELL");
+  const char *base = shell ? strrchr(shell, '/') : NULL;
+  base = base ? base + 1 : shell;
+  if (!base || (strcmp(base, "bash") != 0 && strcmp(base, "zsh") != 0))
+    shell = base = "bash";
+  char *argv[] = {(char *)base, "-c", driver.data, NULL};
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, cmd[0], COPROC_CMD_FD);
+  posix_spawn_file_actions_adddup2(&fa, reply[1], COPROC_REPLY_FD);
+  posix_spawnattr_t attr;
+  spawn_attr_init(&attr);
+  int err = posix_spawnp(&coproc.pid, shell, &fa, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  sb_free(&driver);
+  close(cmd[0]);
+  close(reply[1]);
+  coproc.cmd_fd = cmd[1];
+  coproc.reply_fd = reply[0];
+  if (err) {
+    coproc_close();
+    return 0;
+  }
+  return 1;
+}
+
+/* Applies a reply: directory and variables */
+static void coproc_sync(const char *reply, size_t len) {
+  int settled = probes_settle();
+  const char *pwd = reply + strlen(reply) + 1;
+  char cwd[1024];
+  if (*pwd && (!getcwd(cwd, sizeof(cwd)) || strcmp(cwd, pwd) != 0) &&
+      chdir(pwd) == 0) {
+    env_set("PWD", pwd, settled);
+    printf(C_DIM "%s" C_RESET "\n", pwd);
+  }
+  for (const char *v = pwd + strlen(pwd) + 1; v < reply + len && *v;
+       v += strlen(v) + 1) {
+    const char *eq = strchr(v, '=');
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int)(eq ? eq - v : 63), v);
+    env_set(name, eq ? eq + 1 : NULL, settled);
+  }
+}
+
+/* Runs cmd in the coprocess; returns its exit status (128+n after signal
+ * n), or -1 when no shell took it */
+static int coproc_run(const char *cmd) {
+  if (!coproc.pid && !coproc_start())
+    return -1;
+  char cwd[1024];
+  if (!getcwd(cwd, sizeof(cwd)))
+    snprintf(cwd, sizeof(cwd), ".");
+  StringBuffer req;
+  sb_init(&req);
+  sb_append(&req, cwd);
+  sb_append(&req, "\n");
+  sb_append(&req, cmd);
+  sb_append(&req, "\n");
+  sb_append(&req, coproc.sentinel);
+  sb_append(&req, "\n");
+
+  HeldSignals held;
+  hold_signals(&held);
+  void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+  fflush(stdout);
+  fflush(stderr);
+  int sent = 1;
+  for (size_t off = 0; sent && off < req.len;) {
+    ssize_t n = write(coproc.cmd_fd, req.data + off, req.len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    sent = n > 0;
+    off += sent ? (size_t)n : 0;
+  }
+  sb_free(&req);
+  StringBuffer reply;
+  sb_init(&reply);
+  int done = 0;
+  while (sent && !done) {
+    char buf[4096];
+    ssize_t n = read(coproc.reply_fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    sb_append_n(&reply, buf, (size_t)n);
+    done = reply.len >= 2 && !reply.data[reply.len - 1] &&
+           !reply.data[reply.len - 2];
+  }
+  signal(SIGPIPE, old_pipe);
+
+  int rc = -1;
+  if (done) {
+    rc = atoi(reply.data);
+    coproc_sync(reply.data, reply.len);
+  } else {
+    /* The shell is gone: if it got the command, it exited running it */
+    pid_t pid = coproc.pid;
+    int status = 0;
+    coproc_close();
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+    if (sent)
+      rc = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                               : WEXITSTATUS(status);
+  }
+  release_signals(&held);
+  sb_free(&reply);
+  return rc;
+}
+
+static void report_exit(int code, int sig, int core) {
+  if (sig)
+    printf(C_RED "Killed by signal %d (%s)%s" C_RESET "\n", sig,
+           strsignal(sig), core ? ", core dumped" : "");
+  else if (code == 0)
+    printf(C_GREEN "Success" C_RESET "\n");
+  else
+    printf(C_RED "Exit: %d" C_RESET "\n", code);
+}
+#endif
+
+static void execute_command(const char *cmd) {
+  printf("\n" C_DIM "Executing..." C_RESET "\n");
+#ifdef _WIN32
+  int ret = system(cmd);
+  if (ret == 0)
+    printf(C_GREEN "Success" C_RESET "\n");
+  else
+    printf(C_RED "Exit: %d" C_RESET "\n", ret);
+#else
+  int rc = persistent_shell ? coproc_run(cmd) : -1;
+  if (rc > 128 && rc < 128 + NSIG)
+    report_exit(0, rc - 128, 0); /* The shell's way of saying signal */
+  else if (rc >= 0)
+    report_exit(rc, 0, 0);
+  else if ((rc = run_command(cmd)) == -1)
+    printf(C_RED "Cannot run %s: %s" C_RESET "\n", cmd, strerror(errno));
+  else {
+    report_exit(WIFEXITED(rc) ? WEXITSTATUS(rc) : 0,
+                WIFSIGNALED(rc) ? WTERMSIG(rc) : 0,
+#ifdef WCOREDUMP
+                WIFSIGNALED(rc) && WCOREDUMP(rc)
+#else
+                0
+#endif
+    );
+    if (capture_output)
+      print_capture_summary();
+  }
+#endif
+  printf("\n");
+}
+
+/* Prompt Action */
+static char prompt_action(void) {
+  printf(C_BOLD "Execute? " C_RESET "[" C_GREEN "y" C_RESET "/" C_RED
+                "n" C_RESET "/" C_YELLOW "e" C_RESET "dit]: ");
+  fflush(stdout);
+
+  char buf[64];
+  if (!fgets(buf, sizeof(buf), stdin))
+    return 'n';
+  if (buf[0] == 'y' || buf[0] == 'Y' || buf[0] == '\n')
+    return 'y';
+  if (buf[0] == 'e' || buf[0] == 'E')
+    return 'e';
+  return 'n';
+}
+
+/* Editor Logic */
+static void edit_command_in_editor(char *cmd_buf, size_t buf_size) {
+#ifdef _WIN32
+  char temp_path[MAX_PATH];
+  char temp_file[MAX_PATH];
+
+  if (GetTempPathA(MAX_PATH, temp_path) == 0 ||
+      GetTempFileNameA(temp_path, "comgen", 0, temp_file) == 0) {
+    fprintf(stderr, C_RED "Failed to create temp file" C_RESET "\n");
+    return;
+  }
+
+  FILE *fp = fopen(temp_file, "w");
+  if (fp) {
+    fputs(cmd_buf, fp);
+    fclose(fp);
+  }
+
+  /* Launch Editor */
+  /* Default to notepad on Windows if EDITOR not set */
+  char *env_editor = getenv("EDITOR");
+  char cmd[MAX_PATH * 2 + 32];
+  if (env_editor) {
+    snprintf(cmd, sizeof(cmd), "%s \"%s\"", env_editor, temp_file);
+  } else {
+    snprintf(cmd, sizeof(cmd), "notepad \"%s\"", temp_file);
+  }
+
+  if (system(cmd) == 0) {
+    /* Read back */
+    fp = fopen(temp_file, "r");
+    if (fp) {
+      size_t len = fread(cmd_buf, 1, buf_size - 1, fp);
+      cmd_buf[len] = '\0';
+      /* Trim trailing whitespace/newlines */
+      while (len > 0 && (cmd_buf[len - 1] == '\n' || cmd_buf[len - 1] == '\r' ||
+                         cmd_buf[len - 1] == ' ' || cmd_buf[len - 1] == '\t')) {
+        cmd_buf[--len] = '\0';
+      }
+      fclose(fp);
+    }
+  }
+
+  DeleteFileA(temp_file);
+
+#else
+  char temp_template[] = "/tmp/comgen_XXXXXX";
+  int fd = mkstemp(temp_template);
+  if (fd == -1) {
+    perror("mkstemp");
+    return;
+  }
+
+  if (write(fd, cmd_buf, strlen(cmd_buf)) == -1) {
+    perror("write");
+    close(fd);
+    unlink(temp_template);
+    return;
+  }
+  close(fd);
+
+  const char *editor = getenv("VISUAL");
+  if (!editor)
+    editor = getenv("EDITOR");
+  if (!editor)
+    editor = "vi";
+
+  char sys_cmd[2048];
+  snprintf(sys_cmd, sizeof(sys_cmd), "%s %s", editor, temp_template);
+
+  int ret = system(sys_cmd);
+  if (ret == 0) {
+    FILE *fp = fopen(temp_template, "r");
+    if (fp) {
+      size_t len = fread(cmd_buf, 1, buf_size - 1, fp);
+      cmd_buf[len] = '\0';
+      /* Trim trailing whitespace/newlines */
+      while (len > 0 && (cmd_buf[len - 1] == '\n' || cmd_buf[len - 1] == '\r' ||
+                         cmd_buf[len - 1] == ' ' || cmd_buf[len - 1] == '\t')) {
+        cmd_buf[--len] = '\0';
+      }
+      fclose(fp);
+    }
+  } else {
+    printf(C_RED "Editor exited with error" C_RESET "\n");
+  }
+  unlink(temp_template);
+#endif
+}
+
+/* Loads a file given to /attach; returns NULL (after reporting) on error */
+static Attachment *load_attachment(const char *path) {
+  char expanded[1024];
+  const char *home = getenv("HOME");
+  if (path[0] == '~' && path[1] == '/' && home)
+    snprintf(expanded, sizeof(expanded), "%s%s", home, path + 1);
+  else
+    snprintf(expanded, sizeof(expanded), "%s", path);
+
+  FILE *fp = fopen(expanded, "rb");
+  if (!fp) {
+    printf(C_RED "Cannot open %s: %s" C_RESET "\n", expanded, strerror(errno));
+    return NULL;
+  }
+  Attachment *att = malloc(sizeof(Attachment));
+  if (!att) {
+    fclose(fp);
+    return NULL;
+  }
+  attachment_init(att, path);
+  attachment_read(att, fp);
+  fclose(fp);
+  return att;
+}
+
+/* One-shot answer: the input itself when it is already a command ('?'
+ * forces the model), else generate_cached. hit->us < 0 unless a hit. */
+static char *oneshot_answer(ComgenSession *session, GenRequest *req,
+                            const char *prompt, const Attachment *att,
+                            CacheHit *hit) {
+  memset(hit, 0, sizeof(*hit));
+  hit->us = -1;
+  if (*prompt == '?')
+    prompt++;
+  else if (!att && is_shell_command(prompt))
+    return strdup(prompt);
+  return generate_cached(session, req, prompt, att, hit);
+}
+
+/* --stream: text deltas go to stdout as they arrive (for the widgets) */
+static int stream_out;
+
+static void stdout_chunk(const char *text, size_t len, void *arg) {
+  size_t *streamed = arg;
+  fwrite(text, 1, len, stdout);
+  fflush(stdout);
+  *streamed += len;
+}
+
+/* Prints a one-shot result and returns the exit code. streamed: bytes
+ * of it already written to stdout. */
+static int finish_oneshot(const char *prompt, const char *cmd,
+                          size_t streamed) {
+  if (!cmd) {
+    if (streamed) /* Ends the partial line; the exit code disowns it */
+      printf("\n");
+    fflush(stdout);
+    fprintf(stderr, C_RED "Error generating command" C_RESET "\n");
+    print_history_suggestions(stderr, prompt);
+    return 1;
+  }
+  int failed = strncmp(cmd, "ERROR:", 6) == 0;
+  if (streamed)
+    printf("\n");
+  else
+    fprintf(failed ? stderr : stdout, "%s\n", cmd);
+  return failed;
+}
+
+/* comgen "prompt": print the generated command and exit */
+static int run_oneshot(ComgenSession *session, const char *prompt,
+                       const Attachment *att) {
+  CacheHit hit;
+  size_t streamed = 0;
+  GenRequest req;
+  local_request(&req);
+  if (stream_out) {
+    req.stream_fn = stdout_chunk;
+    req.stream_arg = &streamed;
+  }
+  char *cmd = oneshot_answer(session, &req, prompt, att, &hit);
+  if (cmd && (hit.us >= 0 || hit.fallback))
+    print_cache_hit(stderr, &hit);
+  else if (!cmd && req.error[0])
+    fprintf(stderr, C_RED "%s" C_RESET "\n", req.error);
+  int rc = finish_oneshot(prompt, cmd, streamed);
+  free(cmd);
+  return rc;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--api] [--no-daemon] [--stream] [--startup-trace]\n"
+          "          [-] [--] [prompt...]\n"
+          "       %s --widget bash|zsh\n"
+          "       %s daemon [stop|status|metrics]\n"
+          "       %s serve [--listen [addr:]port] [--threads n]\n"
+          "       %s import-history [history-file...]\n"
+          "       %s cache export <file> | import <file>...\n"
+          "       %s cache-sim [--sizes n,n,...] [event-log...]\n"
+          "  --api  always ask the model; offline intents only answer\n"
+          "         when the API is unreachable\n"
+          "  With a prompt, prints one command and exits; with -, stdin is\n"
+          "  attached as context (cmd | %s - \"parse this\"). Otherwise\n"
+          "  it is answered by comgend, started on first use (--no-daemon\n"
+          "  or COMGEN_NO_DAEMON=1 to answer in-process).\n"
+          "  import-history ranks commands from shell history (bash, zsh,\n"
+          "  fish, comgen) to seed examples and offline suggestions.\n"
+          "  cache export/import share cached answers as a bundle file.\n"
+          "  cache-sim replays logged requests through cache policies.\n"
+          "  serve answers POST /v1/command {\"prompt\": ...} over HTTP\n"
+          "  (Linux; default 127.0.0.1:8765).\n"
+          "  --stream  write the command as it is generated\n"
+          "  --widget  print a key binding that turns the line being\n"
+          "            edited into a command: eval \"$(%s --widget zsh)\"\n",
+          argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0);
+}
+
+/* Line-editor widgets: the key (Alt-G unless COMGEN_WIDGET_KEY is set)
+ * sends the current line as the prompt and replaces it with the command,
+ * ready to edit or run. They call comgen with stdin closed so the
+ * daemon path is taken. ZLE can redraw mid-widget, so zsh reads the
+ * --stream output and shows tokens as they arrive; bash's bind -x only
+ * redraws when the function returns, so it replaces the line at the end.
+ * On failure the original line is left untouched. */
+static const char widget_bash[] =
+    "__comgen_widget() {\n"
+    "  [[ -n ${READLINE_LINE//[[:space:]]/} ]] || return\n"
+    "  local cmd\n"
+    "  cmd=$(command comgen -- \"$READLINE_LINE\" </dev/null 2>/dev/null)"
+    " || return\n"
+    "  [[ -n $cmd ]] || return\n"
+    "  READLINE_LINE=$cmd\n"
+    "  READLINE_POINT=${#cmd}\n"
+    "}\n"
+    "bind -x \"\\\"${COMGEN_WIDGET_KEY:-\\\\eg}\\\": __comgen_widget\"\n";
+
+static const char widget_zsh[] =
+    "zmodload zsh/system 2>/dev/null\n"
+    "__comgen_widget() {\n"
+    "  [[ -n ${BUFFER//[[:space:]]/} ]] || return\n"
+    "  local prompt=$BUFFER chunk out= fd\n"
+    "  zle -R \"comgen: generating...\"\n"
+    "  exec {fd}< <(command comgen --stream -- \"$prompt\" </dev/null"
+    " 2>/dev/null || print -rn -- $'\\0')\n"
+    "  while sysread -i $fd chunk 2>/dev/null; do\n"
+    "    out+=$chunk\n"
+    "    [[ $out == *$'\\0'* ]] && break\n"
+    "    BUFFER=${out%%$'\\n'}\n"
+    "    CURSOR=${#BUFFER}\n"
+    "    zle -R\n"
+    "  done\n"
+    "  exec {fd}<&-\n"
+    "  out=${out%%$'\\n'}\n"
+    "  if [[ -z $out || $out == *$'\\0'* || $out == ERROR:* ]]; then\n"
+    "    BUFFER=$prompt\n"
+    "  else\n"
+    "    BUFFER=$out\n"
+    "  fi\n"
+    "  CURSOR=${#BUFFER}\n"
+    "  zle -R\n"
+    "}\n"
+    "zle -N __comgen_widget\n"
+    "bindkey \"${COMGEN_WIDGET_KEY:-\\eg}\" __comgen_widget\n";
+
+/* comgen --widget bash|zsh: print the integration script to eval */
+static int print_widget(const char *shell, const char *argv0) {
+  if (strcmp(shell, "bash") == 0)
+    fputs(widget_bash, stdout);
+  else if (strcmp(shell, "zsh") == 0)
+    fputs(widget_zsh, stdout);
+  else {
+    usage(argv0);
+    return 1;
+  }
+  return 0;
+}
+
+#ifndef _WIN32
+/* comgend: a resident comgen that keeps the API connection, caches,
+ * history index and context probes warm. One-shot clients send the
+ * prompt, their directory and the environment the context comes from
+ * over a Unix socket in the config dir and print the reply, so a warm
+ * request costs one socket round trip. The first client spawns the
+ * daemon; it exits after DAEMON_IDLE_MS idle. Only the daemon's own uid
+ * may connect. A client whose model, key or endpoint differ from the
+ * daemon's, or whose directory the daemon cannot enter, is refused and
+ * answers in-process.
+ *
+ * Frames are a DaemonFrame followed by len payload bytes:
+ *   GENERATE  u16 cwd_len, cwd, u64 identity, u16 env_len, env, prompt
+ *             env: daemon_vars as "NAME=value" or "NAME", NUL ended;
+ *             flags: DAEMON_F_*
+ *   CHUNK     text delta, before the REPLY  (DAEMON_F_STREAM only)
+ *   REPLY     u8 has_cmd, u16 note_len, note, command
+ *   REFUSED   (empty; the client answers in-process)
+ *   STATUS    (request empty; reply is text)
+ *   STOP      (no reply)
+ *   METRICS   (request empty; reply is Prometheus text) */
+#define DAEMON_MAGIC 0x32444743u /* "CGD2" */
+#define DAEMON_IDLE_MS (30 * 60 * 1000)
+#define DAEMON_IO_MS 5000       /* Reading a request */
+#define DAEMON_SPAWN_MS 2000    /* Waiting for a new daemon's socket */
+#define DAEMON_MAX_FRAME (64 * 1024)
+#define DAEMON_F_API 1
+#define DAEMON_F_STREAM 2
+
+enum { D_GENERATE = 1, D_STATUS, D_STOP, D_METRICS, D_REPLY = 0x81,
+       D_CHUNK, D_REFUSED };
+
+/* Per request: what the shell, venv and container probes and PATH
+ * lookups read */
+static const char *daemon_vars[] = {"SHELL",        "PATH",
+                                    "VIRTUAL_ENV",  "CONDA_DEFAULT_ENV",
+                                    "CONDA_PREFIX", "IN_NIX_SHELL",
+                                    "container",    NULL};
+
+/* What session_init read: a client that differs needs another daemon */
+static uint64_t daemon_identity(void) {
+  static const char *vars[] = {"ANTHROPIC_API_KEY", "COMGEN_MODEL",
+                               "COMGEN_API_URL", "COMGEN_SHARED_CACHE",
+                               "HOME", NULL};
+  uint64_t h = HASH_SEED;
+  for (const char **v = vars; *v; v++) {
+    const char *val = getenv(*v);
+    h = hash_bytes(val ? "=" : "", 1, h); /* Unset != empty */
+    h = hash_bytes(val ? val : "", val ? strlen(val) + 1 : 1, h);
+  }
+  return h;
+}
+
+/* Takes on a client's daemon_vars once probes_settle succeeded; returns
+ * whether the shell or container changed, which are probed once per
+ * process otherwise */
+static int daemon_apply_env(const char *env, size_t len) {
+  int changed = 0;
+  for (const char *v = env; v < env + len && *v; v += strlen(v) + 1) {
+    const char *eq = strchr(v, '=');
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int)(eq ? eq - v : 63), v);
+    const char *old = getenv(name);
+    if (eq ? old && strcmp(old, eq + 1) == 0 : !old)
+      continue;
+    changed |= strcmp(name, "SHELL") == 0 || strcmp(name, "container") == 0;
+    if (eq)
+      setenv(name, eq + 1, 1);
+    else
+      unsetenv(name);
+  }
+  return changed;
+}
+
+static int daemon_peer_ok(int fd) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+typedef struct {
+  uint32_t magic;
+  uint16_t type;
+  uint16_t flags;
+  uint32_t len;
+} DaemonFrame;
+
+static int daemon_socket_path(struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  char path[1024];
+  get_config_file(path, sizeof(path), "comgend.sock");
+  if (strlen(path) >= sizeof(addr->sun_path)) /* Deep HOME */
+    snprintf(path, sizeof(path), "/tmp/comgend-%d.sock", (int)getuid());
+  snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+  return 1;
+}
+
+static int io_full(int fd, void *buf, size_t len, int writing) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = writing ? send(fd, p, len, MSG_NOSIGNAL) : read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 1;
+}
+
+static int daemon_send(int fd, int type, int flags, const void *a,
+                       size_t a_len, const void *b, size_t b_len) {
+  DaemonFrame f = {DAEMON_MAGIC, (uint16_t)type, (uint16_t)flags,
+                   (uint32_t)(a_len + b_len)};
+  return io_full(fd, &f, sizeof(f), 1) &&
+         (!a_len || io_full(fd, (void *)a, a_len, 1)) &&
+         (!b_len || io_full(fd, (void *)b, b_len, 1));
+}
+
+/* Reads one frame; *payload is malloc'd and NUL terminated */
+static int daemon_recv(int fd, DaemonFrame *f, char **payload) {
+  *payload = NULL;
+  if (!io_full(fd, f, sizeof(*f), 0) || f->magic != DAEMON_MAGIC ||
+      f->len > DAEMON_MAX_FRAME)
+    return 0;
+  if (!(*payload = malloc(f->len + 1u)))
+    return 0;
+  (*payload)[f->len] = '\0';
+  if (!io_full(fd, *payload, f->len, 0)) {
+    free(*payload);
+    *payload = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static int daemon_connect(void) {
+  struct sockaddr_un addr;
+  daemon_socket_path(&addr);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void daemon_chunk(const char *text, size_t len, void *arg) {
+  daemon_send(*(int *)arg, D_CHUNK, 0, text, len, NULL, 0);
+}
+
+static void daemon_handle(ComgenSession *session, int fd,
+                          unsigned long *served, double started,
+                          uint64_t identity) {
+  DaemonFrame f;
+  char *payload;
+  struct timeval tv = {DAEMON_IO_MS / 1000, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (!daemon_recv(fd, &f, &payload))
+    return;
+  if (f.type == D_STATUS) {
+    char text[256];
+    int n = snprintf(text, sizeof(text),
+                     "comgend pid %d, up %.0f s, %lu requests, %zu cached "
+                     "in memory, model %s",
+                     (int)getpid(), (now_ms() - started) / 1000, *served,
+                     cache.mem_count, session->model);
+    daemon_send(fd, D_REPLY, 0, text, (size_t)n, NULL, 0);
+  } else if (f.type == D_METRICS) {
+    StringBuffer text;
+    sb_init(&text);
+    metrics_text(&text);
+    daemon_send(fd, D_REPLY, 0, text.data, text.len, NULL, 0);
+    sb_free(&text);
+  } else if (f.type == D_GENERATE && f.len >= 2) {
+    uint16_t cwd_len, env_len = 0;
+    uint64_t id = 0;
+    memcpy(&cwd_len, payload, 2);
+    const char *p = payload + 2 + cwd_len;
+    size_t fixed = 2u + cwd_len + 8 + 2;
+    if (fixed <= f.len) {
+      memcpy(&id, p, 8);
+      memcpy(&env_len, p + 8, 2);
+    }
+    char cwd[1024];
+    snprintf(cwd, sizeof(cwd), "%.*s", (int)cwd_len, payload + 2);
+    /* Context is the client's: its directory and environment, freshly
+     * probed. Answering from anywhere else would be wrong, so a probe
+     * too hung to let us take them on refuses too. */
+    if (fixed + env_len > f.len || id != identity || !cwd_len ||
+        cwd_len >= sizeof(cwd) || !probes_settle() || chdir(cwd) != 0) {
+      daemon_send(fd, D_REFUSED, 0, NULL, 0, NULL, 0);
+    } else {
+      const char *prompt = p + 10 + env_len;
+      (*served)++;
+      if (daemon_apply_env(p + 10, env_len)) {
+        find_probe("shell")->force = 1;
+        find_probe("container")->force = 1;
+      }
+      probes_start();
+      probes_finish();
+      force_api = (f.flags & DAEMON_F_API) != 0;
+      GenRequest req;
+      local_request(&req);
+      if (f.flags & DAEMON_F_STREAM) {
+        req.stream_fn = daemon_chunk;
+        req.stream_arg = &fd;
+      }
+      CacheHit hit;
+      char *cmd = oneshot_answer(session, &req, prompt, NULL, &hit);
+      char *note = NULL;
+      size_t note_len = 0;
+      FILE *mem = open_memstream(&note, &note_len);
+      if (mem) {
+        if (cmd && (hit.us >= 0 || hit.fallback))
+          print_cache_hit(mem, &hit);
+        else if (!cmd && req.error[0])
+          fprintf(mem, C_RED "%s" C_RESET "\n", req.error);
+        fclose(mem);
+      }
+      char head[3] = {cmd != NULL, 0, 0};
+      uint16_t nl = (uint16_t)(note_len < 65535 ? note_len : 0);
+      memcpy(head + 1, &nl, 2);
+      StringBuffer body;
+      sb_init(&body);
+      sb_append_n(&body, head, 3);
+      sb_append_n(&body, note ? note : "", nl);
+      if (cmd)
+        sb_append(&body, cmd);
+      daemon_send(fd, D_REPLY, 0, body.data, body.len, NULL, 0);
+      sb_free(&body);
+      free(note);
+      free(cmd);
+    }
+  }
+  free(payload);
+}
+
+/* Runs the daemon in the foreground until idle, STOP or a signal */
+static int daemon_run(void) {
+  if (!ensure_config_dir())
+    return 1;
+  char lock_path[1024];
+  get_config_file(lock_path, sizeof(lock_path), "comgend.lock");
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "comgend is already running\n");
+    return 1;
+  }
+  struct sockaddr_un addr;
+  daemon_socket_path(&addr);
+  unlink(addr.sun_path); /* Stale: we hold the lock */
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t old_mask = umask(077);
+  int bound = lfd >= 0 &&
+              bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+              listen(lfd, 64) == 0;
+  umask(old_mask);
+  if (!bound) {
+    fprintf(stderr, "comgend: %s: %s\n", addr.sun_path, strerror(errno));
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  /* The socket is up before the slow part, so clients just queue */
+  double started = now_ms();
+  oneshot = 1;
+  curl_global_init(CURL_GLOBAL_DEFAULT); /* Not thread-safe: before probes */
+  probes_start();
+  ComgenSession session = {0};
+  int ok = session_init(&session);
+  probes_finish();
+
+  unsigned long served = 0;
+  uint64_t identity = daemon_identity();
+  int stop = !ok;
+  while (!stop) {
+    struct pollfd pfd = {lfd, POLLIN, 0};
+    int r = poll(&pfd, 1, DAEMON_IDLE_MS);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break; /* Idle */
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    if (!daemon_peer_ok(fd)) { /* The /tmp fallback is world-reachable */
+      close(fd);
+      continue;
+    }
+    DaemonFrame peek;
+    if (recv(fd, &peek, sizeof(peek), MSG_PEEK) == (ssize_t)sizeof(peek) &&
+        peek.magic == DAEMON_MAGIC && peek.type == D_STOP)
+      stop = 1;
+    else
+      daemon_handle(&session, fd, &served, started, identity);
+    close(fd);
+  }
+  unlink(addr.sun_path);
+  close(lfd);
+  cache_close();
+  session_cleanup(&session);
+  curl_global_cleanup();
+  close(lock_fd);
+  return ok ? 0 : 1;
+}
+
+/* Forks a detached daemon; before any threads exist, so fork is safe */
+static void daemon_spawn(void) {
+  pid_t pid = fork();
+  if (pid < 0)
+    return;
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+  setsid();
+  if (fork() != 0)
+    _exit(0);
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO)
+      close(null_fd);
+  }
+  for (int fd = STDERR_FILENO + 1; fd < 1024; fd++)
+    close(fd); /* Pipes held open would make the caller wait on us */
+  if (chdir("/") != 0)
+    _exit(1);
+  _exit(daemon_run());
+}
+
+/* Sends a one-shot prompt to the daemon, spawning it if needed. Returns
+ * the exit code, or -1 when no daemon could answer (run in-process). */
+static int daemon_oneshot(const char *prompt) {
+  int fd = daemon_connect();
+  if (fd < 0) {
+    daemon_spawn();
+    for (double t = now_ms(); fd < 0 && now_ms() - t < DAEMON_SPAWN_MS;) {
+      struct timespec ts = {0, 5 * 1000000};
+      nanosleep(&ts, NULL);
+      fd = daemon_connect();
+    }
+    if (fd < 0)
+      return -1;
+  }
+  char cwd[1024];
+  if (!getcwd(cwd, sizeof(cwd)))
+    cwd[0] = '\0';
+  uint16_t cwd_len = (uint16_t)strlen(cwd);
+  uint64_t id = daemon_identity();
+  StringBuffer head, env;
+  sb_init(&head);
+  sb_init(&env);
+  for (const char **v = daemon_vars; *v; v++) {
+    const char *val = getenv(*v);
+    sb_append(&env, *v);
+    if (val) {
+      sb_append(&env, "=");
+      sb_append(&env, val);
+    }
+    sb_append_n(&env, "", 1);
+  }
+  uint16_t env_len = (uint16_t)(env.len < 65535 ? env.len : 0);
+  sb_append_n(&head, (const char *)&cwd_len, 2);
+  sb_append_n(&head, cwd, cwd_len);
+  sb_append_n(&head, (const char *)&id, 8);
+  sb_append_n(&head, (const char *)&env_len, 2);
+  sb_append_n(&head, env.data ? env.data : "", env_len);
+  sb_free(&env);
+  signal(SIGPIPE, SIG_IGN);
+  int flags = (force_api ? DAEMON_F_API : 0) |
+              (stream_out ? DAEMON_F_STREAM : 0);
+  DaemonFrame f;
+  char *reply = NULL;
+  size_t streamed = 0;
+  int ok = daemon_send(fd, D_GENERATE, flags, head.data, head.len, prompt,
+                       strlen(prompt));
+  sb_free(&head);
+  while (ok && (ok = daemon_recv(fd, &f, &reply)) && f.type == D_CHUNK) {
+    stdout_chunk(reply, f.len, &streamed);
+    free(reply);
+    reply = NULL;
+  }
+  close(fd);
+  uint16_t note_len = 0;
+  if (ok && f.type == D_REPLY && f.len >= 3)
+    memcpy(&note_len, reply + 1, 2);
+  if (!ok || f.type != D_REPLY || f.len < 3 || 3u + note_len > f.len) {
+    free(reply);
+    if (streamed)
+      printf("\n");
+    return streamed ? 1 : -1; /* Half an answer cannot be retried */
+  }
+  fwrite(reply + 3, 1, note_len, stderr);
+  int rc = finish_oneshot(prompt, reply[0] ? reply + 3 + note_len : NULL,
+                          streamed);
+  free(reply);
+  return rc;
+}
+
+/* comgen daemon [stop|status|metrics]: no argument runs it in the
+ * foreground */
+static int daemon_command(int argc, char **argv, const char *argv0) {
+  if (argc == 0)
+    return daemon_run();
+  int type = strcmp(argv[0], "stop") == 0      ? D_STOP
+             : strcmp(argv[0], "status") == 0  ? D_STATUS
+             : strcmp(argv[0], "metrics") == 0 ? D_METRICS
+                                               : 0;
+  if (argc != 1 || !type) {
+    usage(argv0);
+    return 1;
+  }
+  int fd = daemon_connect();
+  if (fd < 0) {
+    printf("comgend is not running\n");
+    return type == D_STOP ? 0 : 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  DaemonFrame f;
+  char *reply = NULL;
+  int ok = daemon_send(fd, type, 0, NULL, 0, NULL, 0);
+  if (ok && type == D_STATUS && daemon_recv(fd, &f, &reply))
+    printf("%s\n", reply);
+  else if (ok && type == D_METRICS && daemon_recv(fd, &f, &reply))
+    fputs(reply, stdout);
+  else if (ok && type == D_STOP)
+    printf("comgend stopped\n");
+  free(reply);
+  close(fd);
+  return ok ? 0 : 1;
+}
+
+#endif
+
+/* comgen cache export <file> | import <file>... */
+static int cache_command(int argc, char **argv, const char *argv0) {
+  if (argc >= 2 && strcmp(argv[0], "import") == 0)
+    return bundle_import(argv + 1, argc - 1);
+  if (argc != 2 || strcmp(argv[0], "export") != 0) {
+    usage(argv0);
+    return 1;
+  }
+  /* Export picks this model, OS, shell and user's answers */
+#ifndef _WIN32
+  curl_global_init(CURL_GLOBAL_DEFAULT); /* Else curl_easy_init does it */
+#endif
+  probes_start();
+  ComgenSession session = {0};
+  session_init(&session);
+  probes_finish();
+  int rc = bundle_export(&session, argv[1]);
+  cache_close();
+  session_cleanup(&session);
+  return rc;
+}
 
-  struct curl_slist *headers = NULL;
-  char auth_header[256];
-  snprintf(auth_header, sizeof(auth_header), "x-api-key: %s", s->api_key);
+#ifdef __linux__
+/* comgen serve: the response cache and API behind a local HTTP/JSON
+ * endpoint for a team's tools. An epoll thread accepts connections and
+ * reads requests; complete ones are queued to a pool of workers, each
+ * with its own curl handle. The handles share DNS, TLS sessions and
+ * connections through a curl_share, and identical prompts in flight at
+ * the same time go upstream once (see flight_begin). Requests carry
+ * their own environment; nothing of this host's is added but defaults.
+ *
+ *   POST /v1/command  {"prompt":"...", "os":"...", "shell":"...",
+ *                      "user":"...", "cwd":"..."}
+ *     200 {"command":"...","source":"api|cache|template|similar|bundle|
+ *                                    shared|offline"}
+ *     422 {"error":"ERROR:..."}  (the model declined)
+ *     502 {"error":"..."}        (upstream failed)
+ *   GET /health
+ *   GET /metrics  (Prometheus text, see metrics_text) */
+#define SERVE_ADDR "127.0.0.1"
+#define SERVE_PORT 8765
+#define SERVE_MAX_REQUEST (64 * 1024)
+#define SERVE_MAX_EVENTS 64
+#define SERVE_SEND_TIMEOUT_S 10
 
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-  headers = curl_slist_append(headers, auth_header);
-  headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
+typedef struct ServeConn {
+  int fd;
+  StringBuffer in;
+  struct ServeConn *next; /* Work queue */
+} ServeConn;
 
-  curl_easy_setopt(s->curl, CURLOPT_URL,
-                   "https://api.anthropic.com/v1/messages");
-  curl_easy_setopt(
-      s->curl, CURLOPT_HTTPHEADER,
-      headers); /* Headers stored in handle? No, must keep list alive? */
-  /* Actually CURLOPT_HTTPHEADER pointer must be valid during perform.
-     Optimisation: We can create headers once and store in session, or
-     re-create. Let's store them in session to be perfectly safe and efficient.
-   */
-  /* Simplified: Set them here, but we need to keep headers valid. */
-  /* Fix: Add headers to struct or make static logic. For now, we will NOT free
-     headers until exit if we set them here? CURL documentation says: "The
-     linked list must be kept available until the transfer is done" So we can
-     attach them to the handle permanently? No, easy_perform uses them.
-     Optimization solution: Attached headers once in init. */
+static struct {
+  int epfd;
+  ComgenSession *session;
+  CURLSH *share;
+  pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+  pthread_mutex_t lock; /* Guards the queue and counters below */
+  pthread_cond_t ready;
+  ServeConn *head, *tail;
+  size_t queued;
+  unsigned long served, failed;
+} serve = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .ready = PTHREAD_COND_INITIALIZER};
 
-  /* Hack: We need to store persistent headers pointer in session to free it
-     later, but ComgenSession definition is minimal. Let's just set it and
-     forget strict purity or add `struct curl_slist *headers` to ComgenSession.
-   */
-  /* For this generated code, I'll attach it and let OS cleanup at exit,
-     or ideally add void* internal_data to session. */
+static volatile sig_atomic_t serve_stop;
 
-  /* Let's modify the struct locally if needed, or re-alloc headers per request
-     (small overhead). Actually, re-alloc headers per request is safer if we
-     don't change struct definition too much. BUT we want optimizations! Let's
-     rely on the fact we only start curl once. */
+static void serve_on_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
 
-  /* Wait, I can't modify the struct definition inside this function easily
-     without forward declaration. Let's just attach headers once and keep them.
-     Mem leak on exit is acceptable for CLI tool OS reclamation. */
-  curl_easy_setopt(s->curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(s->curl, CURLOPT_WRITEFUNCTION, write_cb);
-#endif
-  return 1;
+static void share_lock(CURL *h, curl_lock_data data, curl_lock_access a,
+                       void *arg) {
+  (void)h;
+  (void)a;
+  (void)arg;
+  pthread_mutex_lock(&serve.share_locks[data]);
 }
 
-static void session_cleanup(ComgenSession *s) {
-  if (s->api_key)
-    free(s->api_key);
-  if (s->model)
-    free(s->model);
-#ifdef _WIN32
-  if (s->hConnect)
-    WinHttpCloseHandle(s->hConnect);
-  if (s->hSession)
-    WinHttpCloseHandle(s->hSession);
-#else
-  if (s->curl)
-    curl_easy_cleanup(s->curl);
-#endif
+static void share_unlock(CURL *h, curl_lock_data data, void *arg) {
+  (void)h;
+  (void)arg;
+  pthread_mutex_unlock(&serve.share_locks[data]);
 }
 
-static void execute_command(const char *cmd) {
-  printf("\n" C_DIM "Executing..." C_RESET "\n");
-  int ret = system(cmd);
-#ifdef _WIN32
-  if (ret == 0)
-    printf(C_GREEN "Success" C_RESET "\n");
-  else
-    printf(C_RED "Exit: %d" C_RESET "\n", ret);
-#else
-  if (WIFEXITED(ret) && WEXITSTATUS(ret) == 0)
-    printf(C_GREEN "Success" C_RESET "\n");
-  else
-    printf(C_RED "Exit: %d" C_RESET "\n", WEXITSTATUS(ret));
-#endif
-  printf("\n");
+static void serve_close(ServeConn *c) {
+  close(c->fd); /* Also leaves the epoll set */
+  sb_free(&c->in);
+  free(c);
 }
 
-/* Prompt Action */
-static char prompt_action(void) {
-  printf(C_BOLD "Execute? " C_RESET "[" C_GREEN "y" C_RESET "/" C_RED
-                "n" C_RESET "/" C_YELLOW "e" C_RESET "dit]: ");
-  fflush(stdout);
+/* Length of the first complete request in c->in, 0 if it needs more
+ * bytes, -1 if it is malformed or too large, -2 if its body is sent with
+ * a Transfer-Encoding (chunked) rather than a Content-Length. *body gets
+ * its offset and *keep whether the connection stays open after it. */
+static long serve_request_len(const ServeConn *c, size_t *body, int *keep) {
+  const char *end = strstr(c->in.data, "\r\n\r\n");
+  if (!end)
+    return c->in.len > SERVE_MAX_REQUEST ? -1 : 0;
+  *body = (size_t)(end - c->in.data) + 4;
+  const char *line_end = strstr(c->in.data, "\r\n");
+  long content = 0;
+  *keep = line_end - c->in.data > 8 &&
+          strncmp(line_end - 8, "HTTP/1.1", 8) == 0;
+  for (const char *h = line_end; h && h < end; h = strstr(h + 2, "\r\n")) {
+    if (strncasecmp(h + 2, "Content-Length:", 15) == 0)
+      content = strtol(h + 17, NULL, 10);
+    else if (strncasecmp(h + 2, "Transfer-Encoding:", 18) == 0)
+      return -2;
+    else if (strncasecmp(h + 2, "Connection:", 11) == 0)
+      *keep = strncasecmp(h + 13 + strspn(h + 13, " "), "close", 5) != 0;
+  }
+  if (content < 0 || *body + (size_t)content > SERVE_MAX_REQUEST)
+    return -1;
+  return *body + (size_t)content <= c->in.len ? (long)*body + content : 0;
+}
 
-  char buf[64];
-  if (!fgets(buf, sizeof(buf), stdin))
-    return 'n';
-  if (buf[0] == 'y' || buf[0] == 'Y' || buf[0] == '\n')
-    return 'y';
-  if (buf[0] == 'e' || buf[0] == 'E')
-    return 'e';
-  return 'n';
+static int serve_reply_as(int fd, int status, const char *type,
+                          const char *body, int keep) {
+  const char *reason = status == 200   ? "OK"
+                       : status == 400 ? "Bad Request"
+                       : status == 404 ? "Not Found"
+                       : status == 411 ? "Length Required"
+                       : status == 413 ? "Payload Too Large"
+                       : status == 422 ? "Unprocessable Entity"
+                       : status == 503 ? "Service Unavailable"
+                                       : "Bad Gateway";
+  char head[256];
+  int n = snprintf(head, sizeof(head),
+                   "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+                   "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+                   status, reason, type, strlen(body),
+                   keep ? "keep-alive" : "close");
+  return io_full(fd, head, (size_t)n, 1) &&
+         io_full(fd, (void *)body, strlen(body), 1);
 }
 
-/* Editor Logic */
-static void edit_command_in_editor(char *cmd_buf, size_t buf_size) {
-#ifdef _WIN32
-  char temp_path[MAX_PATH];
-  char temp_file[MAX_PATH];
+static int serve_reply(int fd, int status, const char *json, int keep) {
+  return serve_reply_as(fd, status, "application/json", json, keep);
+}
 
-  if (GetTempPathA(MAX_PATH, temp_path) == 0 ||
-      GetTempFileNameA(temp_path, "comgen", 0, temp_file) == 0) {
-    fprintf(stderr, C_RED "Failed to create temp file" C_RESET "\n");
-    return;
-  }
+/* Request fields override this host's identity; the rest stays empty */
+static void serve_env_field(const char *body, const char *key, char *dst,
+                            size_t size, const char *fallback) {
+  char *v = json_string_field(body, key, 1);
+  snprintf(dst, size, "%s", v ? v : fallback);
+  free(v);
+}
 
-  FILE *fp = fopen(temp_file, "w");
-  if (fp) {
-    fputs(cmd_buf, fp);
-    fclose(fp);
+static int serve_command(ComgenSession *session, const char *body,
+                         StringBuffer *out) {
+  char *prompt = json_string_field(body, "prompt", 1);
+  if (!prompt || !*prompt) {
+    free(prompt);
+    sb_append(out, "{\"error\":\"missing prompt\"}");
+    return 400;
   }
-
-  /* Launch Editor */
-  /* Default to notepad on Windows if EDITOR not set */
-  char *env_editor = getenv("EDITOR");
-  char cmd[MAX_PATH * 2 + 32];
-  if (env_editor) {
-    snprintf(cmd, sizeof(cmd), "%s \"%s\"", env_editor, temp_file);
+  EnvContext env;
+  memset(&env, 0, sizeof(env));
+  serve_env_field(body, "os", env.os, sizeof(env.os), env_ctx.os);
+  serve_env_field(body, "shell", env.shell, sizeof(env.shell), env_ctx.shell);
+  serve_env_field(body, "user", env.user, sizeof(env.user), env_ctx.user);
+  serve_env_field(body, "cwd", env.cwd, sizeof(env.cwd), "~");
+  GenRequest req;
+  memset(&req, 0, sizeof(req));
+  req.env = &env;
+  req.quiet = 1;
+  req.ephemeral = 1; /* Unauthenticated: kept out of the user's cache */
+  char *prio = json_string_field(body, "priority", 1);
+  req.prio = prio ? prio_from_name(prio) : PRIO_INTERACTIVE;
+  free(prio);
+  if (req.prio < 0) {
+    free(prompt);
+    sb_append(out, "{\"error\":\"priority: interactive, batch or "
+                   "speculative\"}");
+    return 400;
+  }
+  /* Users named in requests queue fairly against each other */
+  char *user = json_string_field(body, "user", 1);
+  req.user = user ? hash_bytes(user, strlen(user), HASH_SEED) : 0;
+  free(user);
+  CacheHit hit;
+  char *cmd = generate_cached(session, &req, prompt, NULL, &hit);
+  free(prompt);
+  int status = cmd && strncmp(cmd, "ERROR:", 6) == 0 ? 422
+               : cmd                                 ? 200
+               : req.error[0]                        ? 503
+                                                     : 502;
+  if (status == 200) {
+    sb_append(out, "{\"command\":\"");
+    sb_append_json(out, cmd, strlen(cmd));
+    sb_append(out, "\",\"source\":\"");
+    sb_append(out, hit_source(&hit));
+    sb_append(out, "\"}");
   } else {
-    snprintf(cmd, sizeof(cmd), "notepad \"%s\"", temp_file);
+    sb_append(out, "{\"error\":\"");
+    if (cmd)
+      sb_append_json(out, cmd, strlen(cmd));
+    else if (req.error[0])
+      sb_append_json(out, req.error, strlen(req.error));
+    else
+      sb_append(out, "upstream request failed");
+    sb_append(out, "\"}");
   }
+  free(cmd);
+  return status;
+}
 
-  if (system(cmd) == 0) {
-    /* Read back */
-    fp = fopen(temp_file, "r");
-    if (fp) {
-      size_t len = fread(cmd_buf, 1, buf_size - 1, fp);
-      cmd_buf[len] = '\0';
-      /* Trim trailing whitespace/newlines */
-      while (len > 0 && (cmd_buf[len - 1] == '\n' || cmd_buf[len - 1] == '\r' ||
-                         cmd_buf[len - 1] == ' ' || cmd_buf[len - 1] == '\t')) {
-        cmd_buf[--len] = '\0';
-      }
-      fclose(fp);
+/* Answers every complete request buffered on c; returns 0 once c should
+ * be closed */
+static int serve_connection(ComgenSession *session, ServeConn *c) {
+  size_t body;
+  long len;
+  int keep;
+  while ((len = serve_request_len(c, &body, &keep)) != 0) {
+    if (len == -2) {
+      serve_reply(c->fd, 411,
+                  "{\"error\":\"chunked bodies are not supported, send "
+                  "Content-Length\"}", 0);
+      return 0;
+    }
+    if (len < 0) {
+      serve_reply(c->fd, 413, "{\"error\":\"request too large\"}", 0);
+      return 0;
+    }
+    char *req = c->in.data;
+    StringBuffer out;
+    sb_init(&out);
+    const char *type = "application/json";
+    int status;
+    if (strncmp(req, "POST /v1/command ", 17) == 0) {
+      char saved = req[len];
+      req[len] = '\0';
+      status = serve_command(session, req + body, &out);
+      req[len] = saved;
+    } else if (strncmp(req, "GET /health ", 12) == 0) {
+      pthread_mutex_lock(&serve.lock);
+      char buf[160];
+      snprintf(buf, sizeof(buf),
+               "{\"status\":\"ok\",\"served\":%lu,\"failed\":%lu,"
+               "\"shared\":%lu,\"keys\":",
+               serve.served, serve.failed, flights.shared);
+      pthread_mutex_unlock(&serve.lock);
+      sb_append(&out, buf);
+      key_pool_json(&out);
+      sb_append(&out, ",\"scheduler\":");
+      sched_json(&out);
+      sb_append(&out, "}");
+      status = 200;
+    } else if (strncmp(req, "GET /metrics ", 13) == 0) {
+      metrics_text(&out);
+      pthread_mutex_lock(&serve.lock);
+      char buf[160];
+      snprintf(buf, sizeof(buf),
+               "# HELP comgen_serve_queued Requests read and waiting for a "
+               "worker.\n# TYPE comgen_serve_queued gauge\n"
+               "comgen_serve_queued %zu\n",
+               serve.queued);
+      pthread_mutex_unlock(&serve.lock);
+      sb_append(&out, buf);
+      type = "text/plain; version=0.0.4";
+      status = 200;
+    } else {
+      sb_append(&out, "{\"error\":\"not found\"}");
+      status = 404;
     }
+    pthread_mutex_lock(&serve.lock);
+    serve.served += status == 200;
+    serve.failed += status != 200;
+    pthread_mutex_unlock(&serve.lock);
+    int sent = serve_reply_as(c->fd, status, type, out.data, keep);
+    sb_free(&out);
+    if (!sent || !keep)
+      return 0;
+    memmove(c->in.data, c->in.data + len, c->in.len - (size_t)len + 1);
+    c->in.len -= (size_t)len;
   }
+  return 1;
+}
 
-  DeleteFileA(temp_file);
+static void *serve_worker(void *arg) {
+  (void)arg;
+  ComgenSession session = *serve.session;
+  session.curl = curl_easy_duphandle(serve.session->curl);
+  if (!session.curl)
+    return NULL;
+  curl_easy_setopt(session.curl, CURLOPT_SHARE, serve.share);
+  for (;;) {
+    pthread_mutex_lock(&serve.lock);
+    while (!serve.head)
+      pthread_cond_wait(&serve.ready, &serve.lock);
+    ServeConn *c = serve.head;
+    if (!(serve.head = c->next))
+      serve.tail = NULL;
+    serve.queued--;
+    pthread_mutex_unlock(&serve.lock);
 
-#else
-  char temp_template[] = "/tmp/comgen_XXXXXX";
-  int fd = mkstemp(temp_template);
-  if (fd == -1) {
-    perror("mkstemp");
-    return;
+    if (!serve_connection(&session, c)) {
+      serve_close(c);
+      continue;
+    }
+    struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = c}};
+    if (epoll_ctl(serve.epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+      serve_close(c);
   }
+  return NULL;
+}
 
-  if (write(fd, cmd_buf, strlen(cmd_buf)) == -1) {
-    perror("write");
-    close(fd);
-    unlink(temp_template);
+static void serve_enqueue(ServeConn *c) {
+  pthread_mutex_lock(&serve.lock);
+  c->next = NULL;
+  if (serve.tail)
+    serve.tail->next = c;
+  else
+    serve.head = c;
+  serve.tail = c;
+  serve.queued++;
+  pthread_cond_signal(&serve.ready);
+  pthread_mutex_unlock(&serve.lock);
+}
+
+/* Readable connection (it is out of the epoll set until re-armed): read
+ * what has arrived and queue it once a request is complete */
+static void serve_read(ServeConn *c) {
+  char buf[16384];
+  ssize_t n;
+  while ((n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    sb_append_n(&c->in, buf, (size_t)n);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    serve_close(c);
     return;
   }
-  close(fd);
+  size_t body;
+  int keep;
+  if (serve_request_len(c, &body, &keep) != 0) {
+    serve_enqueue(c);
+    return;
+  }
+  struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = c}};
+  if (epoll_ctl(serve.epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+    serve_close(c);
+}
 
-  const char *editor = getenv("VISUAL");
-  if (!editor)
-    editor = getenv("EDITOR");
-  if (!editor)
-    editor = "vi";
+/* comgen serve [--listen [addr:]port] [--threads n] */
+static int serve_main(int argc, char **argv, const char *argv0) {
+  char addr_s[64] = SERVE_ADDR;
+  int port = SERVE_PORT;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores > 2 ? (int)cores * 4 : 8; /* Workers mostly wait */
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      const char *v = argv[++i], *colon = strrchr(v, ':');
+      if (colon)
+        snprintf(addr_s, sizeof(addr_s), "%.*s", (int)(colon - v), v);
+      port = atoi(colon ? colon + 1 : v);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else {
+      usage(argv0);
+      return 1;
+    }
+  }
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons((uint16_t)port);
+  if (port <= 0 || port > 65535 || threads <= 0 ||
+      inet_pton(AF_INET, addr_s, &sin.sin_addr) != 1) {
+    usage(argv0);
+    return 1;
+  }
 
-  char sys_cmd[2048];
-  snprintf(sys_cmd, sizeof(sys_cmd), "%s %s", editor, temp_template);
+  oneshot = 1; /* Diagnostics go to stderr */
+  curl_global_init(CURL_GLOBAL_DEFAULT); /* Not thread-safe: before probes */
+  probes_start();
+  ComgenSession session = {0};
+  int ok = session_init(&session);
+  probes_finish();
+  if (!ok) {
+    fprintf(stderr, C_RED "No API key. Run comgen once interactively or set "
+                          "ANTHROPIC_API_KEY." C_RESET "\n");
+    return 1;
+  }
 
-  int ret = system(sys_cmd);
-  if (ret == 0) {
-    FILE *fp = fopen(temp_template, "r");
-    if (fp) {
-      size_t len = fread(cmd_buf, 1, buf_size - 1, fp);
-      cmd_buf[len] = '\0';
-      /* Trim trailing whitespace/newlines */
-      while (len > 0 && (cmd_buf[len - 1] == '\n' || cmd_buf[len - 1] == '\r' ||
-                         cmd_buf[len - 1] == ' ' || cmd_buf[len - 1] == '\t')) {
-        cmd_buf[--len] = '\0';
+  int one = 1;
+  int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (lfd < 0 ||
+      setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+      listen(lfd, 1024) != 0 ||
+      (serve.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    fprintf(stderr, "comgen serve: %s:%d: %s\n", addr_s, port,
+            strerror(errno));
+    return 1;
+  }
+  struct epoll_event lev = {EPOLLIN, {.ptr = NULL}};
+  epoll_ctl(serve.epfd, EPOLL_CTL_ADD, lfd, &lev);
+
+  serve.session = &session;
+  serve.share = curl_share_init();
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&serve.share_locks[i], NULL);
+  curl_share_setopt(serve.share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(serve.share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(serve.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(serve.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(serve.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+  /* Workers inherit a blocked mask; signals land on the epoll thread */
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int started = 0;
+  for (; started < threads; started++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve_worker, NULL) != 0)
+      break;
+    pthread_detach(tid);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_on_signal; /* No SA_RESTART: epoll_wait returns */
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  fprintf(stderr, "comgen serve: http://%s:%d/v1/command (%d workers)\n",
+          addr_s, port, started);
+
+  struct epoll_event events[SERVE_MAX_EVENTS];
+  while (!serve_stop) {
+    int n = epoll_wait(serve.epfd, events, SERVE_MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+      ServeConn *c = events[i].data.ptr;
+      if (c) {
+        serve_read(c);
+        continue;
+      }
+      int fd;
+      while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        /* Blocking for the workers' writes, bounded for slow readers */
+        struct timeval tv = {SERVE_SEND_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = NULL}};
+        if (!(ev.data.ptr = c = calloc(1, sizeof(*c)))) {
+          close(fd);
+          continue;
+        }
+        c->fd = fd;
+        sb_init(&c->in);
+        if (epoll_ctl(serve.epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+          serve_close(c);
       }
-      fclose(fp);
     }
-  } else {
-    printf(C_RED "Editor exited with error" C_RESET "\n");
   }
-  unlink(temp_template);
+  /* Workers may be mid-request; the cache is an append-only log, so
+   * exiting without joining them loses at most their answers */
+  fprintf(stderr, "comgen serve: %lu served, %lu failed, %lu shared\n",
+          serve.served, serve.failed, flights.shared);
+  cache_lock();
+  cache_close();
+  return 0;
+}
 #endif
+
+#ifndef _WIN32
+#define HISTORY_MAX_LINES 5000
+
+/* REPL history persists in the config dir, one entry per line, so it can
+ * be recalled next session and fed to `comgen import-history`. Lines that
+ * look like they carry credentials stay in this session's memory only. */
+static void remember_history(const char *line) {
+  char path[1024];
+  add_history(line);
+  if (looks_secret(line))
+    return;
+  get_config_file(path, sizeof(path), "history");
+  append_history(1, path);
 }
+#endif
+
+int main(int argc, char **argv) {
+  double t_start = now_ms();
+  if (argc > 1 && strcmp(argv[1], "import-history") == 0)
+    return import_history(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "cache-sim") == 0)
+    return cache_sim(argc - 2, argv + 2);
+  if (argc > 1 && strcmp(argv[1], "cache") == 0)
+    return cache_command(argc - 2, argv + 2, argv[0]);
+#ifndef _WIN32
+  const char *base = strrchr(argv[0], '/');
+  if (strcmp(base ? base + 1 : argv[0], "comgend") == 0)
+    return daemon_run();
+  if (argc > 1 && strcmp(argv[1], "daemon") == 0)
+    return daemon_command(argc - 2, argv + 2, argv[0]);
+#endif
+#ifdef __linux__
+  if (argc > 1 && strcmp(argv[1], "serve") == 0)
+    return serve_main(argc - 2, argv + 2, argv[0]);
+#endif
+  int startup_trace = 0, use_daemon = !getenv("COMGEN_NO_DAEMON");
+  int read_stdin = 0; /* "-": never implied, stdin may be cron's or ssh's */
+  StringBuffer prompt_arg;
+  sb_init(&prompt_arg);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--startup-trace") == 0) {
+      startup_trace = 1;
+    } else if (strcmp(argv[i], "--api") == 0) {
+      force_api = 1;
+    } else if (strcmp(argv[i], "--no-daemon") == 0) {
+      use_daemon = 0;
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream_out = 1;
+    } else if (strcmp(argv[i], "-") == 0) {
+      read_stdin = 1;
+    } else if (strcmp(argv[i], "--widget") == 0 && i + 1 < argc) {
+      sb_free(&prompt_arg);
+      return print_widget(argv[i + 1], argv[0]);
+    } else if (strcmp(argv[i], "--") == 0) {
+      for (i++; i < argc; i++) {
+        if (prompt_arg.len > 0)
+          sb_append(&prompt_arg, " ");
+        sb_append(&prompt_arg, argv[i]);
+      }
+    } else if (strncmp(argv[i], "--", 2) == 0 || strcmp(argv[i], "-h") == 0) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      if (prompt_arg.len > 0)
+        sb_append(&prompt_arg, " ");
+      sb_append(&prompt_arg, argv[i]);
+    }
+  }
+  oneshot = prompt_arg.len > 0;
+
+#ifndef _WIN32
+  /* Warm path: the resident daemon answers; nothing is initialised here.
+   * It takes no attachment, so "-" is answered in-process. */
+  if (oneshot && use_daemon && !read_stdin) {
+    int rc = daemon_oneshot(prompt_arg.data);
+    if (rc >= 0) {
+      if (startup_trace)
+        fprintf(stderr, C_DIM "startup: %.2f ms round trip via comgend"
+                              C_RESET "\n", now_ms() - t_start);
+      sb_free(&prompt_arg);
+      return rc;
+    }
+  }
+#else
+  (void)use_daemon;
+#endif
 
-int main(void) {
+  /* Context probes run on the worker pool, overlapping with the TLS
+   * handshake and config loading. curl_global_init is not thread-safe,
+   * so it runs before the pool starts. */
 #ifdef _WIN32
   SetConsoleOutputCP(CP_UTF8);
 #else
   curl_global_init(CURL_GLOBAL_DEFAULT);
 #endif
+  probes_start();
+  double t_net = now_ms();
+
+  /* Input piped to "-" becomes bounded context for the one-shot prompt */
+  Attachment *attachment = NULL;
+  if (oneshot && read_stdin && (attachment = malloc(sizeof(Attachment)))) {
+    attachment_init(attachment, "stdin");
+    attachment_read(attachment, stdin);
+    if (attachment->bytes == 0) {
+      attachment_free(attachment);
+      free(attachment);
+      attachment = NULL;
+    }
+  }
 
   ComgenSession session = {0};
   if (!session_init(&session)) {
-    if (!session.api_key) {
+    if (!session.api_key && oneshot) {
+      fprintf(stderr, C_RED "No API key. Run comgen once interactively or set "
+                            "ANTHROPIC_API_KEY." C_RESET "\n");
+      return 1;
+    } else if (!session.api_key) {
       printf(C_MAGENTA "Welcome to comgen!" C_RESET "\n");
       printf("No API key found. Please enter your Anthropic API Key.\n");
       printf("Key: ");
@@ -836,14 +9602,52 @@ int main(void) {
     }
   }
 
-  gather_context();
+  double t_session = now_ms();
+  probes_finish();
+
+  if (oneshot) {
+    if (startup_trace)
+      fprintf(stderr,
+              C_DIM "startup: %.2f ms to request (net init %.2f, session "
+                    "%.2f, context wait %.2f, snapshot %s)" C_RESET "\n",
+              now_ms() - t_start, t_net - t_start, t_session - t_net,
+              now_ms() - t_session, snapshot_hit ? "hit" : "miss");
+    int rc = run_oneshot(&session, prompt_arg.data, attachment);
+    if (attachment) {
+      attachment_free(attachment);
+      free(attachment);
+    }
+    cache_close();
+    sb_free(&prompt_arg);
+    session_cleanup(&session);
+#ifndef _WIN32
+    curl_global_cleanup();
+#endif
+    return rc;
+  }
+  sb_free(&prompt_arg);
 
   printf(C_MAGENTA C_BOLD "comgen 2.0" C_RESET " (%s)\n", session.model);
-  printf(C_DIM "Ready. /q:quit /ls:scan files" C_RESET "\n\n");
+  printf(C_DIM "Ready. /q:quit /ls:scan files /attach <file> /probes:context "
+               "timings /cache [stats|clear]" C_RESET "\n\n");
+
+  if (startup_trace) {
+    double t_ready = now_ms();
+    fprintf(stderr,
+            C_DIM "startup: %.2f ms to prompt (net init %.2f, session %.2f, "
+                  "context wait %.2f, snapshot %s)" C_RESET "\n",
+            t_ready - t_start, t_net - t_start, t_session - t_net,
+            t_ready - t_session, snapshot_hit ? "hit" : "miss");
+  }
 
   char *line_buf;
 #ifdef _WIN32
   char win_buf[4096];
+#else
+  char history_path[1024];
+  get_config_file(history_path, sizeof(history_path), "history");
+  if (read_history(history_path) != 0 && ensure_config_dir())
+    write_history(history_path); /* append_history needs the file */
 #endif
 
   while (1) {
@@ -858,7 +9662,7 @@ int main(void) {
     if (!line_buf)
       break;
     if (*line_buf)
-      add_history(line_buf);
+      remember_history(line_buf);
 #endif
 
     if (strcmp(line_buf, "/q") == 0) {
@@ -870,31 +9674,107 @@ int main(void) {
       free(line_buf);
       continue;
     }
-
-    if (strlen(line_buf) > 0) {
-      /* Refresh CWD context cheaply */
-#ifdef _WIN32
-      GetCurrentDirectory(sizeof(env_ctx.cwd), env_ctx.cwd);
+    if (strcmp(line_buf, "/probes") == 0) {
+      print_probes();
+      free(line_buf);
+      continue;
+    }
+    if (strcmp(line_buf, "/output") == 0) {
+#ifndef _WIN32
+      print_last_run();
 #else
-      if (!getcwd(env_ctx.cwd, sizeof(env_ctx.cwd)))
-        strcpy(env_ctx.cwd, ".");
+      printf(C_DIM "/output is not supported on Windows (capture_output "
+                   "is ignored)" C_RESET "\n");
 #endif
+      free(line_buf);
+      continue;
+    }
+    if (strcmp(line_buf, "/cache") == 0 ||
+        strcmp(line_buf, "/cache stats") == 0) {
+      print_cache_stats();
+      free(line_buf);
+      continue;
+    }
+    if (strcmp(line_buf, "/cache clear") == 0) {
+      cache_clear();
+      printf(C_DIM "Response cache cleared" C_RESET "\n");
+      free(line_buf);
+      continue;
+    }
+    if (strncmp(line_buf, "/attach", 7) == 0 &&
+        (line_buf[7] == '\0' || line_buf[7] == ' ')) {
+      const char *file = line_buf + 7;
+      while (*file == ' ')
+        file++;
+      if (attachment) {
+        attachment_free(attachment);
+        free(attachment);
+        attachment = NULL;
+      }
+      if (!*file) {
+        printf(C_DIM "Attachment cleared" C_RESET "\n");
+      } else if ((attachment = load_attachment(file))) {
+        char size_s[24];
+        format_size(attachment->bytes, size_s, sizeof(size_s));
+        printf(C_DIM "Attached %s (%llu lines, %s); sent with each request "
+                     "until /attach" C_RESET "\n",
+               attachment->name, attachment->lines, size_s);
+      }
+      free(line_buf);
+      continue;
+    }
+
+    /* '?' always asks the model, '!' always runs the line as typed */
+    const char *input = line_buf;
+    int ask = *input == '?', run = *input == '!';
+    if (ask || run) {
+      input++;
+      while (*input == ' ')
+        input++;
+    }
+    if (!ask && change_directory(input)) {
+      free(line_buf);
+      continue;
+    }
 
-      printf(C_DIM "Thinking..." C_RESET "\r");
-      fflush(stdout);
+    if (strlen(input) > 0) {
+      CacheHit hit;
+      char *cmd;
+      GenRequest req;
+      local_request(&req);
+      double t_local = now_ms();
+      if (!ask && (run || is_shell_command(input))) {
+        memset(&hit, 0, sizeof(hit));
+        hit.local = 1;
+        hit.us = (now_ms() - t_local) * 1000;
+        cmd = strdup(input);
+      } else {
+        /* Refresh due probes; each is bounded by its own deadline */
+        probes_start();
+        probes_finish();
+
+        printf(C_DIM "Thinking..." C_RESET "\r");
+        fflush(stdout);
 
-      char *cmd = generate_command(&session, line_buf);
-      printf("             \r");
+        cmd = generate_cached(&session, &req, input, attachment, &hit);
+        printf("             \r");
+      }
 
       if (cmd) {
         if (strncmp(cmd, "ERROR:", 6) == 0) {
           printf(C_RED "%s" C_RESET "\n", cmd);
         } else {
           printf("\n" C_MAGENTA "%s" C_RESET "\n", cmd);
+          if (hit.us >= 0 || hit.fallback)
+            print_cache_hit(stdout, &hit);
           char action = prompt_action();
-          if (action == 'y')
+          if (action == 'y') {
             execute_command(cmd);
-          else if (action == 'e') {
+#ifndef _WIN32
+            if (!hit.local) /* Typed lines are in history already */
+              remember_history(cmd);
+#endif
+          } else if (action == 'e') {
             /* Open in editor logic */
             char edit_buf[4096];
             /* Copy original command to buffer */
@@ -906,6 +9786,9 @@ int main(void) {
             if (strlen(edit_buf) > 0) {
               printf(C_YELLOW "Modified command: %s" C_RESET "\n", edit_buf);
               execute_command(edit_buf);
+#ifndef _WIN32
+              remember_history(edit_buf);
+#endif
             } else {
               printf(C_YELLOW "Operation cancelled (empty command)" C_RESET
                               "\n");
@@ -915,14 +9798,23 @@ int main(void) {
         free(cmd);
       } else {
         printf(C_RED "Error generating command" C_RESET "\n");
+        if (req.error[0])
+          printf(C_RED "%s" C_RESET "\n", req.error);
+        print_history_suggestions(stdout, input);
       }
     }
 
     free(line_buf);
   }
 
+  if (attachment) {
+    attachment_free(attachment);
+    free(attachment);
+  }
+  cache_close();
   session_cleanup(&session);
 #ifndef _WIN32
+  history_truncate_file(history_path, HISTORY_MAX_LINES);
   curl_global_cleanup();
 #endif
   return 0;
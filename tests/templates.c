@@ -0,0 +1,54 @@
+/* Command template checks: make check. Builds comgen.c in and drives the
+ * templating functions directly, without the API. */
+#define main comgen_main
+#include "../comgen.c"
+#undef main
+
+static int failures;
+
+static void expect(int ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+static int canon(const char *prompt, CanonPrompt *cp) {
+  char norm[CACHE_PROMPT_MAX + 1];
+  normalize_prompt(prompt, norm, sizeof(norm));
+  return canonicalize_prompt(norm, cp);
+}
+
+int main(void) {
+  CanonPrompt a, b;
+  expect(canon("say \"error\" now", &a) == 1, "one literal in the prompt");
+  expect(canon("say \"a;touch PWNED;b\" now", &b) == 1,
+         "metacharacters are a literal");
+
+  /* The literal only occurs inside quotes: no slot may be made of it */
+  char *tmpl = templatize_command("echo 'error ok'", &a, PLAT_GNU);
+  expect(!tmpl, "no slot inside single quotes");
+  free(tmpl);
+  tmpl = templatize_command("echo \"error ok\"", &a, PLAT_GNU);
+  expect(!tmpl, "no slot inside double quotes");
+  free(tmpl);
+
+  /* A slot outside quotes renders the new value as one quoted word */
+  tmpl = templatize_command("echo error", &a, PLAT_GNU);
+  expect(tmpl != NULL, "bare literal becomes a slot");
+  char *cmd = tmpl ? render_template(tmpl, &b, PLAT_GNU) : NULL;
+  expect(cmd && strcmp(cmd, "echo 'a;touch PWNED;b'") == 0,
+         "value with metacharacters is quoted");
+  free(cmd);
+  free(tmpl);
+
+  /* A template stored before slots were checked is refused */
+  char old[] = "echo '\x1f" "0s\x1f ok'";
+  cmd = render_template(old, &b, PLAT_GNU);
+  expect(!cmd, "stored slot inside quotes is not rendered");
+  free(cmd);
+
+  if (!failures)
+    printf("templates: ok\n");
+  return failures != 0;
+}